@@ -29,6 +29,7 @@ struct analyzer {
 	struct analyzer_reg *info;
 	void *priv;
 	struct registry_instance *reg_instance;
+	struct registry_perf *perf_listener_time;
 
 	struct analyzer *prev, *next;
 
@@ -50,7 +50,8 @@
 // Our own time structure which is the time in usec
 typedef uint64_t ptime;
 #define pom_timeval_to_ptime(x) (((uint64_t) ((x).tv_sec) * 1000000UL) + (uint64_t) (x).tv_usec)
-#define pom_sec_ptime(x) ((uint64_t) (x) * 1000000UL);
+#define pom_sec_ptime(x) ((uint64_t) (x) * 1000000UL)
+#define pom_msec_ptime(x) ((uint64_t) (x) * 1000UL)
 #define pom_ptime_sec(x) (uint32_t) ((x) / 1000000UL)
 #define pom_ptime_usec(x) (uint32_t) ((x) % 1000000UL)
 
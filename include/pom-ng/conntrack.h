@@ -33,6 +33,7 @@ struct conntrack_entry {
 	struct ptype *fwd_value, *rev_value; ///< Forward and reverse value for hashing
 	struct conntrack_node_list *parent; ///< Parent conntrack
 	struct conntrack_node_list *children; ///< Children of this conntrack
+	struct conntrack_entry **children_idx; ///< Direct mapped index of unique children by proto id
 	void *priv; ///< Private data of the protocol
 	struct conntrack_priv_list *priv_list; ///< Private data coming from other objects
 	struct conntrack_timer *cleanup_timer; ///< Cleanup the conntrack when this timer is reached
@@ -41,6 +42,7 @@ struct conntrack_entry {
 	pthread_mutex_t lock; ///< Lock of the conntrack entry
 	uint32_t hash; ///< Full hash prior to modulo
 	unsigned int refcount; ///< Reference count (mostly in how many proto_stack it's referenced)
+	ptime created; ///< Time at which the conntrack was created
 };
 
 struct conntrack_node_list {
@@ -74,10 +76,10 @@ int conntrack_add_priv(struct conntrack_entry *ce, void *obj, void *priv, int (*
 void *conntrack_get_priv(struct conntrack_entry *ce, void *obj);
 void conntrack_remove_priv(struct conntrack_entry *ce, void *obj);
 
-int conntrack_delayed_cleanup(struct conntrack_entry *ce, unsigned int delay, ptime now);
+int conntrack_delayed_cleanup(struct conntrack_entry *ce, ptime delay, ptime now);
 
 struct conntrack_timer *conntrack_timer_alloc(struct conntrack_entry *ce, int (*handler) (struct conntrack_entry *ce, void *priv, ptime now), void *priv);
-int conntrack_timer_queue(struct conntrack_timer *t, unsigned int expiry, ptime now);
+int conntrack_timer_queue(struct conntrack_timer *t, ptime expiry, ptime now);
 int conntrack_timer_dequeue(struct conntrack_timer *t);
 int conntrack_timer_cleanup(struct conntrack_timer *t);
 
@@ -54,18 +54,39 @@ struct packet_multipart_pkt {
 
 };
 
+// Granularity of the gap tracking, which is the unit of IP fragment offsets
+#define PACKET_MULTIPART_BLOCK	8
+
 struct packet_multipart {
 
-	size_t cur; // Current ammount of data in the buffer
-	unsigned int gaps; // Number of gaps
+	size_t cur; // End of the data received so far
+	unsigned int gaps; // Number of blocks missing before the end of the data
 	unsigned int flags;
-	struct packet_multipart_pkt *head, *tail;
+	struct packet_multipart_pkt *head, *tail; // Parts in the order they were received
 	struct proto *proto;
 	unsigned int align_offset;
+	uint64_t *blocks; // Bitmap of the blocks whose first byte was received
+	unsigned int blocks_size; // Size of the bitmap in words
+	unsigned int blocks_set; // Number of bits set in the bitmap
+};
+
+// Returned by packet_frag_add() when the fragment was not kept
+#define PACKET_FRAG_DROPPED	1
+
+// Fragment reassembly state, part of the global fragment cache
+struct packet_frag {
+
+	struct packet_multipart *multipart; // NULL once released or evicted
+	struct conntrack_entry *ce; // Conntrack holding this state, locked while adding fragments
+	unsigned int src_bucket; // Bucket of the source address for the quotas
+	size_t size; // Bytes accounted in the cache
+	int linked;
+	struct packet_frag *lru_prev, *lru_next;
 };
 
 struct packet_info {
 	struct ptype **fields_value;
+	unsigned int refcount;
 	struct packet_info *next;
 };
 
@@ -80,6 +101,9 @@ int packet_multipart_cleanup(struct packet_multipart *m);
 int packet_multipart_add_packet(struct packet_multipart *multipart, struct packet *pkt, size_t offset, size_t len, size_t pkt_buff_offset);
 int packet_multipart_process(struct packet_multipart *multipart, struct proto_process_stack *stack, unsigned int stack_index);
 
+int packet_frag_add(struct packet_frag *f, struct conntrack_entry *ce, struct packet *pkt, size_t offset, size_t len, size_t pkt_buff_offset, void *src, size_t src_len);
+struct packet_multipart *packet_frag_release(struct packet_frag *f);
+
 struct packet_stream_parser *packet_stream_parser_alloc(size_t max_line_size, unsigned int flags);
 int packet_stream_parser_add_payload(struct packet_stream_parser *sp, void *pload, size_t len);
 // Add payload to the stream parser and use it as or own buffer (or copy then free it if we already have some stuff buffered)
@@ -94,4 +118,8 @@ int packet_stream_parser_cleanup(struct packet_stream_parser *sp);
 struct filter *packet_filter_compile(char *filter_expr);
 int packet_filter_match(struct filter *f, struct proto_process_stack *stack);
 
+// BPF filter matching the packets needed by the listeners, NULL if every packet is needed
+char *packet_bpf_filter_get(int ethernet, unsigned int *serial);
+unsigned int packet_bpf_filter_serial();
+
 #endif
@@ -25,6 +25,7 @@
 #define PLOAD_FLAG_NEED_ANALYSIS	0x02
 #define PLOAD_FLAG_IS_ERR		0x04
 #define PLOAD_FLAG_OPENED		0x08
+#define PLOAD_FLAG_INCOMPLETE		0x10 // Some bytes of the payload are missing
 
 #define PLOAD_ANALYSIS_ERR	POM_ERR		// Something went wrong
 #define PLOAD_ANALYSIS_OK	POM_OK		// All went ok
@@ -64,6 +65,7 @@ struct pload_type {
 	struct registry_instance *reg_instance;
 
 	struct registry_perf *perf_analyzed;
+	unsigned int profiler_id;
 
 
 	UT_hash_handle hh;
@@ -99,6 +101,8 @@ int pload_set_type(struct pload *p, char *type);
 int pload_set_encoding(struct pload *p, char *encoding);
 void pload_set_expected_size(struct pload *p, size_t size);
 int pload_append(struct pload *p, void *data, size_t len);
+int pload_append_gap(struct pload *p, size_t len);
+int pload_is_incomplete(struct pload *p);
 struct event *pload_get_related_event(struct pload *p);
 void pload_set_parent(struct pload* p, struct pload *parent);
 void pload_set_analyzer_priv(struct pload *p, void *priv);
@@ -33,6 +33,11 @@
 
 // The listener needs the payload of the specified protocol
 #define PROTO_PACKET_LISTENER_PLOAD_ONLY	0x2
+// The payload listener handles gaps : a NULL pload of plen missing bytes
+#define PROTO_PACKET_LISTENER_GAP		0x4
+
+// The proto handles gaps in its payload instead of zeros
+#define PROTO_REG_FLAG_GAP	0x1
 
 
 // Error code definition
@@ -71,6 +76,7 @@ struct proto_reg_info {
 	struct conntrack_info *ct_info;
 	struct proto_event_reg *events;
 	char *number_class;
+	unsigned int flags;
 
 	int (*init) (struct proto *proto, struct registry_instance *i);
 	int (*process) (void *proto_priv, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
@@ -85,6 +91,9 @@ struct proto_packet_listener {
 	void *object;
 	int (*process) (void *object, struct packet *p, struct proto_process_stack *s, unsigned int stack_index);
 	struct filter *filter;
+	struct filter_index_item *index_item;
+	struct registry_perf *perf_process_time;
+	unsigned int profiler_id;
 	struct proto_packet_listener *prev, *next;
 };
 
@@ -123,7 +132,7 @@ int proto_expectation_set_field(struct proto_expectation *e, int stack_index, st
 void proto_expectation_set_session(struct proto_expectation *e, struct conntrack_session *session);
 void proto_expectation_set_match_callback(struct proto_expectation *e, void (*match_callback) (struct proto_expectation *e, void *callback_priv, struct conntrack_entry *ce), void *callback_priv, void (*callback_priv_cleanup) (void *priv));
 
-int proto_expectation_add_and_cleanup(struct proto_expectation *e, unsigned int expiry, ptime now);
+int proto_expectation_add_and_cleanup(struct proto_expectation *e, ptime expiry, ptime now);
 int proto_expectation_add(struct proto_expectation *e);
 int proto_expectation_remove(struct proto_expectation *e);
 
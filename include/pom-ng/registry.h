@@ -37,10 +37,22 @@ struct registry_param;
 enum registry_perf_type {
 	registry_perf_type_counter,
 	registry_perf_type_gauge,
-	registry_perf_type_timeticks
+	registry_perf_type_timeticks,
+	registry_perf_type_histogram
 
 };
 
+// Histogram buckets are log-linear : 2^SUB_BITS buckets per power of two
+// Values above 2^MAX_BITS are accounted in the last bucket
+#define REGISTRY_PERF_HIST_SUB_BITS	4
+#define REGISTRY_PERF_HIST_MAX_BITS	40
+#define REGISTRY_PERF_HIST_BUCKETS	((REGISTRY_PERF_HIST_MAX_BITS - REGISTRY_PERF_HIST_SUB_BITS + 1) << REGISTRY_PERF_HIST_SUB_BITS)
+
+struct registry_perf_hist_snapshot {
+	uint64_t count, sum, max;
+	uint64_t buckets[REGISTRY_PERF_HIST_BUCKETS];
+};
+
 struct registry_param* registry_new_param(char *name, char *default_value, struct ptype *value, char *description, int flags);
 int registry_cleanup_param(struct registry_param *p);
 int registry_param_set_callbacks(struct registry_param *p, void *priv, int (*pre_check) (void *priv, struct registry_param *p, char *value), int (*post_check) (void *priv, struct registry_param *p, struct ptype *value));
@@ -56,6 +68,15 @@ void registry_perf_timeticks_restart(struct registry_perf *p);
 uint64_t registry_perf_getval(struct registry_perf *p);
 void registry_perf_reset(struct registry_perf *p);
 
+uint64_t registry_perf_hist_clock();
+void registry_perf_hist_record(struct registry_perf *p, uint64_t val);
+void registry_perf_hist_record_since(struct registry_perf *p, uint64_t start);
+uint64_t registry_perf_hist_percentile(struct registry_perf *p, double pct);
+struct registry_perf_hist_snapshot *registry_perf_hist_snapshot(struct registry_perf *p);
+void registry_perf_hist_snapshot_merge(struct registry_perf_hist_snapshot *dst, struct registry_perf_hist_snapshot *src);
+uint64_t registry_perf_hist_snapshot_percentile(struct registry_perf_hist_snapshot *s, double pct);
+void registry_perf_hist_snapshot_cleanup(struct registry_perf_hist_snapshot *s);
+
 int registry_param_info_set_min_max(struct registry_param *p, uint32_t min, uint32_t max);
 int registry_param_info_add_value(struct registry_param *p, char *value);
 
@@ -29,10 +29,14 @@
 #define STREAM_FLAG_PACKET_NO_COPY	0x1
 #define STREAM_FLAG_BIDIR		0x2
 
+// Returned by the gap handler when the gap should be filled with zeros instead
+#define STREAM_GAP_FILL			2
+
 struct proto_process_stack;
 
 struct stream* stream_alloc(uint32_t max_buff_size, struct conntrack_entry *ce, unsigned int flags, int (*handler) (struct conntrack_entry *ce, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index));
-int stream_set_timeout(struct stream *stream, unsigned int timeout);
+int stream_set_timeout(struct stream *stream, ptime timeout);
+int stream_set_gap_handler(struct stream *stream, int (*gap_handler) (struct conntrack_entry *ce, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index));
 int stream_increase_seq(struct stream *stream, unsigned int direction, uint32_t inc);
 int stream_set_start_seq(struct stream *stream, unsigned int direction, uint32_t seq);
 int stream_cleanup(struct stream *stream);
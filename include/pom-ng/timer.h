@@ -29,8 +29,8 @@
 
 struct timer *timer_alloc(void* priv, int (*handler) (void*, ptime));
 int timer_cleanup(struct timer *t);
-int timer_queue(struct timer *t, unsigned int expiry);
-int timer_queue_now(struct timer *t, unsigned int expiry, ptime now);
+int timer_queue(struct timer *t, ptime expiry);
+int timer_queue_now(struct timer *t, ptime expiry, ptime now);
 int timer_dequeue(struct timer *t);
 
 struct timer_sys* timer_sys_alloc(void *priv, int (*handler) (void*));
@@ -59,6 +59,13 @@ int analyzer_register(struct analyzer_reg *reg_info) {
 		return POM_ERR;
 	}
 
+	analyzer->perf_listener_time = registry_instance_add_perf(analyzer->reg_instance, "listener_time", registry_perf_type_histogram, "Time spent in the analyzer listeners", "ns");
+	if (!analyzer->perf_listener_time) {
+		registry_remove_instance(analyzer->reg_instance);
+		free(analyzer);
+		return POM_ERR;
+	}
+
 	if (reg_info->init) {
 		if (reg_info->init(analyzer) != POM_OK) {
 			registry_remove_instance(analyzer->reg_instance);
@@ -80,6 +87,30 @@ int analyzer_register(struct analyzer_reg *reg_info) {
 	return POM_OK;
 }
 
+static struct analyzer *analyzer_find_listener_owner(void *obj) {
+
+	// Analyzers register their listeners with either themselves or their private data
+	struct analyzer *tmp;
+	for (tmp = analyzer_head; tmp; tmp = tmp->next) {
+		if (obj == tmp || (tmp->priv && obj == tmp->priv))
+			return tmp;
+	}
+
+	return NULL;
+}
+
+struct registry_perf *analyzer_get_listener_perf(void *obj) {
+
+	struct analyzer *a = analyzer_find_listener_owner(obj);
+	return (a ? a->perf_listener_time : NULL);
+}
+
+char *analyzer_get_listener_name(void *obj) {
+
+	struct analyzer *a = analyzer_find_listener_owner(obj);
+	return (a ? a->info->name : NULL);
+}
+
 int analyzer_unregister(char *name) {
 
 	struct analyzer *tmp;
@@ -29,5 +29,7 @@
 int analyzer_init();
 int analyzer_cleanup();
 int analyzer_finish();
+struct registry_perf *analyzer_get_listener_perf(void *obj);
+char *analyzer_get_listener_name(void *obj);
 
 #endif
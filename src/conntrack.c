@@ -26,6 +26,7 @@
 #include "core.h"
 
 #include <pthread.h>
+#include <fcntl.h>
 #include <pom-ng/timer.h>
 
 //#define DEBUG_CONNTRACK
@@ -36,6 +37,58 @@
 #define debug_conntrack(x ...)
 #endif
 
+static struct conntrack_stat_perf {
+	char *name;
+	char *description;
+	char *unit;
+} conntrack_stat_perfs[conntrack_stat_tot] = {
+	{ "conn_hash_load", "Load factor of the conntrack hash table", "%" },
+	{ "conn_hash_chain_max", "Length of the longest conntrack hash chain", "connections" },
+	{ "conn_hash_chain_0", "Number of empty conntrack hash buckets", "buckets" },
+	{ "conn_hash_chain_1", "Number of conntrack hash buckets with 1 entry", "buckets" },
+	{ "conn_hash_chain_2_3", "Number of conntrack hash buckets with 2 to 3 entries", "buckets" },
+	{ "conn_hash_chain_4_7", "Number of conntrack hash buckets with 4 to 7 entries", "buckets" },
+	{ "conn_hash_chain_8_more", "Number of conntrack hash buckets with 8 entries or more", "buckets" },
+	{ "conn_age_10s", "Number of connections created less than 10 seconds ago", "connections" },
+	{ "conn_age_60s", "Number of connections created between 10 and 60 seconds ago", "connections" },
+	{ "conn_age_600s", "Number of connections created between 60 and 600 seconds ago", "connections" },
+	{ "conn_age_more", "Number of connections created more than 600 seconds ago", "connections" },
+	{ "conn_with_children", "Number of connections with child connections", "connections" },
+	{ "conn_in_use", "Number of connections currently referenced by a packet", "connections" },
+	{ "conn_expiring", "Number of connections with a pending cleanup timer", "connections" },
+};
+
+static uint32_t conntrack_hash_seeded(struct ptype *a, struct ptype *b, void *parent);
+static uint32_t conntrack_hash_jhash(struct ptype *a, struct ptype *b, void *parent);
+
+struct conntrack_hash_func conntrack_hash_funcs[] = {
+	{ "seeded", conntrack_hash_seeded },
+	{ "jhash", conntrack_hash_jhash },
+	{ 0 }
+};
+
+static uint32_t (*conntrack_hash_func) (struct ptype *a, struct ptype *b, void *parent) = conntrack_hash_seeded;
+static uint64_t conntrack_hash_seed = 0;
+
+static void conntrack_table_lock(struct conntrack_tables *ct, uint32_t hash) {
+
+	int res = pthread_mutex_trylock(&ct->locks[hash]);
+	if (!res)
+		return;
+
+	if (res != EBUSY) {
+		pomlog(POMLOG_ERR "Error while locking conntrack hash lock : %s", pom_strerror(res));
+		abort();
+	}
+
+	// The lock is contended, account for the time spent waiting
+	ptime start = pom_gettimeofday();
+	pom_mutex_lock(&ct->locks[hash]);
+
+	if (ct->perf_lock_wait)
+		registry_perf_inc(ct->perf_lock_wait, pom_gettimeofday() - start);
+}
+
 struct conntrack_tables* conntrack_table_alloc(size_t table_size, int has_rev) {
 
 	struct conntrack_tables *ct = malloc(sizeof(struct conntrack_tables));
@@ -45,6 +98,12 @@ struct conntrack_tables* conntrack_table_alloc(size_t table_size, int has_rev) {
 	}
 	memset(ct, 0, sizeof(struct conntrack_tables));
 
+	int res = pthread_mutex_init(&ct->stats_lock, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Could not initialize conntrack stats lock : %s", pom_strerror(res));
+		free(ct);
+		return NULL;
+	}
 
 	size_t size = sizeof(struct conntrack_list) * table_size;
 	ct->table = malloc(size);
@@ -65,7 +124,7 @@ struct conntrack_tables* conntrack_table_alloc(size_t table_size, int has_rev) {
 	unsigned int i;
 
 	for (i = 0; i < table_size; i++) {
-		int res = pthread_mutex_init(&ct->locks[i], NULL);
+		res = pthread_mutex_init(&ct->locks[i], NULL);
 		if (res) {
 			pomlog(POMLOG_ERR "Could not initialize conntrack hash lock : %s", pom_strerror(res));
 			goto err;
@@ -119,6 +178,7 @@ int conntrack_table_cleanup(struct conntrack_tables *ct) {
 		free(ct->locks);
 	}
 
+	pthread_mutex_destroy(&ct->stats_lock);
 
 	free(ct);
 
@@ -126,7 +186,276 @@ int conntrack_table_cleanup(struct conntrack_tables *ct) {
 }
 
 
-uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent) {
+static void conntrack_table_stats_update(struct conntrack_tables *ct) {
+
+	uint64_t stats[conntrack_stat_tot] = { 0 };
+	uint64_t entries = 0;
+	ptime now = core_get_clock_last();
+
+	unsigned int i;
+	for (i = 0; i < ct->table_size; i++) {
+
+		uint64_t len = 0;
+
+		conntrack_table_lock(ct, i);
+		struct conntrack_list *lst;
+		for (lst = ct->table[i]; lst; lst = lst->next) {
+			struct conntrack_entry *ce = lst->ce;
+			len++;
+
+			ptime age = (now > ce->created ? now - ce->created : 0);
+			if (age < (10 * 1000000UL))
+				stats[conntrack_stat_age_10s]++;
+			else if (age < (60 * 1000000UL))
+				stats[conntrack_stat_age_60s]++;
+			else if (age < (600 * 1000000UL))
+				stats[conntrack_stat_age_600s]++;
+			else
+				stats[conntrack_stat_age_more]++;
+
+			if (ce->children)
+				stats[conntrack_stat_with_children]++;
+			if (ce->refcount)
+				stats[conntrack_stat_in_use]++;
+			if (ce->cleanup_timer && ce->cleanup_timer != (void *) -1)
+				stats[conntrack_stat_expiring]++;
+		}
+		pom_mutex_unlock(&ct->locks[i]);
+
+		entries += len;
+
+		if (len > stats[conntrack_stat_chain_max])
+			stats[conntrack_stat_chain_max] = len;
+
+		if (!len)
+			stats[conntrack_stat_chain_0]++;
+		else if (len == 1)
+			stats[conntrack_stat_chain_1]++;
+		else if (len < 4)
+			stats[conntrack_stat_chain_2_3]++;
+		else if (len < 8)
+			stats[conntrack_stat_chain_4_7]++;
+		else
+			stats[conntrack_stat_chain_8_more]++;
+	}
+
+	if (ct->table_size)
+		stats[conntrack_stat_load] = (entries * 100) / ct->table_size;
+
+	memcpy(ct->stats, stats, sizeof(ct->stats));
+}
+
+static int conntrack_table_stats_perf_update(uint64_t *cur_val, void *priv) {
+
+	struct conntrack_stats_hook *hook = priv;
+	struct conntrack_tables *ct = hook->ct;
+
+	pom_mutex_lock(&ct->stats_lock);
+
+	// All the stats perfs are read together, only scan the table once in a while
+	ptime now = pom_gettimeofday();
+	if (now - ct->stats_ts >= CONNTRACK_STATS_INTERVAL) {
+		conntrack_table_stats_update(ct);
+		ct->stats_ts = now;
+	}
+
+	*cur_val = ct->stats[hook->id];
+
+	pom_mutex_unlock(&ct->stats_lock);
+
+	return POM_OK;
+}
+
+static int conntrack_table_dump_buckets(struct registry_instance *i) {
+
+	struct proto *proto = i->priv;
+	struct conntrack_tables *ct = proto->ct;
+
+	uint32_t top_hash[CONNTRACK_DUMP_TOP_BUCKETS] = { 0 };
+	unsigned int top_len[CONNTRACK_DUMP_TOP_BUCKETS] = { 0 };
+
+	// Find the longest buckets
+	uint32_t hash;
+	for (hash = 0; hash < ct->table_size; hash++) {
+
+		unsigned int len = 0;
+		conntrack_table_lock(ct, hash);
+		struct conntrack_list *lst;
+		for (lst = ct->table[hash]; lst; lst = lst->next)
+			len++;
+		pom_mutex_unlock(&ct->locks[hash]);
+
+		if (!len || len <= top_len[CONNTRACK_DUMP_TOP_BUCKETS - 1])
+			continue;
+
+		int j;
+		for (j = CONNTRACK_DUMP_TOP_BUCKETS - 1; j > 0 && top_len[j - 1] < len; j--) {
+			top_len[j] = top_len[j - 1];
+			top_hash[j] = top_hash[j - 1];
+		}
+		top_len[j] = len;
+		top_hash[j] = hash;
+	}
+
+	pomlog(POMLOG_INFO "Longest conntrack buckets for proto %s (table size %zu) :", proto->info->name, ct->table_size);
+
+	int j;
+	for (j = 0; j < CONNTRACK_DUMP_TOP_BUCKETS && top_len[j]; j++) {
+
+		hash = top_hash[j];
+		pomlog(POMLOG_INFO "Bucket %u : %u entries", hash, top_len[j]);
+
+		conntrack_table_lock(ct, hash);
+		struct conntrack_list *lst;
+		unsigned int k;
+		for (lst = ct->table[hash], k = 0; lst && k < CONNTRACK_DUMP_BUCKET_ENTRIES; lst = lst->next, k++) {
+			struct conntrack_entry *ce = lst->ce;
+			char fwd[64] = { 0 }, rev[64] = { 0 };
+			if (ce->fwd_value)
+				ptype_print_val(ce->fwd_value, fwd, sizeof(fwd) - 1, NULL);
+			if (ce->rev_value)
+				ptype_print_val(ce->rev_value, rev, sizeof(rev) - 1, NULL);
+			pomlog(POMLOG_INFO "  conntrack %p : %s <-> %s, parent %p", ce, fwd, rev, (ce->parent ? ce->parent->ce : NULL));
+		}
+		pom_mutex_unlock(&ct->locks[hash]);
+	}
+
+	return POM_OK;
+}
+
+int conntrack_table_register_stats(struct proto *proto) {
+
+	struct conntrack_tables *ct = proto->ct;
+	struct registry_instance *inst = proto->reg_instance;
+
+	ct->perf_lock_wait = registry_instance_add_perf(inst, "conn_lock_wait", registry_perf_type_counter, "Time spent waiting for conntrack hash locks", "usec");
+	if (!ct->perf_lock_wait)
+		return POM_ERR;
+
+	unsigned int i;
+	for (i = 0; i < conntrack_stat_tot; i++) {
+		struct registry_perf *perf = registry_instance_add_perf(inst, conntrack_stat_perfs[i].name, registry_perf_type_gauge, conntrack_stat_perfs[i].description, conntrack_stat_perfs[i].unit);
+		if (!perf)
+			return POM_ERR;
+
+		ct->stats_hooks[i].ct = ct;
+		ct->stats_hooks[i].id = i;
+		registry_perf_set_update_hook(perf, conntrack_table_stats_perf_update, &ct->stats_hooks[i]);
+	}
+
+	return registry_instance_add_function(inst, "dump_conntrack_buckets", conntrack_table_dump_buckets, "Log the longest conntrack hash buckets and their entries");
+}
+
+int conntrack_hash_init() {
+
+	// Use a random seed so that the hash cannot be predicted from the traffic
+	uint64_t seed = 0;
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd != -1) {
+		if (pom_read(fd, &seed, sizeof(seed)) != POM_OK)
+			seed = 0;
+		close(fd);
+	}
+
+	if (!seed) {
+		pomlog(POMLOG_WARN "Unable to read a random seed for the conntrack hash, falling back to a time based seed");
+		seed = pom_gettimeofday() ^ ((uint64_t) getpid() << 32) ^ (uint64_t) &seed;
+	}
+
+	conntrack_hash_seed = seed;
+
+	return POM_OK;
+}
+
+int conntrack_hash_set_func(char *name) {
+
+	int i;
+	for (i = 0; conntrack_hash_funcs[i].name && strcmp(conntrack_hash_funcs[i].name, name); i++);
+
+	if (!conntrack_hash_funcs[i].name) {
+		pomlog(POMLOG_ERR "Unknown conntrack hash function %s", name);
+		return POM_ERR;
+	}
+
+	conntrack_hash_func = conntrack_hash_funcs[i].hash;
+
+	return POM_OK;
+}
+
+static inline uint64_t conntrack_hash_mum(uint64_t a, uint64_t b) {
+
+	// Multiply and fold the high bits back into the low ones
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t) a * b;
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+	uint64_t hi = (a >> 32) * (b >> 32), lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+	uint64_t mid = (a >> 32) * (b & 0xFFFFFFFF) + (a & 0xFFFFFFFF) * (b >> 32);
+	return (lo + (mid << 32)) ^ (hi + (mid >> 32));
+#endif
+}
+
+static inline uint64_t conntrack_hash_read64(unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t conntrack_hash_value(struct ptype *v, uint64_t seed) {
+
+	unsigned char *p = v->value;
+	size_t size = ptype_get_value_size(v);
+
+	seed ^= CONNTRACK_HASH_K0 * size;
+
+	if (size == 2 * sizeof(uint64_t)) {
+		// IPv6 addresses, process both halves in independent lanes
+		uint64_t lane0 = conntrack_hash_read64(p) ^ CONNTRACK_HASH_K1;
+		uint64_t lane1 = conntrack_hash_read64(p + sizeof(uint64_t)) ^ CONNTRACK_HASH_K2;
+		return conntrack_hash_mum(lane0 ^ seed, lane1 ^ (seed >> 32 | seed << 32));
+	}
+
+	uint64_t h = seed;
+	while (size >= sizeof(uint64_t)) {
+		h = conntrack_hash_mum(conntrack_hash_read64(p) ^ CONNTRACK_HASH_K1, h ^ CONNTRACK_HASH_K2);
+		p += sizeof(uint64_t);
+		size -= sizeof(uint64_t);
+	}
+
+	if (size) {
+		uint64_t last = 0;
+		memcpy(&last, p, size);
+		h = conntrack_hash_mum(last ^ CONNTRACK_HASH_K1, h ^ CONNTRACK_HASH_K2);
+	}
+
+	return h;
+}
+
+static uint32_t conntrack_hash_seeded(struct ptype *a, struct ptype *b, void *parent) {
+
+	if (!a)
+		return POM_ERR;
+
+	uint64_t seed = conntrack_hash_seed ^ conntrack_hash_mum((uint64_t) (uintptr_t) parent ^ CONNTRACK_HASH_K0, CONNTRACK_HASH_K3);
+
+	uint64_t hash_a = conntrack_hash_value(a, seed);
+
+	if (!b)
+		return (uint32_t) conntrack_hash_mum(hash_a ^ CONNTRACK_HASH_K1, seed ^ CONNTRACK_HASH_K3);
+
+	// Order both values so that the hash is the same in both directions
+	uint64_t hash_b = conntrack_hash_value(b, seed);
+	uint64_t lo = hash_a, hi = hash_b;
+	if (lo > hi) {
+		lo = hash_b;
+		hi = hash_a;
+	}
+
+	uint64_t res = conntrack_hash_mum(lo ^ CONNTRACK_HASH_K1, hi ^ CONNTRACK_HASH_K2);
+	return (uint32_t) (res ^ (res >> 32));
+}
+
+static uint32_t conntrack_hash_jhash(struct ptype *a, struct ptype *b, void *parent) {
 
 	// Create a reversible hash for a and b
 	if (!a)
@@ -169,6 +498,12 @@ uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent) {
 }
 
 
+uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent) {
+
+	return conntrack_hash_func(a, b, parent);
+}
+
+
 struct conntrack_entry *conntrack_find(struct conntrack_list *lst, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent) {
 
 	if (!fwd_value)
@@ -229,7 +564,7 @@ int conntrack_get_unique(struct proto_process_stack *stack, unsigned int stack_i
 	}
 
 	struct conntrack_tables *ct = s->proto->ct;
-	pom_mutex_lock(&ct->locks[0]);
+	conntrack_table_lock(ct, 0);
 
 	struct conntrack_list *lst = ct->table[0];
 
@@ -251,6 +586,7 @@ int conntrack_get_unique(struct proto_process_stack *stack, unsigned int stack_i
 
 		memset(res, 0, sizeof(struct conntrack_entry));
 		res->proto = s->proto;
+		res->created = core_get_clock_last();
 
 		if (pom_mutex_init_type(&res->lock, PTHREAD_MUTEX_ERRORCHECK) != POM_OK) {
 			pom_mutex_unlock(&ct->locks[0]);
@@ -329,17 +665,37 @@ int conntrack_get_unique_from_parent(struct proto_process_stack *stack, unsigned
 	struct conntrack_tables *ct = s->proto->ct;
 	struct conntrack_entry *res = NULL;
 
-	// Look for the conntrack
-	
-	if (parent->children) {
+	// Look for the conntrack in the index first
+	unsigned int idx = CONNTRACK_CHILDREN_IDX(s->proto);
+	if (parent->children_idx) {
+		res = parent->children_idx[idx];
+		if (res && res->proto != s->proto)
+			res = NULL;
+	}
+
+	// Fallback on the children list in case another proto uses the same slot
+	if (!res && parent->children) {
 		struct conntrack_node_list *child = parent->children;
 		for (child = parent->children; child && child->ce->proto != s->proto; child = child->next);
-		if (child)
+		if (child) {
 			res = child->ce;
+			if (parent->children_idx && !parent->children_idx[idx])
+				parent->children_idx[idx] = res;
+		}
 	} 
 
 	if (!res) {
 
+		if (!parent->children_idx) {
+			size_t size = sizeof(struct conntrack_entry *) * CONNTRACK_CHILDREN_IDX_SIZE;
+			parent->children_idx = malloc(size);
+			if (!parent->children_idx) {
+				pom_oom(size);
+				goto err;
+			}
+			memset(parent->children_idx, 0, size);
+		}
+
 		// Alloc the conntrack
 		res = malloc(sizeof(struct conntrack_entry));
 		if (!res) {
@@ -349,6 +705,7 @@ int conntrack_get_unique_from_parent(struct proto_process_stack *stack, unsigned
 
 		memset(res, 0, sizeof(struct conntrack_entry));
 		res->proto = s->proto;
+		res->created = core_get_clock_last();
 
 		if (pom_mutex_init_type(&res->lock, PTHREAD_MUTEX_ERRORCHECK) != POM_OK)
 			goto err;
@@ -388,8 +745,11 @@ int conntrack_get_unique_from_parent(struct proto_process_stack *stack, unsigned
 			child->next->prev = child;
 		parent->children = child;
 
+		if (!parent->children_idx[idx])
+			parent->children_idx[idx] = res;
+
 		// Add the conntrack to the table
-		pom_mutex_lock(&ct->locks[0]);
+		conntrack_table_lock(ct, 0);
 		lst->next = ct->table[0];
 		if (lst->next)
 			lst->next->prev = lst;
@@ -457,7 +817,7 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 	uint32_t hash = conntrack_hash(fwd_value, rev_value, s_prev->ce) % ct->table_size;
 
 	// Lock the specific hash while browsing for a conntrack
-	pom_mutex_lock(&ct->locks[hash]);
+	conntrack_table_lock(ct, hash);
 
 	// Try to find the conntrack in the forward table
 
@@ -561,6 +921,7 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 	}
 
 	ce->proto = s->proto;
+	ce->created = core_get_clock_last();
 
 	ce->hash = hash;
 
@@ -717,7 +1078,7 @@ void conntrack_remove_priv(struct conntrack_entry *ce, void *obj) {
 		
 }
 
-int conntrack_delayed_cleanup(struct conntrack_entry *ce, unsigned int delay, ptime now) {
+int conntrack_delayed_cleanup(struct conntrack_entry *ce, ptime delay, ptime now) {
 
 	if (!delay) {
 		if (ce->cleanup_timer && ce->cleanup_timer != (void*)-1) {
@@ -770,7 +1131,7 @@ int conntrack_timed_cleanup(void *timer, ptime now) {
 int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntrack_entry *ce) {
 
 	// Remove the conntrack from the conntrack table
-	pom_mutex_lock(&ct->locks[hash]);
+	conntrack_table_lock(ct, hash);
 
 	// Try to find the conntrack in the list
 	struct conntrack_list *lst = NULL;
@@ -786,7 +1147,7 @@ int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntra
 	conntrack_lock(ce);
 	if (ce->refcount) {
 		debug_conntrack(POMLOG_ERR "Conntrack %p is still being referenced : %u !", ce, ce->refcount);
-		conntrack_delayed_cleanup(ce, 1, core_get_clock_last());
+		conntrack_delayed_cleanup(ce, pom_sec_ptime(1), core_get_clock_last());
 		conntrack_unlock(ce);
 		pom_mutex_unlock(&ct->locks[hash]);
 		return POM_OK;
@@ -825,7 +1186,7 @@ int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntra
 		
 		// Make sure the parent still exists
 		uint32_t hash = ce->parent->hash;
-		pom_mutex_lock(&ce->parent->ct->locks[hash]);
+		conntrack_table_lock(ce->parent->ct, hash);
 		
 		for (lst = ce->parent->ct->table[hash]; lst && lst->ce != ce->parent->ce; lst = lst->next);
 
@@ -836,6 +1197,12 @@ int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntra
 
 			for (; tmp && tmp->ce != ce; tmp = tmp->next);
 
+			if (ce->parent->ce->children_idx) {
+				unsigned int idx = CONNTRACK_CHILDREN_IDX(ce->proto);
+				if (ce->parent->ce->children_idx[idx] == ce)
+					ce->parent->ce->children_idx[idx] = NULL;
+			}
+
 			if (tmp) {
 				if (tmp->prev)
 					tmp->prev->next = tmp->next;
@@ -851,7 +1218,7 @@ int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntra
 			}
 
 			if (!ce->parent->ce->children) // Parent has no child anymore, clean it up after some time
-				conntrack_delayed_cleanup(ce->parent->ce, CONNTRACK_CHILDLESS_TIMEOUT, core_get_clock_last());
+				conntrack_delayed_cleanup(ce->parent->ce, pom_sec_ptime(CONNTRACK_CHILDLESS_TIMEOUT), core_get_clock_last());
 
 			conntrack_unlock(ce->parent->ce);
 		} else {
@@ -897,6 +1264,8 @@ int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntra
 		free(child);
 	}
 
+	if (ce->children_idx)
+		free(ce->children_idx);
 	
 	if (ce->fwd_value)
 		ptype_cleanup(ce->fwd_value);
@@ -941,7 +1310,7 @@ struct conntrack_timer *conntrack_timer_alloc(struct conntrack_entry *ce, int (*
 	return t;
 }
 
-int conntrack_timer_queue(struct conntrack_timer *t, unsigned int expiry, ptime now) {
+int conntrack_timer_queue(struct conntrack_timer *t, ptime expiry, ptime now) {
 	return timer_queue_now(t->timer, expiry, now);
 }
 
@@ -976,7 +1345,7 @@ int conntrack_timer_process(void *priv, ptime now) {
 	struct conntrack_tables *ct = t->proto->ct;
 
 	// Lock the main table
-	pom_mutex_lock(&ct->locks[t->hash]);
+	conntrack_table_lock(ct, t->hash);
 
 	// Check if the conntrack still exists
 
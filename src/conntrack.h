@@ -27,10 +27,68 @@
 
 #define CONNTRACK_CHILDLESS_TIMEOUT	10
 
+// Size of the unique children index, must be a power of 2
+#define CONNTRACK_CHILDREN_IDX_SIZE	8
+#define CONNTRACK_CHILDREN_IDX(proto)	((proto)->id & (CONNTRACK_CHILDREN_IDX_SIZE - 1))
+
+// Minimum interval between two scans of the table for the stats perfs
+#define CONNTRACK_STATS_INTERVAL	1000000UL
+
+// Number of buckets and entries per bucket logged by the dump function
+#define CONNTRACK_DUMP_TOP_BUCKETS	10
+#define CONNTRACK_DUMP_BUCKET_ENTRIES	8
+
+// Default conntrack hash function
+#define CONNTRACK_HASH_DEFAULT		"seeded"
+
+// Odd constants used by the seeded hash
+#define CONNTRACK_HASH_K0		0xa0761d6478bd642fULL
+#define CONNTRACK_HASH_K1		0xe7037ed1a0b428dbULL
+#define CONNTRACK_HASH_K2		0x8ebc6af09c88c6e3ULL
+#define CONNTRACK_HASH_K3		0x589965cc75374cc3ULL
+
+struct conntrack_hash_func {
+	char *name;
+	uint32_t (*hash) (struct ptype *a, struct ptype *b, void *parent);
+};
+
+extern struct conntrack_hash_func conntrack_hash_funcs[];
+
+enum conntrack_stat {
+	conntrack_stat_load = 0,
+	conntrack_stat_chain_max,
+	conntrack_stat_chain_0,
+	conntrack_stat_chain_1,
+	conntrack_stat_chain_2_3,
+	conntrack_stat_chain_4_7,
+	conntrack_stat_chain_8_more,
+	conntrack_stat_age_10s,
+	conntrack_stat_age_60s,
+	conntrack_stat_age_600s,
+	conntrack_stat_age_more,
+	conntrack_stat_with_children,
+	conntrack_stat_in_use,
+	conntrack_stat_expiring,
+	conntrack_stat_tot
+};
+
+struct conntrack_stats_hook {
+	struct conntrack_tables *ct;
+	enum conntrack_stat id;
+};
+
 struct conntrack_tables {
 	struct conntrack_list **table;
 	pthread_mutex_t *locks;
 	size_t table_size;
+
+	struct registry_perf *perf_lock_wait;
+
+	// Snapshot of the table stats, refreshed by the perf update hooks
+	pthread_mutex_t stats_lock;
+	ptime stats_ts;
+	uint64_t stats[conntrack_stat_tot];
+	struct conntrack_stats_hook stats_hooks[conntrack_stat_tot];
 };
 
 struct conntrack_session {
@@ -63,6 +121,9 @@ struct conntrack_timer {
 struct conntrack_tables* conntrack_table_alloc(size_t table_size, int has_rev);
 int conntrack_table_empty(struct conntrack_tables *ct);
 int conntrack_table_cleanup(struct conntrack_tables *ct);
+int conntrack_table_register_stats(struct proto *proto);
+int conntrack_hash_init();
+int conntrack_hash_set_func(char *name);
 uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent);
 struct conntrack_entry *conntrack_find(struct conntrack_list *lst, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent);
 int conntrack_timed_cleanup(void *timer, ptime now);
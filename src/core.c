@@ -31,9 +31,11 @@
 #include "analyzer.h"
 #include "dns.h"
 #include "pload.h"
+#include "profiler.h"
 
 #include <pom-ng/ptype_bool.h>
 #include <pom-ng/ptype_string.h>
+#include <pom-ng/ptype_uint32.h>
 
 #if 0
 #define debug_core(x ...) pomlog(POMLOG_DEBUG x)
@@ -59,17 +61,54 @@ static pthread_cond_t core_pkt_queue_wait_cond = PTHREAD_COND_INITIALIZER;
 static volatile ptime core_clock[CORE_PROCESS_THREAD_MAX] = { 0 };
 
 static struct registry_class *core_registry_class = NULL;
-static struct ptype *core_param_dump_pkt = NULL, *core_param_offline_dns = NULL, *core_param_reset_perf_on_restart = NULL, *core_param_http_admin_password = NULL;
+static struct ptype *core_param_dump_pkt = NULL, *core_param_offline_dns = NULL, *core_param_reset_perf_on_restart = NULL, *core_param_http_admin_password = NULL, *core_param_conntrack_hash = NULL, *core_param_stream_buffer = NULL, *core_param_frag_buffer = NULL, *core_param_frag_source_quota = NULL, *core_param_profiling = NULL, *core_param_latency_histograms = NULL;
 
 // Perf objects
 struct registry_perf *perf_pkt_queue = NULL;
 struct registry_perf *perf_thread_active = NULL;
 struct registry_perf *perf_pkt_dropped = NULL;
+struct registry_perf *perf_pkt_queue_wait = NULL;
 
 
+static int core_param_conntrack_hash_check(void *priv, struct registry_param *p, char *value) {
+
+	if (core_get_state() != core_state_idle) {
+		pomlog(POMLOG_ERR "Parameter %s cannot be changed while the core is running", p->name);
+		return POM_ERR;
+	}
+
+	int i;
+	for (i = 0; conntrack_hash_funcs[i].name && strcmp(conntrack_hash_funcs[i].name, value); i++);
+
+	if (!conntrack_hash_funcs[i].name) {
+		pomlog(POMLOG_ERR "Unknown conntrack hash function %s", value);
+		return POM_ERR;
+	}
+
+	return POM_OK;
+}
+
+static int core_param_conntrack_hash_update(void *priv, struct registry_param *p, struct ptype *value) {
+
+	return conntrack_hash_set_func(PTYPE_STRING_GETVAL(value));
+}
+
+static int core_param_profiling_update(void *priv, struct registry_param *p, struct ptype *value) {
+
+	profiler_set_enabled(*PTYPE_BOOL_GETVAL(value));
+	return POM_OK;
+}
+
+static int core_param_latency_histograms_update(void *priv, struct registry_param *p, struct ptype *value) {
+
+	registry_perf_hist_set_enabled(*PTYPE_BOOL_GETVAL(value));
+	return POM_OK;
+}
+
 int core_init(unsigned int num_threads) {
 
 	struct registry_param *param = NULL;
+	unsigned int i;
 
 	core_registry_class = registry_add_class(CORE_REGISTRY);
 	if (!core_registry_class)
@@ -78,8 +117,9 @@ int core_init(unsigned int num_threads) {
 	perf_pkt_queue = registry_class_add_perf(core_registry_class, "pkt_queue", registry_perf_type_gauge, "Number of packets in the queue waiting to be processed", "pkts");
 	perf_thread_active = registry_class_add_perf(core_registry_class, "active_thread", registry_perf_type_gauge, "Number of active threads", "threads");
 	perf_pkt_dropped = registry_class_add_perf(core_registry_class, "dropped_pkt", registry_perf_type_counter, "Number of packets dropped from the inputs", "pkts");
+	perf_pkt_queue_wait = registry_class_add_perf(core_registry_class, "pkt_queue_wait", registry_perf_type_histogram, "Time spent by the packets in the queue before being processed", "ns");
 
-	if (!perf_pkt_queue || !perf_thread_active || !perf_pkt_dropped)
+	if (!perf_pkt_queue || !perf_thread_active || !perf_pkt_dropped || !perf_pkt_queue_wait)
 		return POM_ERR;
 
 	core_param_dump_pkt = ptype_alloc("bool");
@@ -98,6 +138,10 @@ int core_init(unsigned int num_threads) {
 	if (!core_param_http_admin_password)
 		goto err;
 
+	core_param_conntrack_hash = ptype_alloc("string");
+	if (!core_param_conntrack_hash)
+		goto err;
+
 	param = registry_new_param("dump_pkt", "no", core_param_dump_pkt, "Dump packets to logs", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
 	if (registry_class_add_param(core_registry_class, param) != POM_OK)
 		goto err;
@@ -110,9 +154,64 @@ int core_init(unsigned int num_threads) {
 	if (registry_class_add_param(core_registry_class, param) != POM_OK)
 		goto err;
 
+	core_param_profiling = ptype_alloc("bool");
+	if (!core_param_profiling)
+		goto err;
+
+	param = registry_new_param("profiling", "no", core_param_profiling, "Account the CPU cycles spent in each protocol, listener and payload analyzer", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (!param)
+		goto err;
+	registry_param_set_callbacks(param, NULL, NULL, core_param_profiling_update);
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
+
+	core_param_latency_histograms = ptype_alloc("bool");
+	if (!core_param_latency_histograms)
+		goto err;
+
+	param = registry_new_param("latency_histograms", "no", core_param_latency_histograms, "Record the latency histograms of the protocols, listeners and packet queues", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (!param)
+		goto err;
+	registry_param_set_callbacks(param, NULL, NULL, core_param_latency_histograms_update);
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
+
 	param = registry_new_param("http_admin_password", "", core_param_http_admin_password, "HTTP password for the user admin", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
 	if (registry_class_add_param(core_registry_class, param) != POM_OK)
 		goto err;
+
+	core_param_stream_buffer = ptype_alloc_unit("uint32", "MB");
+	if (!core_param_stream_buffer)
+		goto err;
+
+	param = registry_new_param("stream_buffer", "512", core_param_stream_buffer, "Maximum amount of memory used by all the streams to buffer out of order packets, 0 for no limit", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
+
+	core_param_frag_buffer = ptype_alloc_unit("uint32", "MB");
+	if (!core_param_frag_buffer)
+		goto err;
+
+	param = registry_new_param("fragment_buffer", "64", core_param_frag_buffer, "Maximum amount of memory used to reassemble fragmented packets, 0 for no limit", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
+
+	core_param_frag_source_quota = ptype_alloc_unit("uint32", "KB");
+	if (!core_param_frag_source_quota)
+		goto err;
+
+	param = registry_new_param("fragment_source_quota", "8192", core_param_frag_source_quota, "Maximum amount of memory used to reassemble the fragments sent by a single address, 0 for no limit", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
+
+	param = registry_new_param("conntrack_hash", CONNTRACK_HASH_DEFAULT, core_param_conntrack_hash, "Hash function used for the conntrack tables", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	for (i = 0; conntrack_hash_funcs[i].name; i++) {
+		if (registry_param_info_add_value(param, conntrack_hash_funcs[i].name) != POM_OK)
+			goto err;
+	}
+	registry_param_set_callbacks(param, NULL, core_param_conntrack_hash_check, core_param_conntrack_hash_update);
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
 	
 	param = NULL;
 
@@ -142,8 +241,6 @@ int core_init(unsigned int num_threads) {
 
 	memset(core_processing_threads, 0, sizeof(struct core_processing_thread*) * CORE_PROCESS_THREAD_MAX);
 
-	unsigned int i;
-
 	for (i = 0; i < core_num_threads; i++) {
 		struct core_processing_thread *tmp = malloc(sizeof(struct core_processing_thread));
 		if (!tmp) {
@@ -239,6 +336,8 @@ int core_cleanup(int emergency_cleanup) {
 		free(t);
 	}
 
+	profiler_cleanup();
+
 	return POM_OK;
 }
 
@@ -341,6 +440,7 @@ int core_queue_packet(struct packet *p, unsigned int flags, unsigned int thread_
 	}
 
 	tmp->pkt = p;
+	tmp->queued = registry_perf_hist_clock();
 	tmp->next = NULL;
 	if (t->pkt_queue_tail) {
 		t->pkt_queue_tail->next = tmp;
@@ -375,6 +475,8 @@ void *core_processing_thread_func(void *priv) {
 
 	struct core_processing_thread *tpriv = priv;
 
+	timers_thread_init(tpriv->thread_id);
+
 	if (packet_info_pool_init()) {
 		halt("Error while initializing the packet_info_pool", 1);
 		return NULL;
@@ -426,6 +528,7 @@ void *core_processing_thread_func(void *priv) {
 		tpriv->pkt_count--;
 
 		registry_perf_dec(perf_pkt_queue, 1);
+		registry_perf_hist_record_since(perf_pkt_queue_wait, tmp->queued);
 
 		__sync_fetch_and_sub(&core_pkt_queue_count, 1);
 
@@ -582,8 +685,14 @@ int core_process_packet_stack(struct proto_process_stack *stack, unsigned int st
 
 		struct proto_process_stack *s_next = &stack[i + 1];
 
-		if (!s_next->pload || !s_next->plen)
+		if (!s_next->plen)
+			break;
+
+		if (!s_next->pload) {
+			// This is a gap, only the payload listeners can process it
+			proto_process_pload_listeners(p, stack, i);
 			break;
+		}
 	
 	}
 
@@ -798,6 +907,8 @@ int core_set_state(enum core_state state) {
 		for (i = 0; i < CORE_PROCESS_THREAD_MAX; i++)
 			core_clock[i] = 0;
 
+		timers_reset();
+
 		if (core_start_time) {
 			ptime runtime = now - core_start_time;
 
@@ -866,6 +977,18 @@ unsigned int core_get_num_threads() {
 	return core_num_threads;
 }
 
+uint64_t core_get_stream_buffer_max() {
+	return (uint64_t) *PTYPE_UINT32_GETVAL(core_param_stream_buffer) * 1024 * 1024;
+}
+
+uint64_t core_get_frag_buffer_max() {
+	return (uint64_t) *PTYPE_UINT32_GETVAL(core_param_frag_buffer) * 1024 * 1024;
+}
+
+uint64_t core_get_frag_source_quota() {
+	return (uint64_t) *PTYPE_UINT32_GETVAL(core_param_frag_source_quota) * 1024;
+}
+
 char *core_get_http_admin_password() {
 	char *passwd = PTYPE_STRING_GETVAL(core_param_http_admin_password);
 	if (!strlen(passwd))
@@ -44,6 +44,7 @@ enum core_state {
 
 struct core_packet_queue {
 	struct packet *pkt;
+	uint64_t queued;
 	struct core_packet_queue *next;
 };
 
@@ -80,5 +81,8 @@ struct registry_perf *core_add_perf(const char *name, enum registry_perf_type ty
 unsigned int core_get_num_threads();
 
 char *core_get_http_admin_password();
+uint64_t core_get_stream_buffer_max();
+uint64_t core_get_frag_buffer_max();
+uint64_t core_get_frag_source_quota();
 
 #endif
@@ -155,7 +155,7 @@ int dns_core_init() {
 		goto err;
 	}
 
-	timer_queue(dns_gc_run, DNS_GARBAGE_COLLECTOR_TIMEOUT);
+	timer_queue(dns_gc_run, pom_sec_ptime(DNS_GARBAGE_COLLECTOR_TIMEOUT));
 
 	dns_enabled = 1;
 
@@ -322,7 +322,7 @@ int dns_gc(void *priv, ptime now) {
 	pom_mutex_unlock(&dns_table_lock);
 
 	// Requeue the timer
-	timer_queue(dns_gc_run, DNS_GARBAGE_COLLECTOR_TIMEOUT);
+	timer_queue(dns_gc_run, pom_sec_ptime(DNS_GARBAGE_COLLECTOR_TIMEOUT));
 
 	return POM_OK;
 }
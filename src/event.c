@@ -25,6 +25,10 @@
 #include "registry.h"
 #include "core.h"
 #include "filter.h"
+#include "proto.h"
+#include "analyzer.h"
+#include "output.h"
+#include "profiler.h"
 
 #if 0
 #define debug_event(x ...) pomlog(POMLOG_DEBUG x)
@@ -33,6 +37,7 @@
 #endif
 
 static struct event_reg *event_reg_head = NULL;
+static unsigned int event_listeners = 0;
 
 static unsigned int event_pload_listener_ref = 0;
 
@@ -296,6 +301,23 @@ int event_listener_register(struct event_reg *evt_reg, void *obj, int (*process_
 	lst->process_begin = process_begin;
 	lst->process_end = process_end;
 	lst->filter = f;
+
+	// Account the time spent in the listener to its analyzer or output
+	lst->perf_process_time = analyzer_get_listener_perf(obj);
+	if (!lst->perf_process_time)
+		lst->perf_process_time = output_get_listener_perf(obj);
+	char *owner_name = analyzer_get_listener_name(obj);
+	if (!owner_name)
+		owner_name = output_get_listener_name(obj);
+	lst->profiler_id = profiler_register(profiler_stage_event_listener, owner_name);
+
+	lst->index_item = filter_index_add(&evt_reg->listeners_index, lst, f);
+	if (!lst->index_item) {
+		free(lst);
+		if (f)
+			filter_cleanup(f);
+		return POM_ERR;
+	}
 	
 	lst->next = evt_reg->listeners;
 	if (lst->next)
@@ -308,6 +330,7 @@ int event_listener_register(struct event_reg *evt_reg, void *obj, int (*process_
 		if (evt_reg->info->listeners_notify(evt_reg->info->source_obj, evt_reg, 1) != POM_OK) {
 			pomlog(POMLOG_ERR "Error while notifying event object about new listener");
 			evt_reg->listeners = NULL;
+			filter_index_remove(&evt_reg->listeners_index, lst->index_item);
 			free(lst);
 			if (f)
 				filter_cleanup(f);
@@ -316,6 +339,9 @@ int event_listener_register(struct event_reg *evt_reg, void *obj, int (*process_
 	}
 
 	registry_perf_inc(evt_reg->perf_listeners, 1);
+
+	event_listeners++;
+	proto_bpf_filter_update();
 	
 	return POM_OK;
 }
@@ -340,6 +366,8 @@ int event_listener_unregister(struct event_reg *evt_reg, void *obj) {
 		}
 	}
 
+	filter_index_remove(&evt_reg->listeners_index, lst->index_item);
+
 	if (lst->filter)
 		filter_cleanup(lst->filter);
 
@@ -361,6 +389,9 @@ int event_listener_unregister(struct event_reg *evt_reg, void *obj) {
 
 	registry_perf_dec(evt_reg->perf_listeners, 1);
 
+	event_listeners--;
+	proto_bpf_filter_update();
+
 	return POM_OK;
 }
 
@@ -394,6 +425,10 @@ int event_has_listener(struct event_reg *evt_reg) {
 	return (evt_reg->listeners ? 1 : 0);
 }
 
+unsigned int event_listener_count() {
+	return event_listeners;
+}
+
 int event_process(struct event *evt, struct proto_process_stack *stack, int stack_index, ptime ts) {
 
 
@@ -412,18 +447,23 @@ int event_process(struct event *evt, struct proto_process_stack *stack, int stac
 
 	__sync_fetch_and_or(&evt->flags, EVENT_FLAG_PROCESS_BEGAN);
 
-	struct event_listener *lst;
-	for (lst = evt->reg->listeners; lst; lst = lst->next) {
+	struct filter_index_cursor c;
+	filter_index_cursor_init(&c, &evt->reg->listeners_index, evt);
 
-		if (lst->filter && event_filter_match(lst->filter, evt) != FILTER_MATCH_YES)
-			continue;
+	struct event_listener *lst;
+	while ((lst = filter_index_next(&c))) {
 
+		uint64_t prof = profiler_start();
+		uint64_t start = (lst->perf_process_time ? registry_perf_hist_clock() : 0);
 		if (lst->process_begin && lst->process_begin(evt, lst->obj, stack, stack_index) != POM_OK) {
 			pomlog(POMLOG_WARN "An error occured while processing begining of event %s", evt->reg->info->name);
 		}
 		if (lst->process_end && lst->process_end(evt, lst->obj) != POM_OK) {
 			pomlog(POMLOG_WARN "An error occured while processing event %s", evt->reg->info->name);
 		}
+		registry_perf_hist_record_since(lst->perf_process_time, start);
+		if (prof)
+			profiler_account(lst->profiler_id, prof);
 	}
 
 	for (lst = evt->tmp_listeners; lst; lst = lst->next) {
@@ -469,18 +509,23 @@ int event_process_begin(struct event *evt, struct proto_process_stack *stack, in
 
 	evt->ts = ts;
 
+	struct filter_index_cursor c;
+	filter_index_cursor_init(&c, &evt->reg->listeners_index, evt);
+
 	struct event_listener *lst;
-	for (lst = evt->reg->listeners; lst; lst = lst->next) {
+	while ((lst = filter_index_next(&c))) {
 
 		if (!lst->process_begin)
 			continue;
 
-		if (lst->filter && event_filter_match(lst->filter, evt) != FILTER_MATCH_YES)
-			continue;
-
+		uint64_t prof = profiler_start();
+		uint64_t start = (lst->perf_process_time ? registry_perf_hist_clock() : 0);
 		if (lst->process_begin(evt, lst->obj, stack, stack_index) != POM_OK) {
 			pomlog(POMLOG_WARN "An error occured while processing begining of event %s", evt->reg->info->name);
 		}
+		registry_perf_hist_record_since(lst->perf_process_time, start);
+		if (prof)
+			profiler_account(lst->profiler_id, prof);
 	}
 
 	pom_mutex_lock(&evt->reg->evts_lock);
@@ -525,16 +570,21 @@ int event_process_end(struct event *evt) {
 		free(revt);
 	}
 
-	for (lst = evt->reg->listeners; lst; lst = lst->next) {
-		if (!lst->process_end)
-			continue;
+	struct filter_index_cursor c;
+	filter_index_cursor_init(&c, &evt->reg->listeners_index, evt);
 
-		if (lst->filter && event_filter_match(lst->filter, evt) != FILTER_MATCH_YES)
+	while ((lst = filter_index_next(&c))) {
+		if (!lst->process_end)
 			continue;
 
+		uint64_t prof = profiler_start();
+		uint64_t start = (lst->perf_process_time ? registry_perf_hist_clock() : 0);
 		if (lst->process_end(evt, lst->obj) != POM_OK) {
 			pomlog(POMLOG_WARN "An error occured while processing event %s", evt->reg->info->name);
 		}
+		registry_perf_hist_record_since(lst->perf_process_time, start);
+		if (prof)
+			profiler_account(lst->profiler_id, prof);
 	}
 
 	for (lst = evt->tmp_listeners; lst; lst = lst->next) {
@@ -25,6 +25,7 @@
 
 #include <pom-ng/event.h>
 #include <uthash.h>
+#include "filter.h"
 
 // Indicate that the event processing has started
 #define EVENT_FLAG_PROCESS_BEGAN	0x1
@@ -47,6 +48,7 @@ struct event_reg {
 
 	struct event_reg_info *info;
 	struct event_listener *listeners;
+	struct filter_index listeners_index;
 	struct event_reg *prev, *next;
 	struct event_reg_events *evts;
 	struct registry_instance *reg_instance;
@@ -68,6 +70,9 @@ struct event_listener {
 	int (*process_begin) (struct event *evt, void *obj, struct proto_process_stack *stack, unsigned int stack_index);
 	int (*process_end) (struct event *evt, void *obj);
 
+	struct filter_index_item *index_item;
+	struct registry_perf *perf_process_time;
+	unsigned int profiler_id;
 	struct event_listener *prev, *next;
 };
 
@@ -78,6 +83,7 @@ struct event_filter_prop {
 
 int event_init();
 int event_finish();
+unsigned int event_listener_count();
 int event_add_listener(struct event *evt, void *obj, int (*process_begin) (struct event *evt, void *obj, struct proto_process_stack *stack, unsigned int stack_index), int (*process_end) (struct event *evt, void *obj));
 
 #endif
@@ -23,12 +23,20 @@
 #include "core.h"
 #include "proto.h"
 #include "ptype.h"
+#include "jhash.h"
 
 #include <pom-ng/ptype_string.h>
+#include <pom-ng/ptype_ipv4.h>
+#include <pom-ng/ptype_ipv6.h>
+#include <pom-ng/ptype_mac.h>
+
+#include <arpa/inet.h>
 
 static struct ptype_reg *ptype_string = NULL, *ptype_bool = NULL, *ptype_uint8 = NULL, *ptype_uint16 = NULL, *ptype_uint32 = NULL, *ptype_uint64 = NULL;
 static int addon_ptype_initialized = 0;
 
+static void filter_set_release(struct filter_set *set);
+
 //
 // Init and cleanup functions
 //
@@ -87,10 +95,23 @@ void filter_node_cleanup(struct filter *f, struct filter_node *n) {
 		} else if (n->value[i].type == filter_value_type_prop) {
 			if (f->prop_cleanup && n->value[i].val.prop.priv)
 				f->prop_cleanup(n->value[i].val.prop.priv);
+			if (n->value[i].val.prop.name)
+				free(n->value[i].val.prop.name);
 		} else if (n->value[i].type == filter_value_type_string) {
 			free(n->value[i].val.string);
 		} else if (n->value[i].type == filter_value_type_ptype) {
 			ptype_cleanup(n->value[i].val.ptype);
+		} else if (n->value[i].type == filter_value_type_set) {
+			filter_set_release(n->value[i].val.set);
+		} else if (n->value[i].type == filter_value_type_matcher) {
+			struct filter_matcher *m = n->value[i].val.matcher;
+			if (m->op == FILTER_OP_REGEX) {
+				int j;
+				for (j = 0; j < FILTER_REGEX_COPIES; j++)
+					regfree(&m->re[j]);
+			}
+			free(m->str);
+			free(m);
 		}
 	}
 
@@ -101,6 +122,8 @@ void filter_node_cleanup(struct filter *f, struct filter_node *n) {
 void filter_cleanup(struct filter *f) {
 
 	filter_node_cleanup(f, f->n);
+	if (f->prog)
+		free(f->prog);
 	free(f);
 }
 
@@ -154,6 +177,440 @@ void filter_ptype_to_value(struct filter_value *v, struct ptype *pt) {
 	}
 }
 
+//
+// Set functions
+//
+
+static struct filter_set *filter_set_head = NULL;
+static pthread_mutex_t filter_set_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void filter_set_trie_cleanup(struct filter_set_trie *t) {
+
+	if (!t)
+		return;
+
+	filter_set_trie_cleanup(t->child[0]);
+	filter_set_trie_cleanup(t->child[1]);
+	free(t);
+}
+
+static void filter_set_data_cleanup(struct filter_set_data *d) {
+
+	if (!d)
+		return;
+
+	struct filter_set_entry *e, *tmp;
+	HASH_ITER(hh, d->entries, e, tmp) {
+		HASH_DEL(d->entries, e);
+		free(e);
+	}
+
+	filter_set_trie_cleanup(d->trie);
+	free(d);
+}
+
+static int filter_set_data_add_key(struct filter_set_data *d, void *key, size_t len) {
+
+	struct filter_set_entry *e = NULL;
+	HASH_FIND(hh, d->entries, key, len, e);
+	if (e)
+		return POM_OK;
+
+	e = malloc(sizeof(struct filter_set_entry) + len);
+	if (!e) {
+		pom_oom(sizeof(struct filter_set_entry) + len);
+		return POM_ERR;
+	}
+	memset(e, 0, sizeof(struct filter_set_entry));
+	e->len = len;
+	memcpy(e->key, key, len);
+	HASH_ADD_KEYPTR(hh, d->entries, e->key, e->len, e);
+	d->count++;
+
+	return POM_OK;
+}
+
+static int filter_set_data_add_prefix(struct filter_set_data *d, unsigned char *addr, unsigned int mask) {
+
+	struct filter_set_trie **t = &d->trie;
+	unsigned int i;
+	for (i = 0; ; i++) {
+		if (!*t) {
+			*t = malloc(sizeof(struct filter_set_trie));
+			if (!*t) {
+				pom_oom(sizeof(struct filter_set_trie));
+				return POM_ERR;
+			}
+			memset(*t, 0, sizeof(struct filter_set_trie));
+		}
+
+		if (i == mask)
+			break;
+
+		t = &(*t)->child[(addr[i / 8] >> (7 - (i % 8))) & 1];
+	}
+
+	(*t)->prefix = 1;
+	d->count++;
+
+	return POM_OK;
+}
+
+static int filter_set_trie_match(struct filter_set_trie *t, unsigned char *addr, unsigned int bits) {
+
+	unsigned int i;
+	for (i = 0; t; i++) {
+		if (t->prefix)
+			return FILTER_MATCH_YES;
+		if (i == bits)
+			break;
+		t = t->child[(addr[i / 8] >> (7 - (i % 8))) & 1];
+	}
+
+	return FILTER_MATCH_NO;
+}
+
+// Parse one value of the set
+static int filter_set_data_add(struct filter_set *set, struct filter_set_data *d, char *str, size_t len) {
+
+	while (len && (*str == ' ' || *str == '\t')) {
+		str++;
+		len--;
+	}
+	while (len && (str[len - 1] == ' ' || str[len - 1] == '\t' || str[len - 1] == '\r' || str[len - 1] == '\n'))
+		len--;
+
+	if (!len)
+		return POM_OK;
+
+	if (set->type == filter_set_type_string) {
+		if (len >= 2 && str[0] == '"' && str[len - 1] == '"') {
+			str++;
+			len -= 2;
+		}
+		return filter_set_data_add_key(d, str, len);
+	}
+
+	char value[INET6_ADDRSTRLEN + 5] = { 0 };
+	if (len >= sizeof(value)) {
+		pomlog(POMLOG_ERR "Invalid value in set : %.*s", (int) len, str);
+		return POM_ERR;
+	}
+	memcpy(value, str, len);
+
+	switch (set->type) {
+		case filter_set_type_int: {
+			uint64_t i;
+			char *end = NULL;
+			errno = 0;
+			i = strtoull(value, &end, 10);
+			if (errno || *end) {
+				pomlog(POMLOG_ERR "Invalid integer in set : %s", value);
+				return POM_ERR;
+			}
+			return filter_set_data_add_key(d, &i, sizeof(i));
+		}
+
+		case filter_set_type_ipv4:
+		case filter_set_type_ipv6: {
+			int af = (set->type == filter_set_type_ipv4 ? AF_INET : AF_INET6);
+			unsigned int bits = (af == AF_INET ? 32 : 128), mask = bits;
+			char *slash = strchr(value, '/');
+			if (slash) {
+				*slash = 0;
+				if (sscanf(slash + 1, "%u", &mask) != 1 || mask > bits) {
+					pomlog(POMLOG_ERR "Invalid mask in set : %s", slash + 1);
+					return POM_ERR;
+				}
+			}
+			unsigned char addr[sizeof(struct in6_addr)];
+			if (inet_pton(af, value, addr) != 1) {
+				pomlog(POMLOG_ERR "Invalid address in set : %s", value);
+				return POM_ERR;
+			}
+			// Hosts are hashed, subnets go in the trie
+			if (mask == bits)
+				return filter_set_data_add_key(d, addr, bits / 8);
+			return filter_set_data_add_prefix(d, addr, mask);
+		}
+
+		case filter_set_type_mac: {
+			unsigned char addr[6];
+			if (sscanf(value, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &addr[0], &addr[1], &addr[2], &addr[3], &addr[4], &addr[5]) != 6) {
+				pomlog(POMLOG_ERR "Invalid MAC address in set : %s", value);
+				return POM_ERR;
+			}
+			return filter_set_data_add_key(d, addr, sizeof(addr));
+		}
+
+		default:
+			break;
+	}
+
+	return POM_ERR;
+}
+
+static struct filter_set_data *filter_set_data_alloc() {
+
+	struct filter_set_data *d = malloc(sizeof(struct filter_set_data));
+	if (!d) {
+		pom_oom(sizeof(struct filter_set_data));
+		return NULL;
+	}
+	memset(d, 0, sizeof(struct filter_set_data));
+
+	return d;
+}
+
+// Load the set from a file with one value per line
+static struct filter_set_data *filter_set_data_load(struct filter_set *set) {
+
+	FILE *file = fopen(set->path, "r");
+	if (!file) {
+		pomlog(POMLOG_ERR "Error while opening set file %s : %s", set->path, pom_strerror(errno));
+		return NULL;
+	}
+
+	struct filter_set_data *d = filter_set_data_alloc();
+	if (!d) {
+		fclose(file);
+		return NULL;
+	}
+
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	unsigned int line_num = 0;
+	while ((len = getline(&line, &line_size, file)) >= 0) {
+		line_num++;
+		char *comment = memchr(line, '#', len);
+		if (comment)
+			len = comment - line;
+
+		if (filter_set_data_add(set, d, line, len) != POM_OK) {
+			pomlog(POMLOG_ERR "Error on line %u of set file %s", line_num, set->path);
+			free(line);
+			fclose(file);
+			filter_set_data_cleanup(d);
+			return NULL;
+		}
+	}
+
+	free(line);
+	fclose(file);
+
+	pomlog(POMLOG_DEBUG "Loaded %u values from set file %s", d->count, set->path);
+
+	return d;
+}
+
+static struct filter_set *filter_set_alloc(enum filter_set_type type) {
+
+	struct filter_set *set = malloc(sizeof(struct filter_set));
+	if (!set) {
+		pom_oom(sizeof(struct filter_set));
+		return NULL;
+	}
+	memset(set, 0, sizeof(struct filter_set));
+	set->type = type;
+	set->refcount = 1;
+
+	int res = pthread_rwlock_init(&set->lock, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while initializing the set lock : %s", pom_strerror(res));
+		free(set);
+		return NULL;
+	}
+
+	return set;
+}
+
+static void filter_set_release(struct filter_set *set) {
+
+	if (set->path) {
+		pom_mutex_lock(&filter_set_list_lock);
+		if (--set->refcount) {
+			pom_mutex_unlock(&filter_set_list_lock);
+			return;
+		}
+
+		if (set->next)
+			set->next->prev = set->prev;
+		if (set->prev)
+			set->prev->next = set->next;
+		else
+			filter_set_head = set->next;
+		pom_mutex_unlock(&filter_set_list_lock);
+
+		free(set->path);
+	}
+
+	filter_set_data_cleanup(set->data);
+	pthread_rwlock_destroy(&set->lock);
+	free(set);
+}
+
+// Parse "{ value, value, ... }" or "@/path/to/file"
+static struct filter_set *filter_set_parse(enum filter_set_type type, char *expr, unsigned int len) {
+
+	if (len && *expr == '@') {
+
+		char *path = strndup(expr + 1, len - 1);
+		if (!path) {
+			pom_oom(len);
+			return NULL;
+		}
+
+		// Share the sets loaded from the same file
+		pom_mutex_lock(&filter_set_list_lock);
+		struct filter_set *set;
+		for (set = filter_set_head; set && (set->type != type || strcmp(set->path, path)); set = set->next);
+		if (set) {
+			set->refcount++;
+			pom_mutex_unlock(&filter_set_list_lock);
+			free(path);
+			return set;
+		}
+		pom_mutex_unlock(&filter_set_list_lock);
+
+		set = filter_set_alloc(type);
+		if (!set) {
+			free(path);
+			return NULL;
+		}
+		set->path = path;
+
+		set->data = filter_set_data_load(set);
+		if (!set->data) {
+			free(path);
+			set->path = NULL;
+			filter_set_release(set);
+			return NULL;
+		}
+
+		pom_mutex_lock(&filter_set_list_lock);
+		set->next = filter_set_head;
+		if (set->next)
+			set->next->prev = set;
+		filter_set_head = set;
+		pom_mutex_unlock(&filter_set_list_lock);
+
+		return set;
+	}
+
+	if (len < 2 || expr[0] != '{' || expr[len - 1] != '}') {
+		pomlog(POMLOG_ERR "Values of the \"in\" operator must be between braces or a file starting with '@'");
+		return NULL;
+	}
+
+	struct filter_set *set = filter_set_alloc(type);
+	if (!set)
+		return NULL;
+
+	set->data = filter_set_data_alloc();
+	if (!set->data) {
+		filter_set_release(set);
+		return NULL;
+	}
+
+	expr++;
+	len -= 2;
+	while (len) {
+		char *comma = memchr(expr, ',', len);
+		size_t value_len = (comma ? comma - expr : len);
+		if (filter_set_data_add(set, set->data, expr, value_len) != POM_OK) {
+			filter_set_release(set);
+			return NULL;
+		}
+		if (!comma)
+			break;
+		expr = comma + 1;
+		len -= value_len + 1;
+	}
+
+	return set;
+}
+
+static int filter_set_match(struct filter_set *set, struct filter_value *v) {
+
+	void *key = NULL;
+	size_t len = 0;
+
+	switch (set->type) {
+		case filter_set_type_int:
+			if (v->type != filter_value_type_int)
+				return FILTER_MATCH_NO;
+			key = &v->val.integer;
+			len = sizeof(v->val.integer);
+			break;
+		case filter_set_type_string:
+			if (v->type != filter_value_type_string || !v->val.string)
+				return FILTER_MATCH_NO;
+			key = v->val.string;
+			len = strlen(v->val.string);
+			break;
+		case filter_set_type_ipv4:
+			if (v->type != filter_value_type_ptype || !v->val.ptype)
+				return FILTER_MATCH_NO;
+			key = &PTYPE_IPV4_GETADDR(v->val.ptype);
+			len = sizeof(struct in_addr);
+			break;
+		case filter_set_type_ipv6:
+			if (v->type != filter_value_type_ptype || !v->val.ptype)
+				return FILTER_MATCH_NO;
+			key = &PTYPE_IPV6_GETADDR(v->val.ptype);
+			len = sizeof(struct in6_addr);
+			break;
+		case filter_set_type_mac:
+			if (v->type != filter_value_type_ptype || !v->val.ptype)
+				return FILTER_MATCH_NO;
+			key = PTYPE_MAC_GETADDR(v->val.ptype);
+			len = 6;
+			break;
+	}
+
+	int res = FILTER_MATCH_NO;
+	struct filter_set_entry *e = NULL;
+
+	pom_rwlock_rlock(&set->lock);
+	HASH_FIND(hh, set->data->entries, key, len, e);
+	if (e)
+		res = FILTER_MATCH_YES;
+	else if (set->data->trie)
+		res = filter_set_trie_match(set->data->trie, key, len * 8);
+	pom_rwlock_unlock(&set->lock);
+
+	return res;
+}
+
+int filter_set_reload_all() {
+
+	int res = POM_OK;
+
+	// Processing goes on with the previous values while the files are loaded
+	pom_mutex_lock(&filter_set_list_lock);
+	struct filter_set *set;
+	for (set = filter_set_head; set; set = set->next) {
+		struct filter_set_data *d = filter_set_data_load(set);
+		if (!d) {
+			pomlog(POMLOG_WARN "Keeping the previous values of set file %s", set->path);
+			res = POM_ERR;
+			continue;
+		}
+
+		pom_rwlock_wlock(&set->lock);
+		struct filter_set_data *old = set->data;
+		set->data = d;
+		pom_rwlock_unlock(&set->lock);
+
+		filter_set_data_cleanup(old);
+		pomlog("Reloaded %u values from set file %s", d->count, set->path);
+	}
+	pom_mutex_unlock(&filter_set_list_lock);
+
+	return res;
+}
+
 //
 // Compilation functions
 //
@@ -176,15 +633,11 @@ int filter_parse_expr_token(struct filter *f, char *tok, unsigned int len, struc
 			return POM_ERR;
 		}
 
-		len -= 2;
-
-		char *str = n->value[tok_idx].val.string;
-		char *dq = str + 1;
-		len--;
-		while ( (dq = memchr(dq, '"', len)) ) {
-			// The dquote must be escaped at this point
-			memmove(dq - 1, dq, len);
-			len--;
+		// The dquotes must be escaped at this point
+		char *dq = n->value[tok_idx].val.string;
+		while ((dq = strstr(dq, "\\\""))) {
+			memmove(dq, dq + 1, strlen(dq));
+			dq++;
 		}
 
 		return POM_OK;
@@ -243,9 +696,24 @@ int filter_parse_expr_token(struct filter *f, char *tok, unsigned int len, struc
 		return POM_ERR;
 	}
 
+	// The prop_compile callback is allowed to modify the string
+	char *name = strdup(prop_str);
+	if (!name) {
+		free(prop_str);
+		pom_oom(len + 1);
+		return POM_ERR;
+	}
+
 	int res = f->prop_compile(f, prop_str, &n->value[tok_idx]);
 	free(prop_str);
 
+	if (n->value[tok_idx].type == filter_value_type_prop) {
+		n->value[tok_idx].val.prop.name = name;
+		n->value[tok_idx].val.prop.name_hash = jhash(name, strlen(name), 0);
+	} else {
+		free(name);
+	}
+
 	return res;
 }
 
@@ -268,6 +736,16 @@ int filter_op_compile(struct filter_node *n, char *op) {
 		n->op = FILTER_OP_LE;
 	} else if (!strncmp(op, "neq", 3) || !strncmp(op, "!=", 2)) {
 		n->op = FILTER_OP_NEQ;
+	} else if (!strncmp(op, "in ", 3)) {
+		n->op = FILTER_OP_IN;
+	} else if (!strncmp(op, "contains ", 9)) {
+		n->op = FILTER_OP_CONTAINS;
+	} else if (!strncmp(op, "prefix ", 7)) {
+		n->op = FILTER_OP_PREFIX;
+	} else if (!strncmp(op, "suffix ", 7)) {
+		n->op = FILTER_OP_SUFFIX;
+	} else if (!strncmp(op, "regex ", 6) || !strncmp(op, "=~ ", 3)) {
+		n->op = FILTER_OP_REGEX;
 	}
 
 	if (n->op == FILTER_OP_NOP)
@@ -276,6 +754,147 @@ int filter_op_compile(struct filter_node *n, char *op) {
 	return POM_OK;
 }
 
+// Parse the values of the "in" operation (i.e. : "ipv4.src in { 10.0.0.0/8, 192.168.1.1 }")
+
+static int filter_parse_expr_set(struct filter *f, char *expr, unsigned int len, struct filter_node *n) {
+
+	struct filter_value *v = &n->value[0];
+	if (v->type != filter_value_type_prop) {
+		pomlog(POMLOG_ERR "The \"in\" operator needs a property on its left");
+		return POM_ERR;
+	}
+
+	enum filter_set_type type;
+	if (v->val.prop.out_type == filter_value_type_int) {
+		type = filter_set_type_int;
+	} else if (v->val.prop.out_type == filter_value_type_string) {
+		type = filter_set_type_string;
+	} else if (v->val.prop.out_type == filter_value_type_ptype && !strcmp(v->val.prop.out_ptype->info->name, "ipv4")) {
+		type = filter_set_type_ipv4;
+	} else if (v->val.prop.out_type == filter_value_type_ptype && !strcmp(v->val.prop.out_ptype->info->name, "ipv6")) {
+		type = filter_set_type_ipv6;
+	} else if (v->val.prop.out_type == filter_value_type_ptype && !strcmp(v->val.prop.out_ptype->info->name, "mac")) {
+		type = filter_set_type_mac;
+	} else {
+		pomlog(POMLOG_ERR "The \"in\" operator is not supported for property %s", v->val.prop.name);
+		return POM_ERR;
+	}
+
+	n->value[1].val.set = filter_set_parse(type, expr, len);
+	if (!n->value[1].val.set)
+		return POM_ERR;
+	n->value[1].type = filter_value_type_set;
+
+	return POM_OK;
+}
+
+// Back references can't be matched in linear time, don't let them reach regcomp()
+
+static int filter_regex_has_backref(char *re) {
+
+	char *c = re;
+	while (*c) {
+		if (*c == '[') {
+			// Backslashes have no special meaning in a bracket expression
+			c++;
+			if (*c == '^')
+				c++;
+			if (*c == ']')
+				c++;
+			while (*c && *c != ']')
+				c++;
+		} else if (*c == '\\') {
+			c++;
+			if (*c >= '1' && *c <= '9')
+				return 1;
+		}
+
+		if (*c)
+			c++;
+	}
+
+	return 0;
+}
+
+static __thread int filter_regex_copy_id = -1;
+static unsigned int filter_regex_copy_next = 0;
+
+static regex_t *filter_matcher_get_regex(struct filter_matcher *m) {
+
+	// Each thread uses its own copy until there are more threads than copies
+	if (filter_regex_copy_id < 0)
+		filter_regex_copy_id = __sync_fetch_and_add(&filter_regex_copy_next, 1) % FILTER_REGEX_COPIES;
+
+	return &m->re[filter_regex_copy_id];
+}
+
+// Compile the pattern of a string matching operation (i.e. : "http.url contains \"/admin\"")
+
+static int filter_parse_expr_matcher(struct filter_node *n) {
+
+	if (n->value[0].type != filter_value_type_prop || n->value[1].type != filter_value_type_string) {
+		pomlog(POMLOG_ERR "String matching operations need a property on the left and a string on the right");
+		return POM_ERR;
+	}
+
+	struct filter_matcher *m = malloc(sizeof(struct filter_matcher));
+	if (!m) {
+		pom_oom(sizeof(struct filter_matcher));
+		return POM_ERR;
+	}
+	memset(m, 0, sizeof(struct filter_matcher));
+	m->op = n->op;
+	m->str = n->value[1].val.string;
+	m->len = strlen(m->str);
+
+	if (m->op == FILTER_OP_REGEX) {
+
+		if (filter_regex_has_backref(m->str)) {
+			pomlog(POMLOG_ERR "Back references are not supported in regex \"%s\"", m->str);
+			free(m);
+			return POM_ERR;
+		}
+
+		int i;
+		for (i = 0; i < FILTER_REGEX_COPIES; i++) {
+			int res = regcomp(&m->re[i], m->str, REG_EXTENDED | REG_NOSUB);
+			if (res) {
+				char errbuf[256] = { 0 };
+				regerror(res, &m->re[i], errbuf, sizeof(errbuf) - 1);
+				pomlog(POMLOG_ERR "Error while compiling regex \"%s\" : %s", m->str, errbuf);
+				while (--i >= 0)
+					regfree(&m->re[i]);
+				free(m);
+				return POM_ERR;
+			}
+		}
+	}
+
+	n->value[1].type = filter_value_type_matcher;
+	n->value[1].val.matcher = m;
+
+	return POM_OK;
+}
+
+static int filter_matcher_match(struct filter_matcher *m, char *str) {
+
+	size_t len;
+
+	switch (m->op) {
+		case FILTER_OP_CONTAINS:
+			return (strstr(str, m->str) != NULL);
+		case FILTER_OP_PREFIX:
+			return !strncmp(str, m->str, m->len);
+		case FILTER_OP_SUFFIX:
+			len = strlen(str);
+			return (len >= m->len && !memcmp(str + len - m->len, m->str, m->len));
+		case FILTER_OP_REGEX:
+			return !regexec(filter_matcher_get_regex(m), str, 0, NULL, 0);
+	}
+
+	return FILTER_MATCH_NO;
+}
+
 // Parse a block of 2 tokens and a operation (i.e. : "icmp.code == 4")
 
 int filter_parse_expr_block(struct filter *f, char *expr, unsigned int len, struct filter_node **n) {
@@ -378,9 +997,15 @@ int filter_parse_expr_block(struct filter *f, char *expr, unsigned int len, stru
 		len--;
 	}
 
+	if ((*n)->op == FILTER_OP_IN)
+		return filter_parse_expr_set(f, expr, len, *n);
+
 	if (filter_parse_expr_token(f, expr, len, *n, 1) != POM_OK)
 		return POM_ERR;
 
+	if ((*n)->op >= FILTER_OP_CONTAINS && (*n)->op <= FILTER_OP_REGEX)
+		return filter_parse_expr_matcher(*n);
+
 	return POM_OK;
 }
 
@@ -416,6 +1041,12 @@ int filter_parse_expr(struct filter *f, char *expr, unsigned int len, struct fil
 	memset(*n, 0, sizeof(struct filter_node));
 
 	for (i = 0; i < len; i++) {
+		// Parenthesis and operators within strings don't count
+		if (expr[i] == '"' && !branch_found) {
+			for (i++; i < len && (expr[i] != '"' || expr[i - 1] == '\\'); i++);
+			continue;
+		}
+
 		if (stack_size == 0 && expr[i] == '|' && expr[i + 1] == '|')  {
 			branch_found = 1;
 			branch_op = FILTER_OP_OR;
@@ -491,6 +1122,12 @@ int filter_validate(struct filter_node *n) {
 			case filter_value_type_prop:
 				type[i] = n->value[i].val.prop.out_type;
 				break;
+			case filter_value_type_set:
+				// The set was parsed according to the prop
+				return POM_OK;
+			case filter_value_type_matcher:
+				type[i] = filter_value_type_string;
+				break;
 		}
 	}
 
@@ -503,7 +1140,7 @@ int filter_validate(struct filter_node *n) {
 	}
 
 	if (type[0] == filter_value_type_string) {
-		if (n->op != FILTER_OP_EQ && n->op != FILTER_OP_NEQ) {
+		if (n->op != FILTER_OP_EQ && n->op != FILTER_OP_NEQ && n->value[1].type != filter_value_type_matcher) {
 			pomlog(POMLOG_ERR "Invalid operation for string or pointer");
 			return POM_ERR;
 		}
@@ -513,169 +1150,771 @@ int filter_validate(struct filter_node *n) {
 	return POM_OK;
 }
 
-int filter_compile(char *filter_expr, struct filter *f) {
+// Generic value helpers, used when nothing better is known at compile time
 
-	if (f->n) {
-		pomlog(POMLOG_ERR "Filter already compiled");
-		return POM_ERR;
-	}
+static int filter_value_exists(struct filter_value *v) {
 
+	switch (v->type) {
+		case filter_value_type_string:
+			return v->val.string != NULL;
+		case filter_value_type_int:
+			return FILTER_MATCH_YES;
+		case filter_value_type_ptype:
+			return v->val.ptype != NULL;
+		default:
+			break;
+	}
 
-	if (filter_parse_expr(f, filter_expr, strlen(filter_expr), &f->n) != POM_OK)
-		return POM_ERR;
+	return FILTER_MATCH_NO;
+}
 
-	if (filter_validate(f->n) != POM_OK) {
-		return POM_ERR;
+static int filter_int_compare(int op, uint64_t a, uint64_t b) {
+
+	switch (op) {
+		case FILTER_OP_EQ:
+			return a == b;
+		case FILTER_OP_GT:
+			return a > b;
+		case FILTER_OP_GE:
+			return a >= b;
+		case FILTER_OP_LT:
+			return a < b;
+		case FILTER_OP_LE:
+			return a <= b;
+		case FILTER_OP_NEQ:
+			return a != b;
 	}
 
-	return POM_OK;
+	return FILTER_MATCH_NO;
+}
+
+static int filter_value_compare(int op, struct filter_value *a, struct filter_value *b) {
+
+	if (a->type == filter_value_type_unknown || b->type == filter_value_type_unknown)
+		return FILTER_MATCH_NO;
+
+	if (a->type != b->type) {
+		pomlog(POMLOG_DEBUG "Cannot compare different values");
+		return FILTER_MATCH_NO;
+	}
+
+	switch (a->type) {
+		case filter_value_type_string:
+			if (op == FILTER_OP_EQ)
+				return !strcmp(a->val.string, b->val.string);
+			else if (op == FILTER_OP_NEQ)
+				return strcmp(a->val.string, b->val.string) != 0;
+			return POM_ERR;
+
+		case filter_value_type_int:
+			return filter_int_compare(op, a->val.integer, b->val.integer);
+
+		case filter_value_type_ptype:
+			return ptype_compare_val(op, a->val.ptype, b->val.ptype);
+
+		default:
+			break;
+	}
+
+	pomlog(POMLOG_ERR "Internal error, invalid value type");
+	return POM_ERR;
+}
+
+// Swap the sides of a comparison
+static int filter_op_mirror(int op) {
+
+	switch (op) {
+		case FILTER_OP_GT:
+			return FILTER_OP_LT;
+		case FILTER_OP_GE:
+			return FILTER_OP_LE;
+		case FILTER_OP_LT:
+			return FILTER_OP_GT;
+		case FILTER_OP_LE:
+			return FILTER_OP_GE;
+	}
+
+	return op;
 }
 
 //
-// Matching funtions
+// Bytecode generation
 //
 
-int filter_match_node(struct filter *f, struct filter_node *n, void *obj) {
+static struct filter_insn *filter_emit(struct filter *f, enum filter_insn_code code) {
 
-	int res = FILTER_MATCH_NO;
+	if (f->prog_len >= f->prog_size) {
+		unsigned int new_size = (f->prog_size ? f->prog_size * 2 : 16);
+		struct filter_insn *new_prog = realloc(f->prog, sizeof(struct filter_insn) * new_size);
+		if (!new_prog) {
+			pom_oom(sizeof(struct filter_insn) * new_size);
+			return NULL;
+		}
+		f->prog = new_prog;
+		f->prog_size = new_size;
+	}
 
-	struct filter_value value[2] = { { 0 } };
-	value[0].type = n->value[0].type;
-	value[1].type = n->value[1].type;
+	struct filter_insn *insn = &f->prog[f->prog_len++];
+	memset(insn, 0, sizeof(struct filter_insn));
+	insn->code = code;
 
+	return insn;
+}
 
-	int i;
+static int filter_emit_load(struct filter *f, struct filter_value *prop, unsigned int *reg) {
 
-	// Fetch both values
-	for (i = 0; i < 2; i++) {
-		switch (n->value[i].type) {
-			case filter_value_type_unknown:
-				// Nothing to do
-				break;
-			case filter_value_type_prop: {
-				value[i].type = filter_value_type_unknown;
-				if (f->prop_get_val(&n->value[i], &value[i], obj) != POM_OK)
-					return POM_ERR;
-				break;
-			}
-			case filter_value_type_string:
-				value[i].val.string = n->value[i].val.string;
-				break;
+	if (f->reg_count >= FILTER_REG_MAX) {
+		pomlog(POMLOG_ERR "Internal error, more than %u registers used by a comparison", FILTER_REG_MAX);
+		return POM_ERR;
+	}
+
+	struct filter_insn *insn = filter_emit(f, filter_insn_load);
+	if (!insn)
+		return POM_ERR;
+
+	*reg = f->reg_count++;
+	insn->reg[0] = *reg;
+	insn->arg.prop = prop;
+
+	return POM_OK;
+}
+
+static int filter_emit_const(struct filter *f, int res) {
+
+	if (res == POM_ERR)
+		return POM_ERR;
+
+	struct filter_insn *insn = filter_emit(f, filter_insn_const);
+	if (!insn)
+		return POM_ERR;
+	insn->arg.res = res;
+
+	return POM_OK;
+}
+
+static int filter_compile_node(struct filter *f, struct filter_node *n) {
+
+	struct filter_value *v0 = &n->value[0], *v1 = &n->value[1];
+
+	// Registers are only used within a comparison, reuse them for each one
+	if (n->op != FILTER_OP_AND && n->op != FILTER_OP_OR)
+		f->reg_count = 0;
+
+	if (n->op == FILTER_OP_AND || n->op == FILTER_OP_OR) {
+
+		// Short-circuit the second branch
+		if (filter_compile_node(f, v0->val.node) != POM_OK)
+			return POM_ERR;
+
+		struct filter_insn *jmp = filter_emit(f, (n->op == FILTER_OP_AND ? filter_insn_jmp_false : filter_insn_jmp_true));
+		if (!jmp)
+			return POM_ERR;
+		unsigned int jmp_idx = f->prog_len - 1;
+
+		if (filter_compile_node(f, v1->val.node) != POM_OK)
+			return POM_ERR;
+
+		// The program may have been reallocated
+		f->prog[jmp_idx].arg.target = f->prog_len;
+
+	} else if (n->op == FILTER_OP_IN) {
+
+		unsigned int reg;
+		if (filter_emit_load(f, v0, &reg) != POM_OK)
+			return POM_ERR;
+
+		struct filter_insn *insn = filter_emit(f, filter_insn_in);
+		if (!insn)
+			return POM_ERR;
+		insn->not = n->not;
+		insn->reg[0] = reg;
+		insn->arg.set = v1->val.set;
+
+		return POM_OK;
+
+	} else if (v1->type == filter_value_type_matcher) {
+
+		unsigned int reg;
+		if (filter_emit_load(f, v0, &reg) != POM_OK)
+			return POM_ERR;
+
+		struct filter_insn *insn = filter_emit(f, filter_insn_match);
+		if (!insn)
+			return POM_ERR;
+		insn->not = n->not;
+		insn->reg[0] = reg;
+		insn->arg.matcher = v1->val.matcher;
+
+		return POM_OK;
+
+	} else if (v0->type == filter_value_type_node) {
+
+		// Expression between parenthesis
+		if (filter_compile_node(f, v0->val.node) != POM_OK)
+			return POM_ERR;
+
+	} else if (n->op == FILTER_OP_NOP) {
+
+		if (v0->type == filter_value_type_prop) {
+			unsigned int reg;
+			if (filter_emit_load(f, v0, &reg) != POM_OK)
+				return POM_ERR;
+			struct filter_insn *insn = filter_emit(f, filter_insn_exists);
+			if (!insn)
+				return POM_ERR;
+			insn->reg[0] = reg;
+		} else {
+			if (filter_emit_const(f, filter_value_exists(v0)) != POM_OK)
+				return POM_ERR;
+		}
+
+	} else if (v0->type == filter_value_type_prop && v1->type == filter_value_type_prop) {
+
+		unsigned int reg[2];
+		if (filter_emit_load(f, v0, &reg[0]) != POM_OK || filter_emit_load(f, v1, &reg[1]) != POM_OK)
+			return POM_ERR;
+
+		struct filter_insn *insn = filter_emit(f, filter_insn_cmp);
+		if (!insn)
+			return POM_ERR;
+		insn->op = n->op;
+		insn->not = n->not;
+		insn->reg[0] = reg[0];
+		insn->reg[1] = reg[1];
+
+		return POM_OK;
+
+	} else if (v0->type == filter_value_type_prop || v1->type == filter_value_type_prop) {
+
+		// Always have the prop first and the constant second
+		int op = n->op;
+		struct filter_value *prop = v0, *cst = v1;
+		if (v1->type == filter_value_type_prop) {
+			prop = v1;
+			cst = v0;
+			op = filter_op_mirror(op);
+		}
+
+		if (cst->type == filter_value_type_unknown)
+			return filter_emit_const(f, FILTER_MATCH_NO);
+
+		unsigned int reg;
+		if (filter_emit_load(f, prop, &reg) != POM_OK)
+			return POM_ERR;
+
+		struct filter_insn *insn = NULL;
+		switch (cst->type) {
 			case filter_value_type_int:
-				value[i].val.integer = n->value[i].val.integer;
+				insn = filter_emit(f, filter_insn_cmp_int);
+				if (insn)
+					insn->arg.integer = cst->val.integer;
 				break;
-			case filter_value_type_node:
-				value[i].val.node = n->value[i].val.node;
+			case filter_value_type_string:
+				insn = filter_emit(f, filter_insn_cmp_string);
+				if (insn)
+					insn->arg.string = cst->val.string;
 				break;
 			case filter_value_type_ptype:
-				value[i].val.ptype = n->value[i].val.ptype;
+				insn = filter_emit(f, filter_insn_cmp_ptype);
+				if (insn)
+					insn->arg.ptype = cst->val.ptype;
 				break;
+			default:
+				pomlog(POMLOG_ERR "Internal error, invalid value type");
+				return POM_ERR;
 		}
+
+		if (!insn)
+			return POM_ERR;
+		insn->op = op;
+		insn->not = n->not;
+		insn->reg[0] = reg;
+
+		return POM_OK;
+
+	} else {
+		// Only constants, the result is known already
+		int res = filter_value_compare(n->op, v0, v1);
+		if (v0->type != filter_value_type_unknown && v1->type != filter_value_type_unknown && v0->type == v1->type && res != POM_ERR)
+			res ^= n->not;
+		return filter_emit_const(f, res);
+	}
+
+	if (n->not && !filter_emit(f, filter_insn_not))
+		return POM_ERR;
+
+	return POM_OK;
+}
+
+int filter_compile(char *filter_expr, struct filter *f) {
+
+	if (f->n) {
+		pomlog(POMLOG_ERR "Filter already compiled");
+		return POM_ERR;
 	}
 
 
-	if (n->op != FILTER_OP_NOP) {
-		if (value[0].type == filter_value_type_unknown || value[1].type == filter_value_type_unknown)
-			return FILTER_MATCH_NO;
+	if (filter_parse_expr(f, filter_expr, strlen(filter_expr), &f->n) != POM_OK)
+		return POM_ERR;
+
+	// An empty filter matches everything
+	if (!f->n)
+		return filter_emit_const(f, FILTER_MATCH_YES);
+
+	if (filter_validate(f->n) != POM_OK) {
+		return POM_ERR;
+	}
+
+	return filter_compile_node(f, f->n);
+}
+
+//
+// Matching funtions
+//
+
+// Fetch the value of a prop or reuse the one fetched by a previous filter
+static int filter_cache_get_val(struct filter *f, struct filter_value *prop, struct filter_value *outval, void *obj, struct filter_cache *cache) {
+
+	struct filter_prop *p = &prop->val.prop;
 
-		if (value[0].type != value[1].type) {
-			pomlog(POMLOG_DEBUG "Cannot compare different values");
-			return FILTER_MATCH_NO;
+	unsigned int i;
+	for (i = 0; i < cache->count; i++) {
+		struct filter_cache_entry *e = &cache->entries[i];
+		if (e->name_hash == p->name_hash && e->prop_get_val == f->prop_get_val && !strcmp(e->name, p->name)) {
+			*outval = e->val;
+			return POM_OK;
 		}
 	}
 
-	// Match the values
-	switch (value[0].type) {
-		case filter_value_type_unknown:
-			res = FILTER_MATCH_NO;
-			break;
+	if (f->prop_get_val(prop, outval, obj) != POM_OK)
+		return POM_ERR;
 
-		case filter_value_type_prop:
-			pomlog(POMLOG_ERR "Internal error, invalid value type");
-			res = POM_ERR;
-			break;
+	if (cache->count < FILTER_CACHE_SIZE) {
+		struct filter_cache_entry *e = &cache->entries[cache->count++];
+		e->name = p->name;
+		e->name_hash = p->name_hash;
+		e->prop_get_val = f->prop_get_val;
+		e->val = *outval;
+	}
 
-		case filter_value_type_string:
-			if (n->op == FILTER_OP_NOP) {
-				res = value[0].val.string || value[1].val.string;
-			} else if (n->op == FILTER_OP_EQ) {
-				res = !strcmp(value[0].val.string, value[1].val.string);
-			} else if (n->op == FILTER_OP_NEQ) {
-				res = strcmp(value[0].val.string, value[1].val.string);
-			} else {
-				res = POM_ERR;
-			}
-			break;
+	return POM_OK;
+}
 
-		case filter_value_type_int:
-			switch (n->op) {
-				case FILTER_OP_NOP:
-					res = FILTER_MATCH_YES;
-					break;
-				case FILTER_OP_EQ:
-					res = (value[0].val.integer == value[1].val.integer);
-					break;
-				case FILTER_OP_GT:
-					res = (value[0].val.integer > value[1].val.integer);
-					break;
-				case FILTER_OP_GE:
-					res = (value[0].val.integer >= value[1].val.integer);
+int filter_match(struct filter *f, void *obj) {
+
+	return filter_match_cached(f, obj, NULL);
+}
+
+// Props found in the cache are not fetched again, the object must not change while it's used
+int filter_match_cached(struct filter *f, void *obj, struct filter_cache *cache) {
+
+	struct filter_value regs[FILTER_REG_MAX];
+	int res = FILTER_MATCH_NO;
+
+	struct filter_insn *insn = f->prog, *end = f->prog + f->prog_len;
+	while (insn < end) {
+
+		struct filter_value *r = &regs[insn->reg[0]];
+
+		switch (insn->code) {
+			case filter_insn_const:
+				res = insn->arg.res;
+				break;
+
+			case filter_insn_load:
+				r->type = filter_value_type_unknown;
+				if (cache && insn->arg.prop->val.prop.name) {
+					if (filter_cache_get_val(f, insn->arg.prop, r, obj, cache) != POM_OK)
+						return POM_ERR;
+				} else if (f->prop_get_val(insn->arg.prop, r, obj) != POM_OK) {
+					return POM_ERR;
+				}
+				break;
+
+			case filter_insn_exists:
+				res = filter_value_exists(r);
+				break;
+
+			case filter_insn_cmp_int:
+				res = (r->type == filter_value_type_int ? filter_int_compare(insn->op, r->val.integer, insn->arg.integer) ^ insn->not : FILTER_MATCH_NO);
+				break;
+
+			case filter_insn_cmp_string:
+				if (r->type != filter_value_type_string || !r->val.string) {
+					res = FILTER_MATCH_NO;
 					break;
-				case FILTER_OP_LT:
-					res = (value[0].val.integer < value[1].val.integer);
+				}
+				// Only EQ and NEQ are accepted for strings
+				res = (*r->val.string == *insn->arg.string && !strcmp(r->val.string, insn->arg.string));
+				res ^= (insn->op == FILTER_OP_NEQ) ^ insn->not;
+				break;
+
+			case filter_insn_cmp_ptype:
+				res = (r->type == filter_value_type_ptype ? (ptype_compare_val(insn->op, r->val.ptype, insn->arg.ptype) != 0) ^ insn->not : FILTER_MATCH_NO);
+				break;
+
+			case filter_insn_cmp:
+				if (r->type == filter_value_type_unknown || r->type != regs[insn->reg[1]].type) {
+					res = FILTER_MATCH_NO;
 					break;
-				case FILTER_OP_LE:
-					res = (value[0].val.integer <= value[1].val.integer);
+				}
+				res = filter_value_compare(insn->op, r, &regs[insn->reg[1]]);
+				if (res == POM_ERR)
+					return POM_ERR;
+				res ^= insn->not;
+				break;
+
+			case filter_insn_in:
+				if (r->type == filter_value_type_unknown) {
+					res = FILTER_MATCH_NO;
 					break;
-				case FILTER_OP_NEQ:
-					res = (value[0].val.integer != value[1].val.integer);
+				}
+				res = filter_set_match(insn->arg.set, r) ^ insn->not;
+				break;
+
+			case filter_insn_match:
+				if (r->type != filter_value_type_string || !r->val.string) {
+					res = FILTER_MATCH_NO;
 					break;
-			}
-			break;
+				}
+				res = filter_matcher_match(insn->arg.matcher, r->val.string) ^ insn->not;
+				break;
 
-		case filter_value_type_node: {
-			res = filter_match_node(f, value[0].val.node, obj);
-			if (res == POM_ERR)
-				return POM_ERR;
+			case filter_insn_not:
+				res = !res;
+				break;
 
-			if (n->op == FILTER_OP_AND && !res) {
-				// First value is false so expression will be false
+			case filter_insn_jmp_false:
+				if (!res) {
+					insn = f->prog + insn->arg.target;
+					continue;
+				}
 				break;
-			} else if (n->op == FILTER_OP_OR && res) {
-				// First value is true so expression will be true
+
+			case filter_insn_jmp_true:
+				if (res) {
+					insn = f->prog + insn->arg.target;
+					continue;
+				}
 				break;
-			} else {
-				res = filter_match_node(f, value[1].val.node, obj);
+		}
 
-				if (res == POM_ERR)
-					return POM_ERR;
+		insn++;
+	}
 
-				// If it's AND, first value was true, the second one sets the whole expression value
-				// If it's OR, first was false, the second one sets the whole expression value
+	return res;
+}
 
-			}
-			break;
+//
+// Filter index functions
+//
+
+static uint32_t filter_value_hash(struct filter_value *v) {
+
+	switch (v->type) {
+		case filter_value_type_int:
+			return (uint32_t) (v->val.integer ^ (v->val.integer >> 32)) * 2654435761U;
+		case filter_value_type_string: {
+			uint32_t hash = 2166136261U;
+			char *c;
+			for (c = v->val.string; *c; c++)
+				hash = (hash ^ (unsigned char) *c) * 16777619U;
+			return hash;
 		}
+		case filter_value_type_ptype:
+			return ptype_get_hash(v->val.ptype);
+		default:
+			break;
+	}
+
+	return 0;
+}
 
+static int filter_value_equals(struct filter_value *a, struct filter_value *b) {
+
+	if (a->type != b->type)
+		return 0;
+
+	switch (a->type) {
+		case filter_value_type_int:
+			return a->val.integer == b->val.integer;
+		case filter_value_type_string:
+			return a->val.string && b->val.string && !strcmp(a->val.string, b->val.string);
 		case filter_value_type_ptype:
-			if (n->op == FILTER_OP_NOP) {
-				res = value[0].val.ptype || value[1].val.ptype;
+			return a->val.ptype && b->val.ptype && ptype_compare_val(PTYPE_OP_EQ, a->val.ptype, b->val.ptype);
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+// Addresses compared under a mask don't hash like the values they match
+static int filter_index_ptype_is_masked(struct ptype *pt) {
+
+	char *name = pt->type->info->name;
+	if (!strcmp(name, "ipv4"))
+		return ((struct ptype_ipv4_val *) pt->value)->mask < 32;
+	if (!strcmp(name, "ipv6"))
+		return ((struct ptype_ipv6_val *) pt->value)->mask < 128;
+
+	return 0;
+}
+
+// Find an equality with a constant that must be true for the whole filter to match
+static struct filter_node *filter_index_get_key(struct filter_node *n) {
+
+	if (!n || n->not)
+		return NULL;
+
+	if (n->op == FILTER_OP_AND) {
+		struct filter_node *key = filter_index_get_key(n->value[0].val.node);
+		if (!key)
+			key = filter_index_get_key(n->value[1].val.node);
+		return key;
+	}
+
+	if (n->op != FILTER_OP_EQ)
+		return NULL;
+
+	int i;
+	for (i = 0; i < 2; i++) {
+		struct filter_value *prop = &n->value[i], *cst = &n->value[!i];
+		if (prop->type != filter_value_type_prop || !prop->val.prop.name)
+			continue;
+		if (cst->type == filter_value_type_int || (cst->type == filter_value_type_string && cst->val.string) || (cst->type == filter_value_type_ptype && cst->val.ptype && !filter_index_ptype_is_masked(cst->val.ptype)))
+			return n;
+	}
+
+	return NULL;
+}
+
+static void filter_index_link(struct filter_index *idx, struct filter_index_item *item) {
+
+	item->prop = NULL;
+	item->prop_val = NULL;
+	item->key = NULL;
+
+	struct filter_node *key = (item->f ? filter_index_get_key(item->f->n) : NULL);
+	if (key) {
+		struct filter_value *prop = &key->value[0], *cst = &key->value[1];
+		if (prop->type != filter_value_type_prop) {
+			prop = &key->value[1];
+			cst = &key->value[0];
+		}
+
+		// Find the prop slot or create one
+		int i, slot = -1;
+		for (i = 0; i < FILTER_INDEX_PROP_MAX; i++) {
+			if (idx->props[i] && !strcmp(idx->props[i]->name, prop->val.prop.name))
+				break;
+			if (!idx->props[i] && slot < 0)
+				slot = i;
+		}
+
+		if (i >= FILTER_INDEX_PROP_MAX && slot >= 0) {
+			// Not finding room for the prop is fine, the item just won't be indexed
+			i = slot;
+			struct filter_index_prop *p = malloc(sizeof(struct filter_index_prop));
+			if (!p) {
+				pom_oom(sizeof(struct filter_index_prop));
 			} else {
-				res = ptype_compare_val(n->op, value[0].val.ptype, value[1].val.ptype);
+				memset(p, 0, sizeof(struct filter_index_prop));
+				p->name = strdup(prop->val.prop.name);
+				if (!p->name) {
+					pom_oom(strlen(prop->val.prop.name) + 1);
+					free(p);
+				} else {
+					p->owner = item;
+					p->prop = prop;
+					p->prop_get_val = item->f->prop_get_val;
+					idx->props[i] = p;
+				}
 			}
-			break;
+		}
 
+		if (i < FILTER_INDEX_PROP_MAX && idx->props[i]) {
+			item->prop = idx->props[i];
+			item->prop->refcount++;
+			item->prop_val = prop;
+			item->key = cst;
+		}
 	}
 
-	if (n->not)
-		return !res;
+	// Keep the lists sorted
+	struct filter_index_item **list = &idx->unindexed;
+	if (item->prop)
+		list = &item->prop->buckets[filter_value_hash(item->key) % FILTER_INDEX_BUCKETS];
 
-	return res;
+	// The key belongs to the filter, remember the list for when it's gone
+	item->list = list;
+
+	struct filter_index_item *prev = NULL, *next = *list;
+	while (next && next->seq < item->seq) {
+		prev = next;
+		next = next->next;
+	}
+
+	item->prev = prev;
+	item->next = next;
+	if (prev)
+		prev->next = item;
+	else
+		*list = item;
+	if (next)
+		next->prev = item;
 }
 
-int filter_match(struct filter *f, void *obj) {
+static void filter_index_unlink(struct filter_index *idx, struct filter_index_item *item) {
+
+	if (item->next)
+		item->next->prev = item->prev;
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		*item->list = item->next;
+
+	item->list = NULL;
+	item->prev = NULL;
+	item->next = NULL;
+	item->prop_val = NULL;
+	item->key = NULL;
+
+	struct filter_index_prop *prop = item->prop;
+	if (!prop)
+		return;
+
+	item->prop = NULL;
+	if (--prop->refcount) {
+		if (prop->owner != item)
+			return;
+
+		// The filter providing the prop is going away, use another one
+		int i;
+		struct filter_index_item *tmp = NULL;
+		for (i = 0; i < FILTER_INDEX_BUCKETS && !tmp; i++)
+			tmp = prop->buckets[i];
+
+		prop->owner = tmp;
+		prop->prop = tmp->prop_val;
+		prop->prop_get_val = tmp->f->prop_get_val;
+		return;
+	}
+
+	int i;
+	for (i = 0; i < FILTER_INDEX_PROP_MAX && idx->props[i] != prop; i++);
+	idx->props[i] = NULL;
+	free(prop->name);
+	free(prop);
+}
+
+struct filter_index_item *filter_index_add(struct filter_index *idx, void *obj, struct filter *f) {
+
+	struct filter_index_item *item = malloc(sizeof(struct filter_index_item));
+	if (!item) {
+		pom_oom(sizeof(struct filter_index_item));
+		return NULL;
+	}
+	memset(item, 0, sizeof(struct filter_index_item));
+
+	item->obj = obj;
+	item->f = f;
+	// New items are matched first, like when they are added at the head of a list
+	item->seq = --idx->seq_next;
+
+	filter_index_link(idx, item);
+
+	return item;
+}
+
+void filter_index_set_filter(struct filter_index *idx, struct filter_index_item *item, struct filter *f) {
+
+	filter_index_unlink(idx, item);
+	item->f = f;
+	filter_index_link(idx, item);
+}
+
+void filter_index_remove(struct filter_index *idx, struct filter_index_item *item) {
+
+	if (!item)
+		return;
+
+	filter_index_unlink(idx, item);
+	free(item);
+}
+
+void filter_index_cursor_init(struct filter_index_cursor *c, struct filter_index *idx, void *obj) {
+
+	c->obj = obj;
+	c->list_count = 0;
+	c->cache.count = 0;
+
+	if (idx->unindexed) {
+		c->keys[c->list_count] = NULL;
+		c->lists[c->list_count++] = idx->unindexed;
+	}
+
+	// Fetch each indexed prop once and only look at the items expecting that value
+	int i;
+	for (i = 0; i < FILTER_INDEX_PROP_MAX; i++) {
+		struct filter_index_prop *prop = idx->props[i];
+		if (!prop)
+			continue;
+
+		// The value is kept in the cache for the filters of the items
+		struct filter_cache_entry *e = &c->cache.entries[c->cache.count];
+		struct filter_value *v = &e->val;
+		v->type = filter_value_type_unknown;
+		if (prop->prop_get_val(prop->prop, v, obj) != POM_OK)
+			continue;
+		e->name = prop->name;
+		e->name_hash = prop->prop->val.prop.name_hash;
+		e->prop_get_val = prop->prop_get_val;
+		c->cache.count++;
+
+		if (v->type == filter_value_type_unknown)
+			continue;
 
-	return filter_match_node(f, f->n, obj);
+		if (v->type == filter_value_type_string && !v->val.string)
+			continue;
+		if (v->type == filter_value_type_ptype && !v->val.ptype)
+			continue;
+
+		struct filter_index_item *list = prop->buckets[filter_value_hash(v) % FILTER_INDEX_BUCKETS];
+		if (!list)
+			continue;
 
+		c->keys[c->list_count] = v;
+		c->lists[c->list_count++] = list;
+	}
 }
 
+void *filter_index_next(struct filter_index_cursor *c) {
+
+	while (1) {
+		// Merge the lists to return the items in order
+		unsigned int i, next = 0;
+		struct filter_index_item *item = NULL;
+		for (i = 0; i < c->list_count; i++) {
+			if (c->lists[i] && (!item || c->lists[i]->seq < item->seq)) {
+				item = c->lists[i];
+				next = i;
+			}
+		}
+
+		if (!item)
+			return NULL;
+
+		c->lists[next] = item->next;
+
+		if (c->keys[next] && !filter_value_equals(item->key, c->keys[next]))
+			continue;
+
+		if (item->f && filter_match_cached(item->f, c->obj, &c->cache) != FILTER_MATCH_YES)
+			continue;
+
+		return item->obj;
+	}
+
+	return NULL;
+}
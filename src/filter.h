@@ -38,6 +38,14 @@
 // Remove this one when merge complete
 #define FILTER_OP_NOT	(PTYPE_OP_ALL + 3)
 
+#define FILTER_OP_IN	(PTYPE_OP_ALL + 4)
+
+// String matching operations
+#define FILTER_OP_CONTAINS	(PTYPE_OP_ALL + 5)
+#define FILTER_OP_PREFIX	(PTYPE_OP_ALL + 6)
+#define FILTER_OP_SUFFIX	(PTYPE_OP_ALL + 7)
+#define FILTER_OP_REGEX		(PTYPE_OP_ALL + 8)
+
 #include <pom-ng/data.h>
 
 
@@ -47,6 +55,9 @@
 #include <pom-ng/ptype_uint32.h>
 #include <pom-ng/ptype_uint64.h>
 
+#include <uthash.h>
+#include <regex.h>
+
 
 enum filter_value_type {
 	filter_value_type_unknown,
@@ -55,9 +66,60 @@ enum filter_value_type {
 	filter_value_type_int,
 	filter_value_type_node,
 	filter_value_type_ptype,
+	filter_value_type_set,
+	filter_value_type_matcher,
+};
+
+// Number of copies of each compiled regex, regexec() serializes the threads using the same one
+#define FILTER_REGEX_COPIES	16
+
+// Pattern of a string matching operation, compiled once with the filter
+struct filter_matcher {
+	int op;
+	char *str;
+	size_t len;
+	regex_t re[FILTER_REGEX_COPIES];
+};
+
+enum filter_set_type {
+	filter_set_type_int,
+	filter_set_type_string,
+	filter_set_type_ipv4,
+	filter_set_type_ipv6,
+	filter_set_type_mac,
+};
+
+struct filter_set_entry {
+	UT_hash_handle hh;
+	size_t len;
+	char key[];
+};
+
+// Binary trie of the subnets, walked from the most significant bit
+struct filter_set_trie {
+	struct filter_set_trie *child[2];
+	int prefix; // A subnet ends here
+};
+
+struct filter_set_data {
+	struct filter_set_entry *entries;
+	struct filter_set_trie *trie;
+	unsigned int count;
+};
+
+// Values of the "in" operator, sets loaded from a file are shared and can be reloaded
+struct filter_set {
+	enum filter_set_type type;
+	char *path;
+	unsigned int refcount;
+	pthread_rwlock_t lock;
+	struct filter_set_data *data;
+	struct filter_set *prev, *next;
 };
 
 struct filter_prop {
+	char *name; // As written in the expression, identifies the prop across filters
+	uint32_t name_hash;
 	void *priv;
 	enum filter_value_type out_type;
 	struct ptype_reg *out_ptype;
@@ -69,6 +131,8 @@ union filter_value_u {
 	uint64_t integer;
 	struct filter_node *node;
 	struct ptype *ptype;
+	struct filter_set *set;
+	struct filter_matcher *matcher;
 };
 
 struct filter_value {
@@ -84,9 +148,52 @@ struct filter_node {
 	struct filter_value value[2];
 };
 
+// Registers needed by a single comparison
+#define FILTER_REG_MAX	2
+
+enum filter_insn_code {
+	filter_insn_const,	// res = constant
+	filter_insn_load,	// Fetch a prop into a register
+	filter_insn_exists,	// res = the register holds a value
+	filter_insn_cmp_int,	// res = register <op> integer constant
+	filter_insn_cmp_string,	// res = register <op> string constant
+	filter_insn_cmp_ptype,	// res = register <op> ptype constant
+	filter_insn_cmp,	// res = register <op> register
+	filter_insn_in,		// res = register is in the set
+	filter_insn_match,	// res = register matches the string pattern
+	filter_insn_not,	// res = !res
+	filter_insn_jmp_false,	// Jump to the target if res is false
+	filter_insn_jmp_true,	// Jump to the target if res is true
+};
+
+struct filter_insn {
+
+	enum filter_insn_code code;
+	int op;
+	int not; // Comparisons with a missing value never match, even when negated
+	unsigned int reg[2];
+
+	union {
+		int res;
+		uint64_t integer;
+		char *string;
+		struct ptype *ptype;
+		struct filter_value *prop;
+		struct filter_set *set;
+		struct filter_matcher *matcher;
+		unsigned int target;
+	} arg;
+};
+
 struct filter {
 
 	struct filter_node *n;
+
+	// Program compiled from the tree, the tree still owns the constants and the props
+	struct filter_insn *prog;
+	unsigned int prog_len, prog_size;
+	unsigned int reg_count;
+
 	int (*prop_compile) (struct filter *f, char *prop_str, struct filter_value *v);
 	int (*prop_get_val) (struct filter_value *inval, struct filter_value *outval, void *obj);
 	void (*prop_cleanup) (void *prop);
@@ -94,6 +201,64 @@ struct filter {
 };
 
 
+// Number of distinct props a filter index can hash on
+#define FILTER_INDEX_PROP_MAX	8
+#define FILTER_INDEX_BUCKETS	256
+
+struct filter_index_item {
+
+	void *obj;
+	struct filter *f;
+	int64_t seq; // Order of the item, lower first
+	struct filter_index_prop *prop; // Prop hashed for this item, NULL if not indexed
+	struct filter_value *prop_val; // The prop in this item's filter
+	struct filter_value *key; // Value the prop must be equal to
+	struct filter_index_item **list; // List the item is linked in
+	struct filter_index_item *prev, *next;
+};
+
+struct filter_index_prop {
+
+	unsigned int refcount;
+	struct filter_index_item *owner; // Item whose filter provides the prop
+	char *name; // Own copy, the owner's filter may be released before it's unlinked
+	struct filter_value *prop;
+	int (*prop_get_val) (struct filter_value *inval, struct filter_value *outval, void *obj);
+	struct filter_index_item *buckets[FILTER_INDEX_BUCKETS];
+};
+
+// Index of many filters, used to find out which ones match without evaluating them all
+struct filter_index {
+
+	int64_t seq_next;
+	struct filter_index_item *unindexed;
+	struct filter_index_prop *props[FILTER_INDEX_PROP_MAX];
+};
+
+// Values of the props already fetched from an object, shared by the filters matched against it
+#define FILTER_CACHE_SIZE	16
+
+struct filter_cache_entry {
+	char *name;
+	uint32_t name_hash;
+	int (*prop_get_val) (struct filter_value *inval, struct filter_value *outval, void *obj);
+	struct filter_value val;
+};
+
+struct filter_cache {
+	unsigned int count;
+	struct filter_cache_entry entries[FILTER_CACHE_SIZE];
+};
+
+struct filter_index_cursor {
+
+	void *obj;
+	unsigned int list_count;
+	struct filter_index_item *lists[FILTER_INDEX_PROP_MAX + 1];
+	struct filter_value *keys[FILTER_INDEX_PROP_MAX + 1];
+	struct filter_cache cache;
+};
+
 struct filter *filter_alloc(int (*prop_compile) (struct filter *f, char *prop_str, struct filter_value *v), void *priv, int (*prop_get_val) (struct filter_value *inval, struct filter_value *outval, void *obj), void (*prop_cleanup) (void *(prop)));
 
 
@@ -110,6 +275,15 @@ int filter_compile(char *filter_expr, struct filter *f);
 int filter_node_data_match(struct filter_node *n, struct data *d);
 
 int filter_match(struct filter *n, void *obj);
+int filter_match_cached(struct filter *f, void *obj, struct filter_cache *cache);
+
+int filter_set_reload_all();
+
+struct filter_index_item *filter_index_add(struct filter_index *idx, void *obj, struct filter *f);
+void filter_index_set_filter(struct filter_index *idx, struct filter_index_item *item, struct filter *f);
+void filter_index_remove(struct filter_index *idx, struct filter_index_item *item);
+void filter_index_cursor_init(struct filter_index_cursor *c, struct filter_index *idx, void *obj);
+void *filter_index_next(struct filter_index_cursor *c);
 
 #endif
 
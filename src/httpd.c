@@ -23,6 +23,7 @@
 #include "httpd.h"
 #include "xmlrpcsrv.h"
 #include "core.h"
+#include "registry.h"
 #include <pom-ng/mime.h>
 
 #include <sys/types.h>
@@ -325,7 +326,20 @@ int httpd_mhd_answer_connection(void *cls, struct MHD_Connection *connection, co
 	} else if (!strcmp(method, MHD_HTTP_METHOD_GET)) {
 		// Process GET request
 
-		if (!strcmp(url, HTTPD_STATUS_URL)) {
+		if (!strcmp(url, HTTPD_METRICS_URL)) {
+
+			// Render all the perfs in the Prometheus text format
+			size_t len = 0;
+			char *metrics = registry_metrics_render(&len);
+			if (!metrics) {
+				pomlog(POMLOG_ERR "Error while rendering the metrics");
+				return MHD_NO;
+			}
+
+			response = MHD_create_response_from_data(len, (void *) metrics, MHD_YES, MHD_NO);
+			mime_type = HTTPD_METRICS_MIME_TYPE;
+
+		} else if (!strcmp(url, HTTPD_STATUS_URL)) {
 			const char *replystr = "<html><body>It works !<br/>I'm running as uid %u and gid %u.</body></html>";
 
 			size_t buffsize = strlen(replystr) + 20;
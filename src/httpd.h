@@ -36,6 +36,8 @@
 #define HTTPD_STATUS_URL	"/status.html"
 #define HTTPD_INDEX_PAGE	"index.html"
 #define HTTPD_PLOAD_URL		"/pload/"
+#define HTTPD_METRICS_URL	"/metrics"
+#define HTTPD_METRICS_MIME_TYPE	"text/plain; version=0.0.4"
 
 #define HTTPD_ADMIN_USER	"admin"
 #define HTTPD_REALM		"POM-NG Authentication"
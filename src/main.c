@@ -38,6 +38,7 @@
 #include "pomlog.h"
 #include "proto.h"
 #include "packet.h"
+#include "stream.h"
 #include "timer.h"
 #include "analyzer.h"
 #include "output.h"
@@ -394,6 +395,11 @@ int main(int argc, char *argv[]) {
 		goto err_packet;
 	}
 
+	if (stream_init() != POM_OK) {
+		pomlog(POMLOG_ERR "Error while initializing the streams");
+		goto err_stream;
+	}
+
 	system_store = system_datastore_open(system_store_uri);
 	if (!system_store) {
 		pomlog(POMLOG_ERR "Unable to open the system datastore");
@@ -495,6 +501,7 @@ err_addon:
 	addon_cleanup();
 err_dstore:
 err_timer:
+err_stream:
 err_packet:
 err_httpd:
 	httpd_stop();
@@ -533,7 +533,7 @@ static int analyzer_dns_proto_packet_process(void *object, struct packet *p, str
 			q->cls = question.qclass;
 			q->name = question.qname;
 
-			timer_queue_now(q->t, *PTYPE_UINT32_GETVAL(priv->p_qtimeout), p->ts);
+			timer_queue_now(q->t, pom_sec_ptime(*PTYPE_UINT32_GETVAL(priv->p_qtimeout)), p->ts);
 			pom_mutex_lock(&priv->lock);
 			q->next = priv->entry_head;
 			if (q->next)
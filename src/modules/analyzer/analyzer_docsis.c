@@ -380,7 +380,7 @@ static int analyzer_docsis_pkt_process(void *obj, struct packet *p, struct proto
 
 	}
 
-	timer_queue_now(cm->t, T4_TIMEOUT * cm->t4_multiplier, p->ts);
+	timer_queue_now(cm->t, pom_sec_ptime(T4_TIMEOUT * cm->t4_multiplier), p->ts);
 
 	pom_mutex_unlock(&priv->lock);
 
@@ -209,7 +209,7 @@ int analyzer_http_event_listeners_notify(void *obj, struct event_reg *evt_reg, i
 			return POM_ERR;
 		}
 
-		priv->http_packet_listener = proto_packet_listener_register(priv->proto_http, PROTO_PACKET_LISTENER_PLOAD_ONLY, analyzer, analyzer_http_proto_packet_process, NULL);
+		priv->http_packet_listener = proto_packet_listener_register(priv->proto_http, PROTO_PACKET_LISTENER_PLOAD_ONLY | PROTO_PACKET_LISTENER_GAP, analyzer, analyzer_http_proto_packet_process, NULL);
 		if (!priv->http_packet_listener) {
 			event_listener_unregister(priv->evt_query, analyzer);
 			event_listener_unregister(priv->evt_response, analyzer);
@@ -763,8 +763,13 @@ int analyzer_http_proto_packet_process(void *object, struct packet *p, struct pr
 		}
 	}
 
-	if (pload_append(epriv->pload[dir], pload_stack->pload, pload_stack->plen) != POM_OK)
+	if (!pload_stack->pload) {
+		// Some bytes are missing from the payload
+		if (pload_append_gap(epriv->pload[dir], pload_stack->plen) != POM_OK)
+			return POM_ERR;
+	} else if (pload_append(epriv->pload[dir], pload_stack->pload, pload_stack->plen) != POM_OK) {
 		return POM_ERR;
+	}
 
 	return POM_OK;
 }
@@ -512,7 +512,7 @@ static int analyzer_sip_call_dialog_set_state(struct analyzer_sip_priv *priv, st
 		}
 
 		// Update the timer
-		if (timer_queue_now(d->t, *PTYPE_UINT32_GETVAL(priv->p_dialog_connected_timeout), event_get_timestamp(evt)) != POM_OK)
+		if (timer_queue_now(d->t, pom_sec_ptime(*PTYPE_UINT32_GETVAL(priv->p_dialog_connected_timeout)), event_get_timestamp(evt)) != POM_OK)
 			return POM_ERR;
 
 		// Create an expectation for our call
@@ -529,7 +529,7 @@ static int analyzer_sip_call_dialog_set_state(struct analyzer_sip_priv *priv, st
 			debug_sip("Half dialog for call %s terminated : from_tag %s, branch %s", d->call->call_id, d->from_tag, d->branch);
 		}
 		// Update the timer
-		if (timer_queue_now(d->t, *PTYPE_UINT32_GETVAL(priv->p_dialog_timeout), event_get_timestamp(evt)) != POM_OK)
+		if (timer_queue_now(d->t, pom_sec_ptime(*PTYPE_UINT32_GETVAL(priv->p_dialog_timeout)), event_get_timestamp(evt)) != POM_OK)
 			return POM_ERR;
 	}
 
@@ -1004,7 +1004,7 @@ static int analyzer_sip_event_process_begin(struct event *evt, void *obj, struct
 	uint32_t dialog_timeout = *PTYPE_UINT32_GETVAL(priv->p_dialog_timeout);
 	if (dialog->state == analyzer_sip_dialog_state_connected)
 		dialog_timeout =  *PTYPE_UINT32_GETVAL(priv->p_dialog_connected_timeout);
-	if (timer_queue_now(dialog->t, dialog_timeout, event_get_timestamp(evt)) != POM_OK) {
+	if (timer_queue_now(dialog->t, pom_sec_ptime(dialog_timeout), event_get_timestamp(evt)) != POM_OK) {
 		pom_mutex_unlock(&call->lock);
 		return POM_ERR;
 	}
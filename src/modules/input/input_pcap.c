@@ -127,6 +127,14 @@ static int input_pcap_common_init(struct input *i) {
 	if (input_add_param(i, p) != POM_OK)
 		goto err;
 
+	priv->p_auto_filter = ptype_alloc("bool");
+	if (!priv->p_auto_filter)
+		goto err;
+
+	p = registry_new_param("auto_filter", "yes", priv->p_auto_filter, "Only capture the packets needed by the packet listeners when no event is being listened to", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
 	i->priv = priv;
 	
 	return POM_OK;
@@ -138,15 +146,15 @@ err:
 	if (priv->p_filter)
 		ptype_cleanup(priv->p_filter);
 
+	if (priv->p_auto_filter)
+		ptype_cleanup(priv->p_auto_filter);
+
 	free(priv);
 
 	return POM_ERR;
 }
 
-static int input_pcap_set_filter(pcap_t *p, char *filter) {
-
-	if (strlen(filter) <= 0)
-		return POM_OK;
+static int input_pcap_install_filter(pcap_t *p, char *filter) {
 
 	struct bpf_program fp;
 
@@ -166,6 +174,62 @@ static int input_pcap_set_filter(pcap_t *p, char *filter) {
 	return POM_OK;
 }
 
+static int input_pcap_set_filter(pcap_t *p, char *filter) {
+
+	if (strlen(filter) <= 0)
+		return POM_OK;
+
+	return input_pcap_install_filter(p, filter);
+}
+
+// Install the user filter along with the one matching the packets needed by the listeners
+static int input_pcap_apply_filter(struct input_pcap_priv *priv) {
+
+	char *filter = PTYPE_STRING_GETVAL(priv->p_filter);
+
+	char *auto_filter = NULL;
+	if (*PTYPE_BOOL_GETVAL(priv->p_auto_filter))
+		auto_filter = packet_bpf_filter_get(priv->datalink_type == DLT_EN10MB, &priv->auto_filter_serial);
+	else
+		priv->auto_filter_serial = packet_bpf_filter_serial();
+
+	if (!auto_filter) {
+		if (!priv->auto_filter_installed)
+			return input_pcap_set_filter(priv->p, filter);
+
+		// Remove the previous one
+		priv->auto_filter_installed = 0;
+		pomlog(POMLOG_DEBUG "Capturing all the packets");
+		return input_pcap_install_filter(priv->p, filter);
+	}
+
+	if (*filter) {
+		size_t len = strlen(filter) + strlen(auto_filter) + 12;
+		char *tmp = malloc(len);
+		if (!tmp) {
+			free(auto_filter);
+			pom_oom(len);
+			return POM_ERR;
+		}
+		snprintf(tmp, len, "(%s) and (%s)", filter, auto_filter);
+		free(auto_filter);
+		auto_filter = tmp;
+	}
+
+	if (input_pcap_install_filter(priv->p, auto_filter) != POM_OK) {
+		free(auto_filter);
+		pomlog(POMLOG_WARN "Unable to only capture the packets needed by the listeners, capturing all of them");
+		priv->auto_filter_installed = 0;
+		return input_pcap_install_filter(priv->p, filter);
+	}
+
+	pomlog(POMLOG_DEBUG "Capturing packets matching \"%s\"", auto_filter);
+	free(auto_filter);
+	priv->auto_filter_installed = 1;
+
+	return POM_OK;
+}
+
 static int input_pcap_common_open(struct input *i) {
 
 	struct input_pcap_priv *priv = i->priv;
@@ -229,7 +293,7 @@ static int input_pcap_common_open(struct input *i) {
 	}
 
 
-	if (input_pcap_set_filter(priv->p, PTYPE_STRING_GETVAL(priv->p_filter)) != POM_OK) {
+	if (input_pcap_apply_filter(priv) != POM_OK) {
 		input_pcap_close(i);
 		return POM_ERR;
 	}
@@ -721,7 +785,7 @@ static int input_pcap_dir_open_next(struct input_pcap_priv *p) {
 			continue;
 		}
 
-		if (input_pcap_set_filter(p->p, PTYPE_STRING_GETVAL(p->p_filter)) != POM_OK) {
+		if (input_pcap_apply_filter(p) != POM_OK) {
 			pomlog(POMLOG_ERR "Error while setting filter on file %s", dp->cur_file->filename);
 			continue;
 		}
@@ -758,6 +822,10 @@ static int input_pcap_read(struct input *i) {
 		}
 	}
 
+	// The packet listeners changed
+	if (p->auto_filter_serial != packet_bpf_filter_serial())
+		input_pcap_apply_filter(p);
+
 	struct pcap_pkthdr *phdr;
 	const u_char *data;
 	int result = pcap_next_ex(p->p, &phdr, &data);
@@ -889,6 +957,7 @@ static int input_pcap_cleanup(struct input *i) {
 
 	}
 	ptype_cleanup(priv->p_filter);
+	ptype_cleanup(priv->p_auto_filter);
 	free(priv);
 
 	return POM_OK;
@@ -69,6 +69,9 @@ struct input_pcap_priv {
 	} tpriv;
 
 	struct ptype *p_filter;
+	struct ptype *p_auto_filter;
+	unsigned int auto_filter_serial;
+	int auto_filter_installed;
 
 	struct proto *datalink_proto;
 	int datalink_type;
@@ -56,6 +56,7 @@ static int proto_http_mod_register(struct mod_reg *mod) {
 	proto_http.name = "http";
 	proto_http.api_ver = PROTO_API_VER;
 	proto_http.mod = mod;
+	proto_http.flags = PROTO_REG_FLAG_GAP;
 
 	static struct conntrack_info ct_info = { 0 };
 
@@ -214,6 +215,9 @@ static int proto_http_process(void *proto_priv, struct packet *p, struct proto_p
 		return PROTO_INVALID;
 	}
 
+	if (!s->pload)
+		return proto_http_process_gap(priv, stack, stack_index);
+
 	if (!priv->parser[s->direction]) {
 		priv->parser[s->direction] = packet_stream_parser_alloc(HTTP_MAX_HEADER_LINE, PACKET_STREAM_PARSER_FLAG_TRIM);
 		if (!priv->parser[s->direction])
@@ -494,6 +498,46 @@ static int proto_http_process(void *proto_priv, struct packet *p, struct proto_p
 }
 
 
+static int proto_http_process_gap(struct proto_http_conntrack_priv *priv, struct proto_process_stack *stack, unsigned int stack_index) {
+
+	struct proto_process_stack *s = &stack[stack_index];
+	struct proto_process_stack *s_next = &stack[stack_index + 1];
+	struct http_info *info = &priv->info[s->direction];
+
+	debug_http("entry %p, gap of %u bytes", s->ce, s->plen);
+
+	if (priv->state[s->direction] != HTTP_STATE_BODY) {
+		// Some headers are missing, we can't find where the next query or response starts
+		priv->is_invalid = 1;
+		return PROTO_INVALID;
+	}
+
+	uint32_t gap = s->plen;
+
+	if (info->flags & HTTP_FLAG_CHUNKED) {
+		if (!info->chunk_len || gap > info->chunk_len - info->chunk_pos) {
+			// The gap covers a chunk header
+			priv->is_invalid = 1;
+			return PROTO_INVALID;
+		}
+		info->chunk_pos += gap;
+	} else if (info->flags & HTTP_FLAG_HAVE_CLEN) {
+		size_t pload_remaining = info->content_len - info->content_pos;
+		if (gap > pload_remaining) {
+			// The gap continues into the next query or response, only report what belongs to this payload
+			gap = pload_remaining;
+			priv->is_invalid = 1;
+		}
+		info->content_pos += gap;
+	}
+
+	// Let the payload listeners know about the missing bytes
+	s_next->pload = NULL;
+	s_next->plen = gap;
+
+	return PROTO_OK;
+}
+
 static int proto_http_post_process(void *proto_priv, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index) {
 
 	struct conntrack_entry *ce = stack[stack_index].ce;
@@ -66,6 +66,7 @@ static int proto_http_init(struct proto *proto, struct registry_instance *ri);
 int proto_http_cleanup(void *proto_priv);
 static int proto_http_process(void *proto_priv, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
 static int proto_http_post_process(void *proto_priv, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
+static int proto_http_process_gap(struct proto_http_conntrack_priv *priv, struct proto_process_stack *stack, unsigned int stack_index);
 static int proto_http_conntrack_reset(struct conntrack_entry *ce, int direction);
 static int proto_http_conntrack_cleanup(void *ce_priv);
 static int proto_http_mod_unregister();
@@ -174,7 +174,7 @@ static int proto_ipv4_process(void *proto_priv, struct packet *p, struct proto_p
 		res = conntrack_delayed_cleanup(s->ce, 0, p->ts);
 	} else {
 		uint32_t *conntrack_timeout = PTYPE_UINT32_GETVAL(param_conntrack_timeout);
-		res = conntrack_delayed_cleanup(s->ce, *conntrack_timeout, p->ts);
+		res = conntrack_delayed_cleanup(s->ce, pom_sec_ptime(*conntrack_timeout), p->ts);
 	}
 	if (res == POM_ERR) {
 		conntrack_unlock(s->ce);
@@ -245,8 +245,8 @@ static int proto_ipv4_process(void *proto_priv, struct packet *p, struct proto_p
 			return PROTO_STOP;
 		}
 
-		tmp->multipart = packet_multipart_alloc(s_next->proto, 0, 0);
-		if (!tmp->multipart) {
+		tmp->frag.multipart = packet_multipart_alloc(s_next->proto, 0, 0);
+		if (!tmp->frag.multipart) {
 			conntrack_unlock(s->ce);
 			conntrack_timer_cleanup(tmp->t);
 			free(tmp);
@@ -259,26 +259,30 @@ static int proto_ipv4_process(void *proto_priv, struct packet *p, struct proto_p
 		s->ce->priv = tmp;
 	}
 
-	// Fragment was already handled
-	if (tmp->flags & PROTO_IPV4_FLAG_PROCESSED) {
+	// Fragment was already handled or its packet was dropped
+	if ((tmp->flags & PROTO_IPV4_FLAG_PROCESSED) || !tmp->frag.multipart) {
 		conntrack_unlock(s->ce);
 		registry_perf_inc(perf_frags_dropped, 1);
 		return PROTO_STOP;
 	}
 	
 	// Add the fragment
-	if (packet_multipart_add_packet(tmp->multipart, p, offset, frag_size, (s->pload - (void*)p->buff) + (hdr->ip_hl * 4)) != POM_OK) {
+	res = packet_frag_add(&tmp->frag, s->ce, p, offset, frag_size, (s->pload - (void*)p->buff) + (hdr->ip_hl * 4), &hdr->ip_src, sizeof(hdr->ip_src));
+	if (res == PACKET_FRAG_DROPPED) {
+		conntrack_unlock(s->ce);
+		registry_perf_inc(perf_frags_dropped, 1);
+		return PROTO_STOP;
+	} else if (res != POM_OK) {
+		// The timer will release the fragment
+		packet_multipart_cleanup(packet_frag_release(&tmp->frag));
 		conntrack_unlock(s->ce);
-		packet_multipart_cleanup(tmp->multipart);
-		conntrack_timer_cleanup(tmp->t);
-		free(tmp);
 		return PROTO_ERR;
 	}
 	tmp->count++;
 
 	// Schedule the timeout for the fragment
 	uint32_t *frag_timeout = PTYPE_UINT32_GETVAL(param_frag_timeout);
-	conntrack_timer_queue(tmp->t, *frag_timeout, p->ts);
+	conntrack_timer_queue(tmp->t, pom_sec_ptime(*frag_timeout), p->ts);
 
 
 	if (!(frag_off & IP_MORE_FRAG))
@@ -286,10 +290,9 @@ static int proto_ipv4_process(void *proto_priv, struct packet *p, struct proto_p
 
 	struct packet_multipart *m = NULL;
 
-	if ((tmp->flags & PROTO_IPV4_FLAG_GOT_LAST) && !tmp->multipart->gaps) {
+	if ((tmp->flags & PROTO_IPV4_FLAG_GOT_LAST) && !tmp->frag.multipart->gaps) {
 		tmp->flags |= PROTO_IPV4_FLAG_PROCESSED;
-		m = tmp->multipart;
-		tmp->multipart = NULL;
+		m = packet_frag_release(&tmp->frag);
 	}
 
 
@@ -297,7 +300,7 @@ static int proto_ipv4_process(void *proto_priv, struct packet *p, struct proto_p
 	conntrack_unlock(s->ce);
 	
 	if (m) {
-		int res = packet_multipart_process(m, stack, stack_index + 1);
+		res = packet_multipart_process(m, stack, stack_index + 1);
 		if (res == PROTO_ERR) {
 			return PROTO_ERR;
 		} else if (res == PROTO_INVALID) {
@@ -324,6 +327,8 @@ static int proto_ipv4_fragment_cleanup(struct conntrack_entry *ce, void *priv, p
 	if (f->next)
 		f->next->prev = f->prev;
 
+	struct packet_multipart *m = packet_frag_release(&f->frag);
+
 	conntrack_unlock(ce);
 
 
@@ -331,8 +336,8 @@ static int proto_ipv4_fragment_cleanup(struct conntrack_entry *ce, void *priv, p
 		registry_perf_inc(perf_frags_dropped, f->count);
 	}
 
-	if (f->multipart)
-		packet_multipart_cleanup(f->multipart);
+	if (m)
+		packet_multipart_cleanup(m);
 	
 	if (f->t)
 		conntrack_timer_cleanup(f->t);
@@ -355,8 +360,9 @@ static int proto_ipv4_conntrack_cleanup(void *ce_priv) {
 			registry_perf_inc(perf_frags_dropped, f->count);
 		}
 
-		if (f->multipart)
-			packet_multipart_cleanup(f->multipart);
+		struct packet_multipart *m = packet_frag_release(&f->frag);
+		if (m)
+			packet_multipart_cleanup(m);
 		
 		if (f->t)
 			conntrack_timer_cleanup(f->t);
@@ -41,7 +41,7 @@ enum proto_ipv4_fields {
 struct proto_ipv4_fragment {
 
 	unsigned int count;
-	struct packet_multipart *multipart;
+	struct packet_frag frag;
 	unsigned int flags;
 	struct conntrack_timer *t;
 	struct proto_ipv4_fragment *prev, *next;
@@ -185,8 +185,8 @@ static int proto_ipv6_process_fragment(struct packet *p, struct proto_process_st
 		
 		tmp->id = fhdr->ip6f_ident;
 		tmp->nxthdr = nxthdr;
-		tmp->multipart = packet_multipart_alloc(s_next->proto, 0, 0);
-		if (!tmp->multipart) {
+		tmp->frag.multipart = packet_multipart_alloc(s_next->proto, 0, 0);
+		if (!tmp->frag.multipart) {
 			conntrack_timer_cleanup(tmp->t);
 			free(tmp);
 			conntrack_unlock(s->ce);
@@ -199,18 +199,23 @@ static int proto_ipv6_process_fragment(struct packet *p, struct proto_process_st
 		s->ce->priv = tmp;
 	}
 
-	// Fragment was already handled
-	if (tmp->flags & PROTO_IPV6_FLAG_PROCESSED) {
+	// Fragment was already handled or its packet was dropped
+	if ((tmp->flags & PROTO_IPV6_FLAG_PROCESSED) || !tmp->frag.multipart) {
 		registry_perf_inc(perf_frags_dropped, 1);
 		conntrack_unlock(s->ce);
 		return PROTO_STOP;
 	}
 	
 	// Add the fragment
-	if (packet_multipart_add_packet(tmp->multipart, p, frag_offset, frag_len, frag_data - p->buff) != POM_OK) {
-		packet_multipart_cleanup(tmp->multipart);
-		conntrack_timer_cleanup(tmp->t);
-		free(tmp);
+	struct ip6_hdr *hdr = s->pload;
+	int res = packet_frag_add(&tmp->frag, s->ce, p, frag_offset, frag_len, frag_data - p->buff, &hdr->ip6_src, sizeof(hdr->ip6_src));
+	if (res == PACKET_FRAG_DROPPED) {
+		registry_perf_inc(perf_frags_dropped, 1);
+		conntrack_unlock(s->ce);
+		return PROTO_STOP;
+	} else if (res != POM_OK) {
+		// The timer will release the fragment
+		packet_multipart_cleanup(packet_frag_release(&tmp->frag));
 		conntrack_unlock(s->ce);
 		return PROTO_ERR;
 	}
@@ -218,7 +223,7 @@ static int proto_ipv6_process_fragment(struct packet *p, struct proto_process_st
 
 	// Schedule the timeout for the fragment
 	uint32_t *frag_timeout = PTYPE_UINT32_GETVAL(param_frag_timeout);
-	conntrack_timer_queue(tmp->t, *frag_timeout, p->ts);
+	conntrack_timer_queue(tmp->t, pom_sec_ptime(*frag_timeout), p->ts);
 
 
 	if (!frag_more)
@@ -226,10 +231,9 @@ static int proto_ipv6_process_fragment(struct packet *p, struct proto_process_st
 
 	struct packet_multipart *m = NULL;
 
-	if ((tmp->flags & PROTO_IPV6_FLAG_GOT_LAST) && !tmp->multipart->gaps) {
+	if ((tmp->flags & PROTO_IPV6_FLAG_GOT_LAST) && !tmp->frag.multipart->gaps) {
 		tmp->flags |= PROTO_IPV6_FLAG_PROCESSED;
-		m = tmp->multipart;
-		tmp->multipart = NULL;
+		m = packet_frag_release(&tmp->frag);
 	}
 
 
@@ -237,7 +241,7 @@ static int proto_ipv6_process_fragment(struct packet *p, struct proto_process_st
 	conntrack_unlock(s->ce);
 
 	if (m) {
-		int res = packet_multipart_process(m, stack, stack_index + 1);
+		res = packet_multipart_process(m, stack, stack_index + 1);
 		if (res == PROTO_ERR) {
 			return PROTO_ERR;
 		} else if (res == PROTO_INVALID) {
@@ -282,7 +286,7 @@ static int proto_ipv6_process(void *proto_priv, struct packet *p, struct proto_p
 		}
 	} else {
 		uint32_t *conntrack_timeout = PTYPE_UINT32_GETVAL(param_conntrack_timeout);
-		if (conntrack_delayed_cleanup(s->ce, *conntrack_timeout, p->ts) != POM_OK) {
+		if (conntrack_delayed_cleanup(s->ce, pom_sec_ptime(*conntrack_timeout), p->ts) != POM_OK) {
 			conntrack_unlock(s->ce);
 			return PROTO_ERR;
 		}
@@ -338,14 +342,16 @@ static int proto_ipv6_fragment_cleanup(struct conntrack_entry *ce, void *priv, p
 	if (f->next)
 		f->next->prev = f->prev;
 
+	struct packet_multipart *m = packet_frag_release(&f->frag);
+
 	conntrack_unlock(ce);
 
 	if (!(f->flags & PROTO_IPV6_FLAG_PROCESSED)) {
 		registry_perf_inc(perf_frags_dropped, f->count);
 	}
 
-	if (f->multipart)
-		packet_multipart_cleanup(f->multipart);
+	if (m)
+		packet_multipart_cleanup(m);
 	
 	if (f->t)
 		conntrack_timer_cleanup(f->t);
@@ -368,8 +374,9 @@ static int proto_ipv6_conntrack_cleanup(void *ce_priv) {
 			registry_perf_inc(perf_frags_dropped, f->count);
 		}
 
-		if (f->multipart)
-			packet_multipart_cleanup(f->multipart);
+		struct packet_multipart *m = packet_frag_release(&f->frag);
+		if (m)
+			packet_multipart_cleanup(m);
 		
 		if (f->t)
 			conntrack_timer_cleanup(f->t);
@@ -41,7 +41,7 @@ struct proto_ipv6_fragment {
 
 	uint32_t id;
 	unsigned int count;
-	struct packet_multipart *multipart;
+	struct packet_frag frag;
 	unsigned int flags;
 	struct conntrack_timer *t;
 	struct proto_ipv6_fragment *prev, *next;
@@ -152,7 +152,7 @@ static int proto_pppoe_process(void *proto_priv, struct packet *p, struct proto_
 
 	if (conntrack_get(stack, stack_index) != POM_OK)
 		return PROTO_ERR;
-	conntrack_delayed_cleanup(s->ce, *PTYPE_UINT16_GETVAL(priv->p_session_timeout) , p->ts);
+	conntrack_delayed_cleanup(s->ce, pom_sec_ptime(*PTYPE_UINT16_GETVAL(priv->p_session_timeout)), p->ts);
 	conntrack_unlock(s->ce);
 
 	struct proto_process_stack *s_next = &stack[stack_index + 1];
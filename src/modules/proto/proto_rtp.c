@@ -32,7 +32,7 @@
 
 #include "proto_rtp.h"
 
-static struct ptype *proto_rtp_p_buffer_timeout = NULL, *proto_rtp_p_stream_timeout = NULL;
+static struct ptype *proto_rtp_p_buffer_timeout_ms = NULL, *proto_rtp_p_stream_timeout = NULL;
 
 
 struct mod_reg_info* proto_rtp_reg_info() {
@@ -90,16 +90,16 @@ static int proto_rtp_mod_register(struct mod_reg *mod) {
 static int proto_rtp_init(struct proto *proto, struct registry_instance *i) {
 
 
-	proto_rtp_p_buffer_timeout = ptype_alloc_unit("uint16", "seconds");
+	proto_rtp_p_buffer_timeout_ms = ptype_alloc_unit("uint32", "milliseconds");
 	proto_rtp_p_stream_timeout = ptype_alloc_unit("uint32", "seconds");
-	if (!proto_rtp_p_buffer_timeout || !proto_rtp_p_stream_timeout)
+	if (!proto_rtp_p_buffer_timeout_ms || !proto_rtp_p_stream_timeout)
 		return POM_ERR;
 
 	struct registry_param *p = registry_new_param("stream_timeout", "180", proto_rtp_p_stream_timeout, "Timeout for RTP connections", 0);
 	if (proto_add_param(proto, p) != POM_OK)
 		goto err;
 
-	p = registry_new_param("buffer_timeout", "1", proto_rtp_p_buffer_timeout, "Timeout for the jitter buffer", 0);
+	p = registry_new_param("buffer_timeout_ms", "200", proto_rtp_p_buffer_timeout_ms, "Timeout for the jitter buffer in milliseconds", 0);
 	if (proto_add_param(proto, p) != POM_OK)
 		goto err;
 
@@ -113,9 +113,9 @@ err:
 
 static int proto_rtp_cleanup(void *proto_priv) {
 
-	if (proto_rtp_p_buffer_timeout) {
-		ptype_cleanup(proto_rtp_p_buffer_timeout);
-		proto_rtp_p_buffer_timeout = NULL;
+	if (proto_rtp_p_buffer_timeout_ms) {
+		ptype_cleanup(proto_rtp_p_buffer_timeout_ms);
+		proto_rtp_p_buffer_timeout_ms = NULL;
 	}
 	if (proto_rtp_p_stream_timeout) {
 		ptype_cleanup(proto_rtp_p_stream_timeout);
@@ -280,9 +280,9 @@ static int proto_rtp_stream_process_queue(struct proto_rtp_stream *stream, ptime
 	}
 
 	if (stream->head)
-		conntrack_timer_queue(stream->t, *PTYPE_UINT32_GETVAL(proto_rtp_p_buffer_timeout), now);
+		conntrack_timer_queue(stream->t, pom_msec_ptime(*PTYPE_UINT32_GETVAL(proto_rtp_p_buffer_timeout_ms)), now);
 	else
-		conntrack_timer_queue(stream->t, *PTYPE_UINT32_GETVAL(proto_rtp_p_stream_timeout), now);
+		conntrack_timer_queue(stream->t, pom_sec_ptime(*PTYPE_UINT32_GETVAL(proto_rtp_p_stream_timeout)), now);
 
 	return POM_OK;
 }
@@ -304,7 +304,7 @@ static int proto_rtp_stream_timeout(struct conntrack_entry *ce, void *priv, ptim
 
 		if (!cpriv->streams) {
 			// Timeout the conntrack shortly after
-			conntrack_delayed_cleanup(ce, 1, now);
+			conntrack_delayed_cleanup(ce, pom_sec_ptime(1), now);
 		}
 		conntrack_unlock(ce);
 		return POM_OK;
@@ -336,7 +336,7 @@ static int proto_rtp_stream_process_packet(struct proto_rtp_stream *stream, stru
 		if (stream->head)
 			res = proto_rtp_stream_process_queue(stream, pkt->ts);
 		else
-			conntrack_timer_queue(stream->t, *PTYPE_UINT32_GETVAL(proto_rtp_p_stream_timeout), pkt->ts);
+			conntrack_timer_queue(stream->t, pom_sec_ptime(*PTYPE_UINT32_GETVAL(proto_rtp_p_stream_timeout)), pkt->ts);
 		return res;
 	}
 
@@ -372,7 +372,7 @@ static int proto_rtp_stream_process_packet(struct proto_rtp_stream *stream, stru
 	p->seq = seq;
 
 	if (!stream->head)
-		conntrack_timer_queue(stream->t, *PTYPE_UINT32_GETVAL(proto_rtp_p_buffer_timeout), pkt->ts);
+		conntrack_timer_queue(stream->t, pom_msec_ptime(*PTYPE_UINT32_GETVAL(proto_rtp_p_buffer_timeout_ms)), pkt->ts);
 
 	if (!tmp) {
 		// Packet goes at the head
@@ -273,7 +273,7 @@ static int proto_sip_process(void *proto_priv, struct packet *p, struct proto_pr
 
 	struct proto_sip_priv *ppriv = proto_priv;
 	if (stack[stack_index - 1].proto == ppriv->proto_udp) {
-		if (conntrack_delayed_cleanup(s->ce, *PTYPE_UINT32_GETVAL(ppriv->p_udp_timeout), p->ts) != POM_OK) {
+		if (conntrack_delayed_cleanup(s->ce, pom_sec_ptime(*PTYPE_UINT32_GETVAL(ppriv->p_udp_timeout)), p->ts) != POM_OK) {
 			res = PROTO_ERR;
 			goto end;
 		}
@@ -244,10 +244,10 @@ static int proto_tcp_update_state(struct proto_tcp_priv *ppriv, struct proto_tcp
 	debug_tcp("Connection %p (stream %p) : Timing out in %u seconds", priv, priv->stream, *delay);
 	if (priv->stream) {
 		// If there is a stream, it will kill the conntrack for us
-		if (stream_set_timeout(priv->stream, *delay) != POM_OK)
+		if (stream_set_timeout(priv->stream, pom_sec_ptime(*delay)) != POM_OK)
 			return PROTO_ERR;
 	} else {
-		if (conntrack_delayed_cleanup(ce, *delay, ts) != POM_OK)
+		if (conntrack_delayed_cleanup(ce, pom_sec_ptime(*delay), ts) != POM_OK)
 			return PROTO_ERR;
 	}
 
@@ -400,7 +400,8 @@ static int proto_tcp_process(void *proto_priv, struct packet *p, struct proto_pr
 			conntrack_unlock(s->ce);
 			return PROTO_ERR;
 		}
-		if (stream_set_timeout(priv->stream, *PTYPE_UINT16_GETVAL(ppriv->param_tcp_stream_timeout)) != POM_OK) {
+		stream_set_gap_handler(priv->stream, proto_tcp_process_gap);
+		if (stream_set_timeout(priv->stream, pom_sec_ptime(*PTYPE_UINT16_GETVAL(ppriv->param_tcp_stream_timeout))) != POM_OK) {
 			conntrack_unlock(s->ce);
 			stream_cleanup(priv->stream);
 			priv->stream = NULL;
@@ -474,6 +475,21 @@ static int proto_tcp_process_payload(struct conntrack_entry *ce, struct packet *
 	return core_process_multi_packet(stack, stack_index, p);
 }
 
+static int proto_tcp_process_gap(struct conntrack_entry *ce, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index) {
+
+	struct proto_tcp_conntrack_priv *cp = ce->priv;
+
+	if (!cp->proto)
+		return PROTO_OK;
+
+	// Let the stream fill the gap with zeros if the next proto can't handle it
+	if (!(proto_get_info(cp->proto)->flags & PROTO_REG_FLAG_GAP))
+		return STREAM_GAP_FILL;
+
+	stack[stack_index].proto = cp->proto;
+	return core_process_multi_packet(stack, stack_index, p);
+}
+
 
 static int proto_tcp_conntrack_cleanup(void *ce_priv) {
 
@@ -79,6 +79,7 @@ static int proto_tcp_init(struct proto *proto, struct registry_instance *i);
 static int proto_tcp_mod_register(struct mod_reg *mod);
 static int proto_tcp_process(void *proto_priv, struct packet *p, struct proto_process_stack *s, unsigned int stack_index);
 static int proto_tcp_process_payload(struct conntrack_entry *ce, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
+static int proto_tcp_process_gap(struct conntrack_entry *ce, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
 static int proto_tcp_conntrack_cleanup(void *ce_priv);
 static int proto_tcp_cleanup(void *proto_priv);
 static int proto_tcp_mod_unregister();
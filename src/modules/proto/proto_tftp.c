@@ -170,7 +170,7 @@ static int proto_tftp_process(void *proto_priv, struct packet *p, struct proto_p
 
 			proto_expectation_set_session(expt, session);
 
-			if (proto_expectation_add_and_cleanup(expt, PROTO_TFTP_EXPT_TIMER, p->ts) != POM_OK) {
+			if (proto_expectation_add_and_cleanup(expt, pom_sec_ptime(PROTO_TFTP_EXPT_TIMER), p->ts) != POM_OK) {
 				conntrack_unlock(s->ce);
 				proto_expectation_cleanup(expt);
 				return PROTO_ERR;
@@ -193,7 +193,7 @@ static int proto_tftp_process(void *proto_priv, struct packet *p, struct proto_p
 					conntrack_unlock(s->ce);
 					return PROTO_ERR;
 				}
-				stream_set_timeout(priv->stream, PROTO_TFTP_PKT_TIMER);
+				stream_set_timeout(priv->stream, pom_sec_ptime(PROTO_TFTP_PKT_TIMER));
 				set_start_seq = 1;
 			}
 
@@ -212,7 +212,7 @@ static int proto_tftp_process(void *proto_priv, struct packet *p, struct proto_p
 
 		case tftp_error:
 			// An error occured, cleanup this conntrack soon
-			if (conntrack_delayed_cleanup(s->ce, 1, p->ts) != POM_OK) {
+			if (conntrack_delayed_cleanup(s->ce, pom_sec_ptime(1), p->ts) != POM_OK) {
 				conntrack_unlock(s->ce);
 				return PROTO_ERR;
 			}
@@ -224,7 +224,7 @@ static int proto_tftp_process(void *proto_priv, struct packet *p, struct proto_p
 			return PROTO_INVALID;
 	}
 
-	conntrack_delayed_cleanup(s->ce, PROTO_TFTP_PKT_TIMER, p->ts);
+	conntrack_delayed_cleanup(s->ce, pom_sec_ptime(PROTO_TFTP_PKT_TIMER), p->ts);
 	conntrack_unlock(s->ce);
 	return PROTO_OK;
 }
@@ -146,7 +146,7 @@ static int proto_udp_process(void *proto_priv, struct packet *p, struct proto_pr
 		s_next->proto = s->ce->children->ce->proto;
 	} else {
 		uint32_t *conntrack_timeout = PTYPE_UINT32_GETVAL(param_conntrack_timeout);
-		res = conntrack_delayed_cleanup(s->ce, *conntrack_timeout, p->ts);
+		res = conntrack_delayed_cleanup(s->ce, pom_sec_ptime(*conntrack_timeout), p->ts);
 	}
 
 	conntrack_unlock(s->ce);
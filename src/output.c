@@ -139,7 +139,8 @@ int output_instance_add(char *type, char *name) {
 	res->reg_instance->priv = res;
 
 	res->perf_runtime = registry_instance_add_perf(res->reg_instance, "runtime", registry_perf_type_timeticks, "Runtime", NULL);
-	if (!res->perf_runtime)
+	res->perf_listener_time = registry_instance_add_perf(res->reg_instance, "listener_time", registry_perf_type_histogram, "Time spent in the output listeners", "ns");
+	if (!res->perf_runtime || !res->perf_listener_time)
 		goto err;
 
 	struct ptype *param_running_val = ptype_alloc("bool");
@@ -335,6 +336,31 @@ int output_unregister(char *name) {
 	return POM_OK;
 }
 
+static struct output *output_find_listener_owner(void *obj) {
+
+	// Outputs register their listeners with their private data
+	// Only used when registering listeners, from the thread managing the outputs
+	struct output *tmp;
+	for (tmp = output_head; tmp; tmp = tmp->next) {
+		if (tmp->priv && obj == tmp->priv)
+			return tmp;
+	}
+
+	return NULL;
+}
+
+struct registry_perf *output_get_listener_perf(void *obj) {
+
+	struct output *o = output_find_listener_owner(obj);
+	return (o ? o->perf_listener_time : NULL);
+}
+
+char *output_get_listener_name(void *obj) {
+
+	struct output *o = output_find_listener_owner(obj);
+	return (o ? o->name : NULL);
+}
+
 void output_set_priv(struct output *o, void *priv) {
 	o->priv = priv;
 }
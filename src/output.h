@@ -34,6 +34,7 @@ struct output {
 	int running;
 
 	struct registry_perf *perf_runtime;
+	struct registry_perf *perf_listener_time;
 
 	void *priv;
 
@@ -57,4 +58,6 @@ int output_instance_remove(struct registry_instance *ri);
 int output_stop_all();
 int output_instance_start_stop_handler(void *priv, struct registry_param *p, struct ptype *run);
 int output_param_locked_while_running(void *output, struct registry_param *p, char *param);
+struct registry_perf *output_get_listener_perf(void *obj);
+char *output_get_listener_name(void *obj);
 #endif
@@ -27,6 +27,12 @@
 #include "core.h"
 #include "filter.h"
 
+#include <pom-ng/ptype_ipv4.h>
+#include <pom-ng/ptype_ipv6.h>
+#include <pom-ng/ptype_mac.h>
+
+#include <arpa/inet.h>
+
 #if 0
 #define debug_stream_parser(x ...) pomlog(POMLOG_DEBUG "stream_parser: " x)
 #else
@@ -45,13 +51,61 @@
 
 static struct registry_perf *perf_pkt_buff = NULL;
 static struct registry_perf *perf_pkt_in_use = NULL;
+static struct registry_perf *perf_frag_buff = NULL;
+static struct registry_perf *perf_frag_evicted = NULL;
+static struct registry_perf *perf_frag_overlap = NULL;
+static struct registry_perf *perf_frag_quota_dropped = NULL;
+
+// Fragment cache, least recently used first
+static pthread_mutex_t packet_frag_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct packet_frag *packet_frag_head = NULL, *packet_frag_tail = NULL;
+static size_t packet_frag_size = 0;
+static size_t packet_frag_src_size[PACKET_FRAG_SRC_BUCKETS] = { 0 };
+
+// BPF filter of the packet listeners
+static pthread_mutex_t packet_bpf_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *packet_bpf_untagged = NULL, *packet_bpf_tagged = NULL;
+static enum packet_bpf_type packet_bpf_tagged_type = packet_bpf_type_none;
+static int packet_bpf_enabled = 0;
+static volatile unsigned int packet_bpf_serial = 0;
+
+// Packets whose content BPF can't see : fragments, tunnels and IPv6 extension headers
+#define PACKET_BPF_ENCAP "ip[6:2] & 0x3fff != 0 or ip6[6] == 0 or ip6[6] == 43 or ip6[6] == 44 or ip6[6] == 60 or ip proto 4 or ip proto 41 or ip proto 47 or ip6 proto 4 or ip6 proto 41 or ip6 proto 47"
+#define PACKET_BPF_ENCAP_ETHERNET "ether proto 0x8864"
+
+static struct packet_bpf_proto {
+	char *proto;
+	char *expr;
+} packet_bpf_protos[] = {
+	{ "ipv4", "ip" },
+	{ "ipv6", "ip6" },
+	{ "tcp", "tcp" },
+	{ "udp", "udp" },
+	{ "icmp", "icmp" },
+	{ "icmp6", "icmp6" },
+	{ "arp", "arp" },
+	{ NULL, NULL },
+};
+
+static int packet_perf_frag_buff_update(uint64_t *cur_val, void *priv) {
+
+	*cur_val = packet_frag_size;
+	return POM_OK;
+}
 
 int packet_init() {
 	perf_pkt_buff = core_add_perf("pkt_buff", registry_perf_type_gauge, "Number of bytes used by packets", "bytes");
 	perf_pkt_in_use = core_add_perf("pkt_in_use", registry_perf_type_gauge, "Number of packets in use", "pkts");
+	perf_frag_buff = core_add_perf("fragment_buff", registry_perf_type_gauge, "Number of bytes used by fragments waiting to be reassembled", "bytes");
+	perf_frag_evicted = core_add_perf("fragment_evicted", registry_perf_type_counter, "Number of incomplete packets evicted to make room for new fragments", "pkts");
+	perf_frag_overlap = core_add_perf("fragment_overlap", registry_perf_type_counter, "Number of packets dropped because of overlapping fragments", "pkts");
+	perf_frag_quota_dropped = core_add_perf("fragment_quota_dropped", registry_perf_type_counter, "Number of fragments dropped because their source exceeded its quota", "pkts");
 
-	if (!perf_pkt_buff || !perf_pkt_in_use)
+	if (!perf_pkt_buff || !perf_pkt_in_use || !perf_frag_buff || !perf_frag_evicted || !perf_frag_overlap || !perf_frag_quota_dropped)
 		return POM_ERR;
+
+	registry_perf_set_update_hook(perf_frag_buff, packet_perf_frag_buff_update, NULL);
+
 	return POM_OK;
 }
 
@@ -219,6 +273,8 @@ struct packet_info *packet_info_pool_get(struct proto *p) {
 		debug_info_pool("Allocated info %p for proto %s", info, p->info->name);
 	}
 
+	info->refcount = 1;
+
 	return info;
 }
 
@@ -241,11 +297,23 @@ struct packet_info *packet_info_pool_clone(struct proto *p, struct packet_info *
 }
 
 
+struct packet_info *packet_info_pool_ref(struct packet_info *info) {
+
+	// The values must not be modified anymore once the info is shared
+	__sync_fetch_and_add(&info->refcount, 1);
+
+	return info;
+}
+
 int packet_info_pool_release(struct packet_info *info, unsigned int protocol_id) {
 
 	if (!info)
 		return POM_OK;
 
+	// Still used by someone else
+	if (info->refcount > 1 && __sync_sub_and_fetch(&info->refcount, 1))
+		return POM_OK;
+
 	info->next = packet_info_pool[protocol_id];
 	packet_info_pool[protocol_id] = info;
 
@@ -302,6 +370,7 @@ struct packet_multipart *packet_multipart_alloc(struct proto *proto, unsigned in
 	}
 	memset(res, 0, sizeof(struct packet_multipart));
 
+	res->proto = proto;
 	res->flags = flags;
 	res->align_offset = align_offset;
 
@@ -324,34 +393,77 @@ int packet_multipart_cleanup(struct packet_multipart *m) {
 
 	}
 
+	if (m->blocks)
+		free(m->blocks);
+
 	free(m);
 
 	return POM_OK;
 
 }
 
+static int packet_multipart_mark_blocks(struct packet_multipart *multipart, size_t first, size_t last) {
 
-int packet_multipart_add_packet(struct packet_multipart *multipart, struct packet *pkt, size_t offset, size_t len, size_t pkt_buff_offset) {
+	unsigned int size = (last + 63) / 64;
+	if (size > multipart->blocks_size) {
+		uint64_t *blocks = realloc(multipart->blocks, size * sizeof(uint64_t));
+		if (!blocks) {
+			pom_oom(size * sizeof(uint64_t));
+			return POM_ERR;
+		}
+		memset(blocks + multipart->blocks_size, 0, (size - multipart->blocks_size) * sizeof(uint64_t));
+		multipart->blocks = blocks;
+		multipart->blocks_size = size;
+	}
 
-	struct packet_multipart_pkt *tmp = multipart->tail;
+	int added = 0;
+	size_t i = first;
+	while (i < last) {
+		unsigned int bit = i % 64;
+		size_t count = 64 - bit;
+		if (count > last - i)
+			count = last - i;
+		uint64_t mask = (count == 64 ? ~0ULL : ((1ULL << count) - 1) << bit);
+		added += __builtin_popcountll(mask & ~multipart->blocks[i / 64]);
+		multipart->blocks[i / 64] |= mask;
+		i += count;
+	}
 
-	// Check where to add the packet
-	
-	while (tmp) {
+	return added;
+}
 
-		if (tmp->offset + tmp->len <= offset)
-			break; // Packet is after is one
+static size_t packet_multipart_count_blocks(struct packet_multipart *multipart, size_t first, size_t last) {
 
-		if (tmp->offset == offset) {
-			if (tmp->len != len)
-				pomlog(POMLOG_WARN "Size missmatch for packet already in the buffer");
-			return POM_OK;
-		}
+	size_t count = 0, i;
+	for (i = first; i < last && i / 64 < multipart->blocks_size; i++) {
+		if (multipart->blocks[i / 64] & (1ULL << (i % 64)))
+			count++;
+	}
+
+	return count;
+}
+
+int packet_multipart_add_packet(struct packet_multipart *multipart, struct packet *pkt, size_t offset, size_t len, size_t pkt_buff_offset) {
+
+	// A block is marked when its first byte is part of the range
+	size_t first = (offset + PACKET_MULTIPART_BLOCK - 1) / PACKET_MULTIPART_BLOCK;
+	size_t last = (offset + len + PACKET_MULTIPART_BLOCK - 1) / PACKET_MULTIPART_BLOCK;
 
-		tmp = tmp->prev;
+	int added = 0;
+	if (first < last) {
+		added = packet_multipart_mark_blocks(multipart, first, last);
+		if (added < 0)
+			return POM_ERR;
 
+		if (!added) // All the blocks of this part were already received
+			return POM_OK;
 	}
 
+	multipart->blocks_set += added;
+	if (offset + len > multipart->cur)
+		multipart->cur = offset + len;
+	multipart->gaps = (multipart->cur + PACKET_MULTIPART_BLOCK - 1) / PACKET_MULTIPART_BLOCK - multipart->blocks_set;
+
 	struct packet_multipart_pkt *res = malloc(sizeof(struct packet_multipart_pkt));
 	if (!res) {
 		pom_oom(sizeof(struct packet_multipart_pkt));
@@ -363,93 +475,71 @@ int packet_multipart_add_packet(struct packet_multipart *multipart, struct packe
 	res->pkt_buff_offset = pkt_buff_offset;
 	res->len = len;
 
-
-	// Copy the packet
-
-	
-	res->pkt = packet_clone(pkt, multipart->flags);
-	if (!res->pkt) {
-		free(res);
-		return POM_ERR;
-	}
-
-	multipart->cur += len;
-
-	if (tmp) {
-		// Packet is after this one, add it
-	
-		res->prev = tmp;
-		res->next = tmp->next;
-
-		tmp->next = res;
-
-		if (res->next) {
-			res->next->prev = res;
-
-			if ((res->next->offset == res->offset + res->len) &&
-				(res->prev->offset + res->prev->len == res->offset))
-				// A gap was filled
-				multipart->gaps--;
-			else if ((res->next->offset > res->offset + res->len) &&
-				(res->prev->offset + res->prev->len < res->offset))
-				// A gap was created
-				multipart->gaps++;
-
-		} else {
-
-			if (tmp->offset + tmp->len < res->offset)
-				multipart->gaps++;
-
-			multipart->tail = res;
+	if (!(multipart->flags & PACKET_FLAG_FORCE_NO_COPY) && !pkt->pkt_buff) {
+		// The packet would be copied anyway, only keep our part with the right alignment
+		res->pkt = packet_alloc();
+		if (!res->pkt) {
+			free(res);
+			return POM_ERR;
 		}
-
-
-		return POM_OK;
+		if (packet_buffer_alloc(res->pkt, len, multipart->align_offset) != POM_OK) {
+			packet_release(res->pkt);
+			free(res);
+			return POM_ERR;
+		}
+		memcpy(res->pkt->buff, pkt->buff + pkt_buff_offset, len);
+		res->pkt->ts = pkt->ts;
+		res->pkt->datalink = pkt->datalink;
+		res->pkt->input = pkt->input;
+		res->pkt_buff_offset = 0;
 	} else {
-		// Add it at the head
-		res->next = multipart->head;
-		if (res->next)
-			res->next->prev = res;
-		else
-			multipart->tail = res;
-		multipart->head = res;
-
-		if (res->offset) {
-			// There is a gap at the begining
-			multipart->gaps++;
-		} else if (res->next && res->len == res->next->offset) {
-			// Gap filled
-			multipart->gaps--;
+		res->pkt = packet_clone(pkt, multipart->flags);
+		if (!res->pkt) {
+			free(res);
+			return POM_ERR;
 		}
 	}
 
+	// Parts are kept in the order they were received, later ones win when they overlap
+	res->prev = multipart->tail;
+	if (res->prev)
+		res->prev->next = res;
+	else
+		multipart->head = res;
+	multipart->tail = res;
+
 	return POM_OK;
 }
 
 int packet_multipart_process(struct packet_multipart *multipart, struct proto_process_stack *stack, unsigned int stack_index) {
 
-	struct packet *p = packet_alloc();
-	if (!p) {
+	if (!multipart->head) {
 		packet_multipart_cleanup(multipart);
-		return PROTO_ERR;
+		return PROTO_INVALID;
 	}
 
-
-	if (packet_buffer_alloc(p, multipart->cur, multipart->align_offset)) {
-		packet_release(p);
+	struct packet *p = packet_alloc();
+	if (!p) {
 		packet_multipart_cleanup(multipart);
 		return PROTO_ERR;
 	}
 
 	struct packet_multipart_pkt *tmp = multipart->head;
-	for (; tmp; tmp = tmp->next) {
-		if (tmp->offset + tmp->len > multipart->cur) {
-			pomlog(POMLOG_DEBUG "Offset in packet fragment is bigger than packet size.");
+	void *data = tmp->pkt->buff + tmp->pkt_buff_offset;
+
+	if (!tmp->next && !tmp->offset && tmp->len == multipart->cur && ((uintptr_t) data & (PACKET_BUFFER_ALIGNMENT - 1)) == multipart->align_offset) {
+		// There is a single part, use it in place. It is released with the multipart.
+		p->buff = data;
+	} else {
+		// Upper protos need a contiguous buffer
+		if (packet_buffer_alloc(p, multipart->cur, multipart->align_offset)) {
 			packet_release(p);
 			packet_multipart_cleanup(multipart);
-			return PROTO_INVALID;
+			return PROTO_ERR;
 		}
-		memcpy(p->buff + tmp->offset, tmp->pkt->buff + tmp->pkt_buff_offset, tmp->len);
+
+		for (; tmp; tmp = tmp->next)
+			memcpy(p->buff + tmp->offset, tmp->pkt->buff + tmp->pkt_buff_offset, tmp->len);
 	}
 
 	p->ts = multipart->tail->pkt->ts;
@@ -469,6 +559,170 @@ int packet_multipart_process(struct packet_multipart *multipart, struct proto_pr
 	return (res == PROTO_ERR ? POM_ERR : POM_OK);
 }
 
+static void packet_frag_unlink(struct packet_frag *f) {
+
+	// Must be called with packet_frag_lock held
+
+	if (f->lru_prev)
+		f->lru_prev->lru_next = f->lru_next;
+	else
+		packet_frag_head = f->lru_next;
+
+	if (f->lru_next)
+		f->lru_next->lru_prev = f->lru_prev;
+	else
+		packet_frag_tail = f->lru_prev;
+
+	f->lru_prev = NULL;
+	f->lru_next = NULL;
+	f->linked = 0;
+
+	packet_frag_size -= f->size;
+	packet_frag_src_size[f->src_bucket] -= f->size;
+	f->size = 0;
+}
+
+static int packet_frag_evict(struct packet_frag *f, size_t len, uint64_t max_size) {
+
+	// Must be called with packet_frag_lock held
+
+	unsigned int i;
+	struct packet_frag *tmp = packet_frag_head;
+	for (i = 0; tmp && i < PACKET_FRAG_EVICT_SCAN && packet_frag_size + len > max_size; i++) {
+
+		struct packet_frag *victim = tmp;
+		tmp = tmp->lru_next;
+
+		// Don't wait for a conntrack in use, including ours
+		if (victim == f || pthread_mutex_trylock(&victim->ce->lock))
+			continue;
+
+		packet_frag_unlink(victim);
+		packet_multipart_cleanup(victim->multipart);
+		victim->multipart = NULL;
+		conntrack_unlock(victim->ce);
+
+		registry_perf_inc(perf_frag_evicted, 1);
+	}
+
+	return (packet_frag_size + len > max_size ? POM_ERR : POM_OK);
+}
+
+static size_t packet_frag_charge(struct packet_multipart *m, struct packet *pkt, size_t len, size_t last) {
+
+	// Memory held by packet_multipart_add_packet() for this fragment, not just its payload
+	size_t charge = sizeof(struct packet_multipart_pkt);
+
+	if (!(m->flags & PACKET_FLAG_FORCE_NO_COPY) && !pkt->pkt_buff)
+		charge += sizeof(struct packet) + len;
+	else
+		charge += pkt->len; // The whole packet is kept referenced
+
+	unsigned int blocks_size = (last + 63) / 64;
+	if (blocks_size > m->blocks_size)
+		charge += (blocks_size - m->blocks_size) * sizeof(uint64_t);
+
+	if (!m->head)
+		charge += sizeof(struct packet_multipart);
+
+	return charge;
+}
+
+int packet_frag_add(struct packet_frag *f, struct conntrack_entry *ce, struct packet *pkt, size_t offset, size_t len, size_t pkt_buff_offset, void *src, size_t src_len) {
+
+	struct packet_multipart *m = f->multipart;
+	if (!m)
+		return PACKET_FRAG_DROPPED;
+
+	// Fragments overlapping the ones we have, without being duplicates, are never legitimate
+	size_t first = (offset + PACKET_MULTIPART_BLOCK - 1) / PACKET_MULTIPART_BLOCK;
+	size_t last = (offset + len + PACKET_MULTIPART_BLOCK - 1) / PACKET_MULTIPART_BLOCK;
+	size_t found = packet_multipart_count_blocks(m, first, last);
+	if (found && found < last - first) {
+		packet_multipart_cleanup(packet_frag_release(f));
+		registry_perf_inc(perf_frag_overlap, 1);
+		return PACKET_FRAG_DROPPED;
+	} else if (found && found == last - first) {
+		// Duplicate, nothing to account for
+		return POM_OK;
+	}
+
+	size_t charge = packet_frag_charge(m, pkt, len, last);
+	uint64_t max_size = core_get_frag_buffer_max();
+	uint64_t src_quota = core_get_frag_source_quota();
+
+	pom_mutex_lock(&packet_frag_lock);
+
+	if (!f->linked) {
+		size_t i;
+		uint32_t hash = 2166136261U;
+		for (i = 0; i < src_len; i++)
+			hash = (hash ^ ((unsigned char *) src)[i]) * 16777619U;
+		f->src_bucket = hash % PACKET_FRAG_SRC_BUCKETS;
+		f->ce = ce;
+	}
+
+	if (src_quota && packet_frag_src_size[f->src_bucket] + charge > src_quota) {
+		pom_mutex_unlock(&packet_frag_lock);
+		registry_perf_inc(perf_frag_quota_dropped, 1);
+		return PACKET_FRAG_DROPPED;
+	}
+
+	if (max_size && packet_frag_size + charge > max_size && packet_frag_evict(f, charge, max_size) != POM_OK) {
+		pom_mutex_unlock(&packet_frag_lock);
+		return PACKET_FRAG_DROPPED;
+	}
+
+	// Most recently used goes last
+	if (f->linked) {
+		if (f != packet_frag_tail) {
+			if (f->lru_prev)
+				f->lru_prev->lru_next = f->lru_next;
+			else
+				packet_frag_head = f->lru_next;
+			f->lru_next->lru_prev = f->lru_prev;
+			f->lru_next = NULL;
+			f->lru_prev = packet_frag_tail;
+			packet_frag_tail->lru_next = f;
+			packet_frag_tail = f;
+		}
+	} else {
+		f->lru_prev = packet_frag_tail;
+		if (packet_frag_tail)
+			packet_frag_tail->lru_next = f;
+		else
+			packet_frag_head = f;
+		packet_frag_tail = f;
+		f->linked = 1;
+	}
+
+	f->size += charge;
+	packet_frag_size += charge;
+	packet_frag_src_size[f->src_bucket] += charge;
+
+	pom_mutex_unlock(&packet_frag_lock);
+
+	if (packet_multipart_add_packet(m, pkt, offset, len, pkt_buff_offset) != POM_OK)
+		return POM_ERR;
+
+	return POM_OK;
+}
+
+struct packet_multipart *packet_frag_release(struct packet_frag *f) {
+
+	pom_mutex_lock(&packet_frag_lock);
+
+	if (f->linked)
+		packet_frag_unlink(f);
+
+	struct packet_multipart *m = f->multipart;
+	f->multipart = NULL;
+
+	pom_mutex_unlock(&packet_frag_lock);
+
+	return m;
+}
+
 struct packet_stream_parser *packet_stream_parser_alloc(size_t max_line_size, unsigned int flags) {
 	
 	struct packet_stream_parser *res = malloc(sizeof(struct packet_stream_parser));
@@ -801,3 +1055,389 @@ int packet_filter_match(struct filter *f, struct proto_process_stack *stack) {
 
 	return filter_match(f, stack);
 }
+
+// Conversion of the packet filters to BPF
+// Whatever can't be expressed is replaced by an expression matching more packets
+
+static void packet_bpf_set(struct packet_bpf *b, enum packet_bpf_type type, int exact) {
+
+	if (b->expr) {
+		free(b->expr);
+		b->expr = NULL;
+	}
+	b->type = type;
+	b->exact = exact;
+}
+
+static int packet_bpf_set_expr(struct packet_bpf *b, char *fmt, ...) {
+
+	char expr[256];
+
+	va_list arg_list;
+	va_start(arg_list, fmt);
+	vsnprintf(expr, sizeof(expr), fmt, arg_list);
+	va_end(arg_list);
+
+	packet_bpf_set(b, packet_bpf_type_expr, 1);
+	b->expr = strdup(expr);
+	if (!b->expr) {
+		pom_oom(strlen(expr) + 1);
+		return POM_ERR;
+	}
+
+	return POM_OK;
+}
+
+static char *packet_bpf_join(char *a, char *op, char *b) {
+
+	size_t len = strlen(a) + strlen(op) + strlen(b) + 7;
+	char *res = malloc(len);
+	if (res)
+		snprintf(res, len, "(%s) %s (%s)", a, op, b);
+	else
+		pom_oom(len);
+	free(a);
+	free(b);
+
+	return res;
+}
+
+int packet_bpf_and(struct packet_bpf *a, struct packet_bpf *b) {
+
+	int exact = a->exact && b->exact;
+
+	if (a->type == packet_bpf_type_none || b->type == packet_bpf_type_none) {
+		packet_bpf_set(a, packet_bpf_type_none, 1);
+		packet_bpf_set(b, packet_bpf_type_none, 1);
+		return POM_OK;
+	}
+
+	if (a->type == packet_bpf_type_any) {
+		*a = *b;
+	} else if (b->type == packet_bpf_type_expr) {
+		a->expr = packet_bpf_join(a->expr, "and", b->expr);
+		b->expr = NULL;
+		if (!a->expr) {
+			a->type = packet_bpf_type_none;
+			return POM_ERR;
+		}
+	}
+	a->exact = exact;
+	b->expr = NULL;
+
+	return POM_OK;
+}
+
+int packet_bpf_or(struct packet_bpf *a, struct packet_bpf *b) {
+
+	int exact = a->exact && b->exact;
+
+	if (a->type == packet_bpf_type_any || b->type == packet_bpf_type_any) {
+		packet_bpf_set(a, packet_bpf_type_any, exact);
+		packet_bpf_set(b, packet_bpf_type_any, exact);
+		return POM_OK;
+	}
+
+	if (a->type == packet_bpf_type_none) {
+		*a = *b;
+	} else if (b->type == packet_bpf_type_expr) {
+		a->expr = packet_bpf_join(a->expr, "or", b->expr);
+		b->expr = NULL;
+		if (!a->expr) {
+			a->type = packet_bpf_type_none;
+			return POM_ERR;
+		}
+	}
+	a->exact = exact;
+	b->expr = NULL;
+
+	return POM_OK;
+}
+
+static int packet_bpf_not(struct packet_bpf *b) {
+
+	if (!b->exact) {
+		packet_bpf_set(b, packet_bpf_type_any, 0);
+	} else if (b->type == packet_bpf_type_any) {
+		b->type = packet_bpf_type_none;
+	} else if (b->type == packet_bpf_type_none) {
+		b->type = packet_bpf_type_any;
+	} else {
+		size_t len = strlen(b->expr) + 7;
+		char *expr = malloc(len);
+		if (!expr) {
+			pom_oom(len);
+			return POM_ERR;
+		}
+		snprintf(expr, len, "not (%s)", b->expr);
+		free(b->expr);
+		b->expr = expr;
+	}
+
+	return POM_OK;
+}
+
+static int packet_bpf_proto(struct proto *proto, int tagged, struct packet_bpf *res) {
+
+	char *name = proto->info->name;
+
+	if (!strcmp(name, "vlan")) {
+		packet_bpf_set(res, (tagged ? packet_bpf_type_any : packet_bpf_type_none), 1);
+		return POM_OK;
+	}
+
+	int i;
+	for (i = 0; packet_bpf_protos[i].proto && strcmp(packet_bpf_protos[i].proto, name); i++);
+	if (!packet_bpf_protos[i].proto) {
+		packet_bpf_set(res, packet_bpf_type_any, 0);
+		return POM_OK;
+	}
+
+	return packet_bpf_set_expr(res, "%s", packet_bpf_protos[i].expr);
+}
+
+// Field of a protocol equals a constant
+static int packet_bpf_field(struct packet_filter_prop *prop, struct filter_value *v, int tagged, struct packet_bpf *res) {
+
+	char *proto = prop->proto->info->name;
+	char *field = prop->proto->info->pkt_fields[prop->field_id].name;
+
+	if (!strcmp(proto, "vlan") && !tagged) {
+		packet_bpf_set(res, packet_bpf_type_none, 1);
+		return POM_OK;
+	}
+
+	char *dir = NULL;
+	if (!strcmp(field, "src") || !strcmp(field, "sport"))
+		dir = "src";
+	else if (!strcmp(field, "dst") || !strcmp(field, "dport"))
+		dir = "dst";
+
+	if (dir && v->type == filter_value_type_ptype && (!strcmp(proto, "ipv4") || !strcmp(proto, "ipv6"))) {
+		char addr[INET6_ADDRSTRLEN + 1] = { 0 };
+		if (!strcmp(proto, "ipv4")) {
+			struct ptype_ipv4_val *val = v->val.ptype->value;
+			inet_ntop(AF_INET, &val->addr, addr, sizeof(addr));
+			return packet_bpf_set_expr(res, "ip %s net %s/%u", dir, addr, val->mask);
+		} else {
+			struct ptype_ipv6_val *val = v->val.ptype->value;
+			inet_ntop(AF_INET6, &val->addr, addr, sizeof(addr));
+			return packet_bpf_set_expr(res, "ip6 %s net %s/%u", dir, addr, val->mask);
+		}
+	} else if (dir && v->type == filter_value_type_int && (!strcmp(proto, "tcp") || !strcmp(proto, "udp"))) {
+		return packet_bpf_set_expr(res, "%s %s port %"PRIu64, proto, dir, v->val.integer);
+	} else if (dir && v->type == filter_value_type_ptype && !strcmp(proto, "ethernet")) {
+		unsigned char *addr = (unsigned char *) PTYPE_MAC_GETADDR(v->val.ptype);
+		unsigned char *mask = (unsigned char *) ((struct ptype_mac_val *) v->val.ptype->value)->mask;
+		if ((mask[0] & mask[1] & mask[2] & mask[3] & mask[4] & mask[5]) == 0xff)
+			return packet_bpf_set_expr(res, "ether %s %02x:%02x:%02x:%02x:%02x:%02x", dir, addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
+	} else if (v->type == filter_value_type_int && !strcmp(proto, "icmp") && v->val.integer <= 0xff) {
+		if (!strcmp(field, "type"))
+			return packet_bpf_set_expr(res, "icmp[0] == %"PRIu64, v->val.integer);
+		else if (!strcmp(field, "code"))
+			return packet_bpf_set_expr(res, "icmp[1] == %"PRIu64, v->val.integer);
+	}
+
+	packet_bpf_set(res, packet_bpf_type_any, 0);
+	return POM_OK;
+}
+
+static int packet_filter_node_to_bpf(struct filter_node *n, int tagged, struct packet_bpf *res) {
+
+	struct filter_value *v0 = &n->value[0], *v1 = &n->value[1];
+
+	if (n->op == FILTER_OP_AND || n->op == FILTER_OP_OR) {
+
+		struct packet_bpf b = { 0 };
+		if (packet_filter_node_to_bpf(v0->val.node, tagged, res) != POM_OK || packet_filter_node_to_bpf(v1->val.node, tagged, &b) != POM_OK) {
+			packet_bpf_set(&b, packet_bpf_type_none, 1);
+			return POM_ERR;
+		}
+
+		if ((n->op == FILTER_OP_AND ? packet_bpf_and(res, &b) : packet_bpf_or(res, &b)) != POM_OK)
+			return POM_ERR;
+
+		return (n->not ? packet_bpf_not(res) : POM_OK);
+	}
+
+	if (n->op == FILTER_OP_NOP) {
+		if (v0->type != filter_value_type_prop) {
+			// Constant value
+			packet_bpf_set(res, packet_bpf_type_any, 0);
+			return POM_OK;
+		}
+		// Presence of the protocol
+		struct packet_filter_prop *prop = v0->val.prop.priv;
+		if (packet_bpf_proto(prop->proto, tagged, res) != POM_OK)
+			return POM_ERR;
+		if (prop->field_id != -1)
+			res->exact = 0;
+
+		return (n->not ? packet_bpf_not(res) : POM_OK);
+	}
+
+	if (v1->type == filter_value_type_prop) {
+		struct filter_value *tmp = v0;
+		v0 = v1;
+		v1 = tmp;
+	}
+
+	if ((n->op != FILTER_OP_EQ && n->op != FILTER_OP_NEQ) || v0->type != filter_value_type_prop || v1->type == filter_value_type_prop) {
+		packet_bpf_set(res, packet_bpf_type_any, 0);
+		return POM_OK;
+	}
+
+	struct packet_filter_prop *prop = v0->val.prop.priv;
+	if (prop->field_id == -1) {
+		packet_bpf_set(res, packet_bpf_type_any, 0);
+		return POM_OK;
+	}
+
+	if (packet_bpf_field(prop, v1, tagged, res) != POM_OK)
+		return POM_ERR;
+
+	// A comparison never matches when the field is missing, even negated
+	if (n->not ^ (n->op == FILTER_OP_NEQ)) {
+		struct packet_bpf p = { 0 };
+		if (packet_bpf_not(res) != POM_OK || packet_bpf_proto(prop->proto, tagged, &p) != POM_OK || packet_bpf_and(res, &p) != POM_OK) {
+			packet_bpf_set(&p, packet_bpf_type_none, 1);
+			return POM_ERR;
+		}
+	}
+
+	return POM_OK;
+}
+
+int packet_filter_to_bpf(struct proto *proto, struct filter *f, int tagged, struct packet_bpf *res) {
+
+	memset(res, 0, sizeof(struct packet_bpf));
+
+	if (packet_bpf_proto(proto, tagged, res) != POM_OK)
+		return POM_ERR;
+
+	if (!f || !f->n)
+		return POM_OK;
+
+	struct packet_bpf b = { 0 };
+	if (packet_filter_node_to_bpf(f->n, tagged, &b) != POM_OK) {
+		packet_bpf_set(&b, packet_bpf_type_none, 1);
+		packet_bpf_set(res, packet_bpf_type_none, 1);
+		return POM_ERR;
+	}
+
+	return packet_bpf_and(res, &b);
+}
+
+static int packet_bpf_strcmp(char *a, char *b) {
+
+	if (!a || !b)
+		return (a != b);
+
+	return strcmp(a, b);
+}
+
+// Pass NULL if every packet is needed
+int packet_bpf_filter_set(struct packet_bpf *untagged, struct packet_bpf *tagged) {
+
+	int enabled = (untagged && tagged && untagged->type != packet_bpf_type_any && (untagged->type != packet_bpf_type_none || tagged->type != packet_bpf_type_none));
+
+	char *u = NULL, *t = NULL;
+	enum packet_bpf_type t_type = packet_bpf_type_none;
+	if (enabled) {
+		t_type = tagged->type;
+		if (untagged->type == packet_bpf_type_expr && (u = strdup(PACKET_BPF_ENCAP))) {
+			u = packet_bpf_join(untagged->expr, "or", u);
+			untagged->expr = NULL;
+		}
+		if (tagged->type == packet_bpf_type_expr && (t = strdup(PACKET_BPF_ENCAP))) {
+			t = packet_bpf_join(tagged->expr, "or", t);
+			tagged->expr = NULL;
+		}
+		if ((untagged->type == packet_bpf_type_expr && !u) || (tagged->type == packet_bpf_type_expr && !t)) {
+			free(u);
+			free(t);
+			u = t = NULL;
+			enabled = 0;
+		}
+	}
+
+	if (untagged)
+		packet_bpf_set(untagged, packet_bpf_type_none, 1);
+	if (tagged)
+		packet_bpf_set(tagged, packet_bpf_type_none, 1);
+
+	pom_mutex_lock(&packet_bpf_lock);
+
+	// Installing a filter may flush the capture buffer, don't do it for nothing
+	if (enabled == packet_bpf_enabled && t_type == packet_bpf_tagged_type && !packet_bpf_strcmp(u, packet_bpf_untagged) && !packet_bpf_strcmp(t, packet_bpf_tagged)) {
+		pom_mutex_unlock(&packet_bpf_lock);
+		free(u);
+		free(t);
+		return POM_OK;
+	}
+
+	free(packet_bpf_untagged);
+	free(packet_bpf_tagged);
+	packet_bpf_untagged = u;
+	packet_bpf_tagged = t;
+	packet_bpf_tagged_type = t_type;
+	packet_bpf_enabled = enabled;
+	__sync_add_and_fetch(&packet_bpf_serial, 1);
+
+	pom_mutex_unlock(&packet_bpf_lock);
+
+	if (enabled)
+		pomlog(POMLOG_DEBUG "Packets needed by the listeners : %s", (u ? u : "vlan only"));
+	else
+		pomlog(POMLOG_DEBUG "Listeners need all the packets");
+
+	return POM_OK;
+}
+
+unsigned int packet_bpf_filter_serial() {
+
+	// Read for every packet, a plain load is enough as the filter itself is fetched under the lock
+	return packet_bpf_serial;
+}
+
+char *packet_bpf_filter_get(int ethernet, unsigned int *serial) {
+
+	pom_mutex_lock(&packet_bpf_lock);
+
+	*serial = packet_bpf_serial;
+
+	if (!packet_bpf_enabled || (!ethernet && !packet_bpf_untagged)) {
+		pom_mutex_unlock(&packet_bpf_lock);
+		return NULL;
+	}
+
+	size_t len = (packet_bpf_untagged ? strlen(packet_bpf_untagged) : 0) + (packet_bpf_tagged ? strlen(packet_bpf_tagged) : 0) + 2 * strlen(PACKET_BPF_ENCAP_ETHERNET) + 48;
+	char *res = malloc(len);
+	if (!res) {
+		pom_mutex_unlock(&packet_bpf_lock);
+		pom_oom(len);
+		return NULL;
+	}
+
+	if (!ethernet) {
+		strcpy(res, packet_bpf_untagged);
+		pom_mutex_unlock(&packet_bpf_lock);
+		return res;
+	}
+
+	size_t pos = 0;
+	if (packet_bpf_untagged)
+		pos += snprintf(res + pos, len - pos, "(%s) or ", packet_bpf_untagged);
+	pos += snprintf(res + pos, len - pos, "%s", PACKET_BPF_ENCAP_ETHERNET);
+
+	// The vlan keyword shifts the offsets of what follows so it must come last
+	// The expression only looks past the first tag, keep all the stacked ones (QinQ)
+	if (packet_bpf_tagged_type == packet_bpf_type_any)
+		snprintf(res + pos, len - pos, " or vlan");
+	else if (packet_bpf_tagged_type == packet_bpf_type_expr)
+		snprintf(res + pos, len - pos, " or (vlan and ((%s) or %s or vlan))", packet_bpf_tagged, PACKET_BPF_ENCAP_ETHERNET);
+
+	pom_mutex_unlock(&packet_bpf_lock);
+
+	return res;
+}
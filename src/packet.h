@@ -28,6 +28,11 @@
 
 #define PACKET_BUFFER_ALIGNMENT 4
 
+// Number of buckets used to enforce the per source fragment quota
+#define PACKET_FRAG_SRC_BUCKETS		1024
+// Number of fragment buffers, from the least recently used, that can be evicted to make room
+#define PACKET_FRAG_EVICT_SCAN		8
+
 struct packet_buffer {
 
 	void *base_buff;
@@ -54,15 +59,34 @@ struct packet_filter_prop {
 	struct ptype_reg *pt_reg;
 };
 
+enum packet_bpf_type {
+	packet_bpf_type_none, // Matches no packet
+	packet_bpf_type_any, // Matches every packet
+	packet_bpf_type_expr,
+};
+
+// BPF expression matching at least the packets matched by a filter
+struct packet_bpf {
+	enum packet_bpf_type type;
+	int exact; // Doesn't match more packets than the filter, needed to negate it
+	char *expr;
+};
+
 int packet_init();
 
 void packet_buffer_release(struct packet_buffer *pb);
 
 struct packet_info *packet_info_pool_get(struct proto *p);
 struct packet_info *packet_info_pool_clone(struct proto *p, struct packet_info *info);
+struct packet_info *packet_info_pool_ref(struct packet_info *info);
 int packet_pool_cleanup();
 int packet_info_pool_init();
 int packet_info_pool_release(struct packet_info *info, unsigned int protocol_id);
 int packet_info_pool_cleanup();
 
+int packet_bpf_and(struct packet_bpf *a, struct packet_bpf *b);
+int packet_bpf_or(struct packet_bpf *a, struct packet_bpf *b);
+int packet_filter_to_bpf(struct proto *proto, struct filter *f, int tagged, struct packet_bpf *res);
+int packet_bpf_filter_set(struct packet_bpf *untagged, struct packet_bpf *tagged);
+
 #endif
@@ -24,6 +24,9 @@
 #include "registry.h"
 #include "core.h"
 #include "filter.h"
+#include "profiler.h"
+#include "analyzer.h"
+#include "output.h"
 #include <pom-ng/resource.h>
 #include <pom-ng/ptype_string.h>
 #include <pom-ng/ptype_uint32.h>
@@ -55,6 +58,9 @@ static struct pload_listener_reg *pload_listeners = NULL;
 static struct pload_type *pload_types = NULL;
 static struct pload_mime_type *pload_mime_types_hash = NULL, *pload_mime_types_head = NULL;
 
+// Used to fill gaps when the missing bytes can't be skipped
+static char pload_gap_zero[PLOAD_GAP_STEP_MAX] = { 0 };
+
 static char* pload_class_names[]  = {
 	"other",
 	"application",
@@ -215,6 +221,8 @@ int pload_init() {
 			goto err;
 		}
 
+		def->profiler_id = profiler_register(profiler_stage_pload_analyzer, def->name);
+
 		// Add the payload with its name
 		HASH_ADD_KEYPTR(hh, pload_types, def->name, strlen(def->name), def);
 
@@ -395,9 +403,12 @@ int pload_end(struct pload *pload) {
 		pload->listeners = tmp->next;
 
 		if (tmp->reg->close) {
+			uint64_t prof = profiler_start();
 			if (tmp->reg->close(tmp->reg->obj, tmp->priv) != POM_OK) {
 				pomlog(POMLOG_WARN "Error while closing a payload listener");
 			}
+			if (prof)
+				profiler_account(tmp->reg->profiler_id, prof);
 		}
 
 		pom_mutex_lock(&tmp->reg->lock);
@@ -678,6 +689,20 @@ int pload_store_make_space(struct pload *p, size_t min_size) {
 	return POM_OK;
 }
 
+static void pload_store_update_size(struct pload *p) {
+
+	struct pload_store_map *write_map = p->store->write_map;
+
+	pom_mutex_lock(&p->store->lock);
+	p->store->file_size = write_map->off_start + write_map->off_cur;
+	int res = pthread_cond_broadcast(&p->store->cond);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while signaling pload store condition : %s", pom_strerror(res));
+		abort();
+	}
+	pom_mutex_unlock(&p->store->lock);
+}
+
 int pload_store_append(struct pload *p, void *data, size_t len) {
 
 	struct pload_store_map *write_map = p->store->write_map;
@@ -731,17 +756,43 @@ int pload_store_append(struct pload *p, void *data, size_t len) {
 		write_map->off_cur += len;
 	}
 
-	pom_mutex_lock(&p->store->lock);
-	p->store->file_size = write_map->off_start + write_map->off_cur;
-	int res = pthread_cond_broadcast(&p->store->cond);
-	if (res) {
-		pomlog(POMLOG_ERR "Error while signaling pload store condition : %s", pom_strerror(res));
-		abort();
-	}
-	pom_mutex_unlock(&p->store->lock);
+	pload_store_update_size(p);
 
 	return POM_OK;
 }
+
+static void pload_listeners_write(struct pload *p, void *data, size_t len) {
+
+	struct pload_listener *tmp = p->listeners;
+	while (tmp) {
+		
+		uint64_t prof = profiler_start();
+		int res = tmp->reg->write(tmp->reg->obj, tmp->priv, data, len);
+		if (prof)
+			profiler_account(tmp->reg->profiler_id, prof);
+
+		if (res != POM_OK) {
+			pomlog(POMLOG_WARN "Error while writing to a pload listener");
+			tmp->reg->close(tmp->reg->obj, tmp->priv);
+
+			struct pload_listener *todel = tmp;
+			tmp = tmp->next;
+
+			if (todel->prev)
+				todel->prev->next = todel->next;
+			else
+				p->listeners = todel->next;
+
+			if (todel->next)
+				todel->next->prev = todel->prev;
+
+			free(todel);
+			continue;
+		}
+		tmp = tmp->next;
+	}
+}
+
 int pload_append(struct pload *p, void *data, size_t len) {
 
 	if (p->flags & PLOAD_FLAG_IS_ERR)
@@ -876,7 +927,10 @@ int pload_append(struct pload *p, void *data, size_t len) {
 			.buf_size = len
 		};
 
+		uint64_t prof = profiler_start();
 		int res = a->analyze(p, (p->buf.data ? &p->buf : &pb), a->priv);
+		if (prof)
+			profiler_account(p->type->profiler_id, prof);
 
 		if (res != PLOAD_ANALYSIS_MORE) {
 			if (a->cleanup) {
@@ -932,7 +986,10 @@ int pload_append(struct pload *p, void *data, size_t len) {
 					continue;
 
 				void *pload_priv = NULL;
+				uint64_t prof = profiler_start();
 				int res = reg->open(reg->obj, &pload_priv, p);
+				if (prof)
+					profiler_account(reg->profiler_id, prof);
 				if (res == PLOAD_OPEN_ERR) {
 					pomlog(POMLOG_ERR "One listener errored out when opening a payload");
 					continue;
@@ -998,43 +1055,78 @@ int pload_append(struct pload *p, void *data, size_t len) {
 
 	}
 
-	struct pload_listener *tmp = p->listeners;
-	while (tmp) {
-		
-		if (tmp->reg->write(tmp->reg->obj, tmp->priv, data, len) != POM_OK) {
-			pomlog(POMLOG_WARN "Error while writing to a pload listener");
-			tmp->reg->close(tmp->reg->obj, tmp->priv);
+	pload_listeners_write(p, data, len);
 
-			struct pload_listener *todel = tmp;
-			tmp = tmp->next;
+	if (p->buf.data) {
+		free(p->buf.data);
+		p->buf.data = NULL;
+		p->buf.data_len = 0;
+		p->buf.buf_size = 0;
+	}
 
-			if (todel->prev)
-				todel->prev->next = todel->next;
-			else
-				p->listeners = todel->next;
 
-			if (todel->next)
-				todel->next->prev = todel->prev;
 
-			free(todel);
+	return POM_OK;
+}
 
-		}
-		tmp = tmp->next;
+int pload_append_gap(struct pload *p, size_t len) {
+
+	if (p->flags & PLOAD_FLAG_IS_ERR)
+		return POM_OK;
+
+	p->flags |= PLOAD_FLAG_INCOMPLETE;
+
+	if (p->decoder) {
+		// Decoders can't resynchronize after missing bytes
+		p->flags |= PLOAD_FLAG_IS_ERR;
+		return POM_OK;
 	}
 
+	// Magic and analysis need contiguous data, feed them zeros until the pload is open
+	while (len && !(p->flags & PLOAD_FLAG_OPENED)) {
+		size_t step = (len > PLOAD_GAP_STEP_MAX ? PLOAD_GAP_STEP_MAX : len);
+		if (pload_append(p, pload_gap_zero, step) != POM_OK)
+			return POM_ERR;
+		if (p->flags & PLOAD_FLAG_IS_ERR)
+			return POM_OK;
+		len -= step;
+	}
 
-	if (p->buf.data) {
-		free(p->buf.data);
-		p->buf.data = NULL;
-		p->buf.data_len = 0;
-		p->buf.buf_size = 0;
+	if (!len)
+		return POM_OK;
+
+	if (!p->store) {
+		// Listeners still expect the right amount of bytes
+		while (len && p->listeners) {
+			size_t step = (len > PLOAD_GAP_STEP_MAX ? PLOAD_GAP_STEP_MAX : len);
+			pload_listeners_write(p, pload_gap_zero, step);
+			len -= step;
+		}
+		return POM_OK;
 	}
 
+	// Seek the store, the file is grown with ftruncate() so the area we skip reads as zeros
+	struct pload_store_map *write_map = p->store->write_map;
+	off_t start_off = write_map->off_start + write_map->off_cur;
+	if (write_map->map_size < write_map->off_cur + len) {
+		if (pload_store_make_space(p, len) != POM_OK) {
+			p->flags |= PLOAD_FLAG_IS_ERR;
+			return POM_ERR;
+		}
+	}
+	write_map->off_cur += len;
+	pload_store_update_size(p);
 
+	if (p->listeners)
+		pload_listeners_write(p, write_map->map + (start_off - write_map->off_start), len);
 
 	return POM_OK;
 }
 
+int pload_is_incomplete(struct pload *p) {
+	return (p->flags & PLOAD_FLAG_INCOMPLETE);
+}
+
 struct event *pload_get_related_event(struct pload *p) {
 	return p->rel_event;
 }
@@ -1101,6 +1193,12 @@ int pload_listen_start(void *obj, char *pload_type, struct filter *filter, int (
 	reg->write = write;
 	reg->close = close;
 
+	// Resolve the owner now, the profiler can't look it up while processing
+	char *owner_name = analyzer_get_listener_name(obj);
+	if (!owner_name)
+		owner_name = output_get_listener_name(obj);
+	reg->profiler_id = profiler_register(profiler_stage_pload_listener, owner_name);
+
 	int res = pthread_mutex_init(&reg->lock, NULL);
 
 	if (res) {
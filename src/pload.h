@@ -28,6 +28,8 @@
 
 #define PLOAD_REGISTRY "payload"
 
+#define PLOAD_GAP_STEP_MAX		4096
+
 #define PLOAD_STORE_FLAG_OPENED		0x1
 #define PLOAD_STORE_FLAG_COMPLETE	0x2
 
@@ -47,6 +49,8 @@ struct pload_listener_reg {
 	int (*write) (void *obj, void *priv, void *data, size_t len);
 	int (*close) (void *obj, void *priv);
 
+	unsigned int profiler_id;
+
 	pthread_mutex_t lock;
 
 	struct pload_listener_ploads *ploads;
@@ -0,0 +1,335 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2010-2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+
+#include "profiler.h"
+
+volatile int profiler_enabled = 0;
+
+static __thread struct profiler_thread *profiler_thread_local = NULL;
+
+static pthread_mutex_t profiler_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct profiler_thread *profiler_threads = NULL;
+static unsigned int profiler_thread_count = 0;
+static volatile unsigned int profiler_reset_serial = 0;
+
+static pthread_mutex_t profiler_ids_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct profiler_id *profiler_ids_hash = NULL, **profiler_ids = NULL;
+static volatile unsigned int profiler_id_count = 1; // Id 0 is PROFILER_ID_NONE
+
+static char *profiler_stage_names[] = {
+	"proto_process",
+	"proto_post_process",
+	"packet_listener",
+	"event_listener",
+	"pload_listener",
+	"pload_analyzer",
+};
+
+char *profiler_stage_get_name(enum profiler_stage stage) {
+	return profiler_stage_names[stage];
+}
+
+void profiler_set_enabled(int enabled) {
+
+	if (profiler_enabled == enabled)
+		return;
+
+	profiler_enabled = enabled;
+	pomlog(POMLOG_INFO "Profiling %s", (enabled ? "enabled" : "disabled"));
+}
+
+static struct profiler_thread *profiler_thread_alloc() {
+
+	struct profiler_thread *t = malloc(sizeof(struct profiler_thread));
+	if (!t) {
+		pom_oom(sizeof(struct profiler_thread));
+		return NULL;
+	}
+	memset(t, 0, sizeof(struct profiler_thread));
+
+	int res = pthread_mutex_init(&t->lock, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while initializing the profiler thread lock : %s", pom_strerror(res));
+		free(t);
+		return NULL;
+	}
+
+	t->reset_serial = profiler_reset_serial;
+
+	pom_mutex_lock(&profiler_threads_lock);
+	t->id = profiler_thread_count++;
+	t->next = profiler_threads;
+	profiler_threads = t;
+	pom_mutex_unlock(&profiler_threads_lock);
+
+	profiler_thread_local = t;
+
+	return t;
+}
+
+unsigned int profiler_register(enum profiler_stage stage, char *name) {
+
+	struct profiler_key key;
+	memset(&key, 0, sizeof(struct profiler_key));
+	key.stage = stage;
+	strncpy(key.name, (name ? name : "unknown"), PROFILER_NAME_MAX - 1);
+
+	pom_mutex_lock(&profiler_ids_lock);
+
+	struct profiler_id *pid = NULL;
+	HASH_FIND(hh, profiler_ids_hash, &key, sizeof(struct profiler_key), pid);
+	if (pid) {
+		pom_mutex_unlock(&profiler_ids_lock);
+		return pid->id;
+	}
+
+	struct profiler_id **ids = realloc(profiler_ids, sizeof(struct profiler_id *) * (profiler_id_count + 1));
+	if (!ids) {
+		pom_mutex_unlock(&profiler_ids_lock);
+		pom_oom(sizeof(struct profiler_id *) * (profiler_id_count + 1));
+		return PROFILER_ID_NONE;
+	}
+	profiler_ids = ids;
+
+	pid = malloc(sizeof(struct profiler_id));
+	if (!pid) {
+		pom_mutex_unlock(&profiler_ids_lock);
+		pom_oom(sizeof(struct profiler_id));
+		return PROFILER_ID_NONE;
+	}
+	memset(pid, 0, sizeof(struct profiler_id));
+	memcpy(&pid->key, &key, sizeof(struct profiler_key));
+	pid->id = profiler_id_count;
+
+	HASH_ADD(hh, profiler_ids_hash, key, sizeof(struct profiler_key), pid);
+	profiler_ids[pid->id] = pid;
+	profiler_id_count++;
+
+	pom_mutex_unlock(&profiler_ids_lock);
+
+	return pid->id;
+}
+
+static int profiler_thread_grow(struct profiler_thread *t, unsigned int id) {
+
+	unsigned int size = profiler_id_count;
+	if (size <= id)
+		size = id + 1;
+
+	struct profiler_entry *entries = realloc(t->entries, sizeof(struct profiler_entry) * size);
+	if (!entries) {
+		pom_oom(sizeof(struct profiler_entry) * size);
+		return POM_ERR;
+	}
+	memset(entries + t->entries_size, 0, sizeof(struct profiler_entry) * (size - t->entries_size));
+	t->entries = entries;
+	t->entries_size = size;
+
+	return POM_OK;
+}
+
+void profiler_account(unsigned int id, uint64_t start) {
+
+	uint64_t cycles = profiler_get_cycles() - start;
+
+	if (id == PROFILER_ID_NONE)
+		return;
+
+	struct profiler_thread *t = profiler_thread_local;
+	if (!t) {
+		t = profiler_thread_alloc();
+		if (!t)
+			return;
+	}
+
+	// The entries are only modified by this thread, the lock only guards against the report
+	if (t->reset_serial != profiler_reset_serial || id >= t->entries_size) {
+		pom_mutex_lock(&t->lock);
+		if (t->reset_serial != profiler_reset_serial) {
+			memset(t->entries, 0, sizeof(struct profiler_entry) * t->entries_size);
+			t->reset_serial = profiler_reset_serial;
+		}
+		int res = POM_OK;
+		if (id >= t->entries_size)
+			res = profiler_thread_grow(t, id);
+		pom_mutex_unlock(&t->lock);
+		if (res != POM_OK)
+			return;
+	}
+
+	struct profiler_entry *e = &t->entries[id];
+	e->cycles += cycles;
+	e->calls++;
+}
+
+static int profiler_report_compare(struct profiler_report *a, struct profiler_report *b) {
+
+	if (a->cycles > b->cycles)
+		return -1;
+	if (a->cycles < b->cycles)
+		return 1;
+	return 0;
+}
+
+struct profiler_report *profiler_report(unsigned int max) {
+
+	struct profiler_report *res = NULL, *r, *tmp;
+
+	pom_mutex_lock(&profiler_threads_lock);
+	pom_mutex_lock(&profiler_ids_lock);
+
+	struct profiler_thread *t;
+	for (t = profiler_threads; t; t = t->next) {
+
+		pom_mutex_lock(&t->lock);
+
+		// Entries not cleared since the last reset don't count
+		unsigned int i, entries_size = (t->reset_serial == profiler_reset_serial ? t->entries_size : 0);
+		for (i = 1; i < entries_size; i++) {
+
+			struct profiler_entry *e = &t->entries[i];
+			uint64_t cycles = e->cycles, calls = e->calls;
+			if (!calls)
+				continue;
+
+			struct profiler_key *key = &profiler_ids[i]->key;
+			HASH_FIND(hh, res, key, sizeof(struct profiler_key), r);
+			if (!r) {
+				r = malloc(sizeof(struct profiler_report));
+				if (!r) {
+					pom_oom(sizeof(struct profiler_report));
+					pom_mutex_unlock(&t->lock);
+					goto err;
+				}
+				memset(r, 0, sizeof(struct profiler_report));
+
+				size_t size = sizeof(struct profiler_report_thread) * profiler_thread_count;
+				r->threads = malloc(size);
+				if (!r->threads) {
+					free(r);
+					pom_oom(size);
+					pom_mutex_unlock(&t->lock);
+					goto err;
+				}
+				memset(r->threads, 0, size);
+
+				memcpy(&r->key, key, sizeof(struct profiler_key));
+				HASH_ADD(hh, res, key, sizeof(struct profiler_key), r);
+			}
+
+			r->cycles += cycles;
+			r->calls += calls;
+			r->threads[r->thread_count].id = t->id;
+			r->threads[r->thread_count].cycles = cycles;
+			r->threads[r->thread_count].calls = calls;
+			r->thread_count++;
+		}
+
+		pom_mutex_unlock(&t->lock);
+	}
+
+	pom_mutex_unlock(&profiler_ids_lock);
+	pom_mutex_unlock(&profiler_threads_lock);
+
+	HASH_SORT(res, profiler_report_compare);
+
+	// Keep the top entries only
+	struct profiler_report *head = NULL, *tail = NULL;
+	unsigned int count = 0;
+	HASH_ITER(hh, res, r, tmp) {
+		HASH_DEL(res, r);
+		if (max && count >= max) {
+			free(r->threads);
+			free(r);
+			continue;
+		}
+
+		if (tail)
+			tail->next = r;
+		else
+			head = r;
+		tail = r;
+		count++;
+	}
+
+	return head;
+
+err:
+	pom_mutex_unlock(&profiler_ids_lock);
+	pom_mutex_unlock(&profiler_threads_lock);
+
+	HASH_ITER(hh, res, r, tmp) {
+		HASH_DEL(res, r);
+		free(r->threads);
+		free(r);
+	}
+
+	return NULL;
+}
+
+void profiler_report_cleanup(struct profiler_report *r) {
+
+	while (r) {
+		struct profiler_report *tmp = r;
+		r = r->next;
+		free(tmp->threads);
+		free(tmp);
+	}
+}
+
+void profiler_reset() {
+
+	// Each thread clears its own entries when it notices the change
+	__sync_fetch_and_add(&profiler_reset_serial, 1);
+}
+
+void profiler_cleanup() {
+
+	profiler_enabled = 0;
+
+	pom_mutex_lock(&profiler_threads_lock);
+
+	while (profiler_threads) {
+		struct profiler_thread *t = profiler_threads;
+		profiler_threads = t->next;
+
+		free(t->entries);
+		pthread_mutex_destroy(&t->lock);
+		free(t);
+	}
+	profiler_thread_count = 0;
+
+	pom_mutex_unlock(&profiler_threads_lock);
+
+	pom_mutex_lock(&profiler_ids_lock);
+
+	struct profiler_id *pid, *tmp;
+	HASH_ITER(hh, profiler_ids_hash, pid, tmp) {
+		HASH_DEL(profiler_ids_hash, pid);
+		free(pid);
+	}
+	free(profiler_ids);
+	profiler_ids = NULL;
+	profiler_id_count = 1;
+
+	pom_mutex_unlock(&profiler_ids_lock);
+}
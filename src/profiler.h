@@ -0,0 +1,119 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2010-2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include "common.h"
+
+#include <time.h>
+#include <uthash.h>
+
+// Cycles are counted with the TSC when available
+#if defined(__i386__) || defined(__x86_64__)
+#define PROFILER_UNIT "cycles"
+#else
+#define PROFILER_UNIT "ns"
+#endif
+
+enum profiler_stage {
+	profiler_stage_proto_process = 0,
+	profiler_stage_proto_post_process,
+	profiler_stage_packet_listener,
+	profiler_stage_event_listener,
+	profiler_stage_pload_listener,
+	profiler_stage_pload_analyzer,
+};
+
+// Longest name kept for an entry
+#define PROFILER_NAME_MAX	64
+
+// Entries are resolved by name when registering so objects sharing an address over time don't get mixed up
+struct profiler_key {
+	enum profiler_stage stage;
+	char name[PROFILER_NAME_MAX];
+};
+
+// Id returned when the entry couldn't be registered, never accounted
+#define PROFILER_ID_NONE	0
+
+struct profiler_id {
+	struct profiler_key key;
+	unsigned int id;
+	UT_hash_handle hh;
+};
+
+struct profiler_entry {
+	volatile uint64_t cycles, calls;
+};
+
+struct profiler_thread {
+	unsigned int id;
+	pthread_mutex_t lock;
+	unsigned int reset_serial;
+	struct profiler_entry *entries; // Indexed by profiler id, only written by the owning thread
+	unsigned int entries_size;
+	struct profiler_thread *next;
+};
+
+struct profiler_report_thread {
+	unsigned int id;
+	uint64_t cycles, calls;
+};
+
+struct profiler_report {
+	struct profiler_key key;
+	uint64_t cycles, calls;
+	unsigned int thread_count;
+	struct profiler_report_thread *threads;
+	UT_hash_handle hh;
+	struct profiler_report *next;
+};
+
+extern volatile int profiler_enabled;
+
+static inline uint64_t profiler_get_cycles() {
+
+#if defined(__i386__) || defined(__x86_64__)
+	uint32_t lo, hi;
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000LLU) + ts.tv_nsec;
+#endif
+}
+
+// Returns 0 when profiling is disabled so the caller can skip the accounting
+#define profiler_start() (profiler_enabled ? profiler_get_cycles() : 0)
+
+unsigned int profiler_register(enum profiler_stage stage, char *name);
+void profiler_account(unsigned int id, uint64_t start);
+void profiler_set_enabled(int enabled);
+char *profiler_stage_get_name(enum profiler_stage stage);
+struct profiler_report *profiler_report(unsigned int max);
+void profiler_report_cleanup(struct profiler_report *r);
+void profiler_reset();
+void profiler_cleanup();
+
+#endif
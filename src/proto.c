@@ -25,6 +25,10 @@
 #include "main.h"
 #include "mod.h"
 #include "core.h"
+#include "event.h"
+#include "analyzer.h"
+#include "output.h"
+#include "profiler.h"
 #include <pom-ng/filter.h>
 
 
@@ -43,6 +47,9 @@ static struct proto_number_class *proto_number_class_head = NULL;
 unsigned int proto_count = 0;
 
 int proto_init() {
+
+	if (conntrack_hash_init() != POM_OK)
+		return POM_ERR;
 	
 	proto_registry_class = registry_add_class(PROTO_REGISTRY);
 	if (!proto_registry_class)
@@ -94,6 +101,7 @@ int proto_register(struct proto_reg_info *reg_info) {
 		pomlog(POMLOG_ERR "Error while adding the registry instanc for protocol %s", reg_info->name);
 		goto err_lock;
 	}
+	proto->reg_instance->priv = proto;
 
 
 	// Allocate the conntrack table
@@ -111,16 +119,25 @@ int proto_register(struct proto_reg_info *reg_info) {
 		if (!proto->perf_conn_cur || !proto->perf_conn_tot || !proto->perf_conn_hash_col)
 			goto err_conntrack;
 
+		if (conntrack_table_register_stats(proto) != POM_OK)
+			goto err_conntrack;
+
 	}
 
 	proto->perf_pkts = registry_instance_add_perf(proto->reg_instance, "pkts", registry_perf_type_counter, "Number of packets processed", "pkts");
 	proto->perf_bytes = registry_instance_add_perf(proto->reg_instance, "bytes", registry_perf_type_counter, "Number of bytes processed", "bytes");
 	proto->perf_expt_pending = registry_instance_add_perf(proto->reg_instance, "expectations_pending", registry_perf_type_gauge, "Number of expectations pending", "expectations");
 	proto->perf_expt_matched = registry_instance_add_perf(proto->reg_instance, "expectations_matched", registry_perf_type_counter, "Number of expectations matched", "expectations");
+	proto->perf_expt_lookups = registry_instance_add_perf(proto->reg_instance, "expectations_lookups", registry_perf_type_counter, "Number of packets looked up in the pending expectations", "pkts");
+	proto->perf_expt_lookup_time = registry_instance_add_perf(proto->reg_instance, "expectations_lookup_time", registry_perf_type_histogram, "Time spent looking up the pending expectations for each packet", "ns");
+	proto->perf_process_time = registry_instance_add_perf(proto->reg_instance, "process_time", registry_perf_type_histogram, "Time spent processing each packet", "ns");
 
-	if (!proto->perf_pkts || !proto->perf_bytes || !proto->perf_expt_pending || !proto->perf_expt_matched)
+	if (!proto->perf_pkts || !proto->perf_bytes || !proto->perf_expt_pending || !proto->perf_expt_matched || !proto->perf_expt_lookups || !proto->perf_expt_lookup_time || !proto->perf_process_time)
 		goto err_conntrack;
 
+	proto->profiler_process_id = profiler_register(profiler_stage_proto_process, reg_info->name);
+	proto->profiler_post_process_id = profiler_register(profiler_stage_proto_post_process, reg_info->name);
+
 	if (reg_info->init) {
 		if (reg_info->init(proto, proto->reg_instance) == POM_ERR) {
 			pomlog(POMLOG_ERR "Error while registering proto %s", reg_info->name);
@@ -154,6 +171,104 @@ err_proto:
 
 }
 
+static int proto_expectation_match(struct proto_expectation *e, struct proto_process_stack *stack, unsigned int stack_index) {
+
+	// Bit one means it matches the forward direction
+	// Bit two means it matches the reverse direction
+
+	int expt_dir = 3;
+
+	struct proto_expectation_stack *es = e->tail;
+	int stack_index_tmp = stack_index;
+	for (; es && expt_dir; es = es->prev, stack_index_tmp--) {
+
+		struct proto_process_stack *s_tmp = &stack[stack_index_tmp];
+
+		if (s_tmp->proto != es->proto)
+			return 0;
+
+		if (!es->fields[POM_DIR_FWD] && !es->fields[POM_DIR_REV]) {
+			// Nothing to match for this proto
+			continue;
+		}
+
+		struct ptype *fwd_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->fwd_pkt_field_id];
+		struct ptype *rev_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->rev_pkt_field_id];
+
+		if (expt_dir & 1) {
+			if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], fwd_value)) ||
+				(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], rev_value))) {
+				expt_dir &= ~1; // It doesn't match in the forward direction
+			}
+		}
+
+		if (expt_dir & 2) {
+			if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], rev_value)) ||
+				(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], fwd_value))) {
+				expt_dir &= ~2;
+			}
+		}
+	}
+
+	return expt_dir;
+}
+
+static struct ptype *proto_expectation_get_key(struct proto_expectation *e) {
+
+	// An expectation is hashed on the value of its last proto, whichever direction it's in
+	struct proto_expectation_stack *es = e->tail;
+	if (!es->proto->info->ct_info)
+		return NULL;
+
+	if (es->fields[POM_DIR_FWD])
+		return es->fields[POM_DIR_FWD];
+
+	return es->fields[POM_DIR_REV];
+}
+
+static unsigned int proto_expectation_get_lists(struct proto *proto, struct proto_process_stack *s, struct proto_expectation ***lists) {
+
+	// Must be called with the expectation lock held
+
+	unsigned int count = 0;
+
+	if (proto->expectations)
+		lists[count++] = &proto->expectations;
+
+	if (!proto->expectation_table)
+		return count;
+
+	// The expected value can be found in either direction of the packet
+	struct conntrack_info *ct_info = proto->info->ct_info;
+	uint32_t fwd_hash = ptype_get_hash(s->pkt_info->fields_value[ct_info->fwd_pkt_field_id]) % PROTO_EXPECTATION_HASH_SIZE;
+	lists[count++] = &proto->expectation_table[fwd_hash];
+
+	if (ct_info->rev_pkt_field_id != -1) {
+		uint32_t rev_hash = ptype_get_hash(s->pkt_info->fields_value[ct_info->rev_pkt_field_id]) % PROTO_EXPECTATION_HASH_SIZE;
+		if (rev_hash != fwd_hash)
+			lists[count++] = &proto->expectation_table[rev_hash];
+	}
+
+	return count;
+}
+
+static void proto_expectation_unlink(struct proto *proto, struct proto_expectation *e) {
+
+	// Must be called with the expectation lock held
+
+	if (e->next)
+		e->next->prev = e->prev;
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		*e->list = e->next;
+
+	e->next = NULL;
+	e->prev = NULL;
+	e->list = NULL;
+	proto->expectation_count--;
+}
+
 int proto_process(struct packet *p, struct proto_process_stack *stack, unsigned int stack_index) {
 
 	struct proto_process_stack *s = &stack[stack_index];
@@ -162,81 +277,53 @@ int proto_process(struct packet *p, struct proto_process_stack *stack, unsigned
 
 	if (!proto || !proto->info->process)
 		return PROTO_ERR;
+	uint64_t prof = profiler_start();
+	uint64_t process_start = registry_perf_hist_clock();
 	int res = proto->info->process(proto->priv, p, stack, stack_index);
+	registry_perf_hist_record_since(proto->perf_process_time, process_start);
+	if (prof)
+		profiler_account(proto->profiler_process_id, prof);
 
 	registry_perf_inc(proto->perf_pkts, 1);
-	registry_perf_inc(proto->perf_bytes, s->plen);
+	if (s->pload) // Don't account for gaps
+		registry_perf_inc(proto->perf_bytes, s->plen);
 
 	if (res != PROTO_OK)
 		return res;
 
-	int matched = 0;
-
 	// Process the expectations !
-	pom_rwlock_rlock(&proto->expectation_lock);
-	struct proto_expectation *e = NULL;
-	for (e = proto->expectations; e; e = e->next) {
-
-		if (e->flags & PROTO_EXPECTATION_FLAG_MATCHED) {
-			// Another thread already matched the expectation, continue
-			continue;
-		}
-		
-		// Bit one means it matches the forward direction
-		// Bit two means it matches the reverse direction
-
-		int expt_dir = 3;
+	if (!proto->expectation_count)
+		return res;
 
-		struct proto_expectation_stack *es = e->tail;
-		int stack_index_tmp = stack_index;
-		while (es) {
+	uint64_t lookup_start = registry_perf_hist_clock();
 
-			struct proto_process_stack *s_tmp = &stack[stack_index_tmp];
+	int matched = 0;
+	struct proto_expectation **lists[3];
 
-			if (s_tmp->proto != es->proto) {
-				expt_dir = 0;
-				break;
-			}
+	pom_rwlock_rlock(&proto->expectation_lock);
+	unsigned int i, list_count = proto_expectation_get_lists(proto, s, lists);
+	for (i = 0; i < list_count; i++) {
+		struct proto_expectation *e;
+		for (e = *lists[i]; e; e = e->next) {
 
-			if (!es->fields[POM_DIR_FWD] && !es->fields[POM_DIR_REV]) {
-				// Nothing to match for this proto
+			if (e->flags & PROTO_EXPECTATION_FLAG_MATCHED) {
+				// Another thread already matched the expectation, continue
 				continue;
 			}
 
-			struct ptype *fwd_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->fwd_pkt_field_id];
-			struct ptype *rev_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->rev_pkt_field_id];
-
-			if (expt_dir & 1) {
-				if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], fwd_value)) ||
-					(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], rev_value))) {
-					expt_dir &= ~1; // It doesn't match in the forward direction
+			if (proto_expectation_match(e, stack, stack_index)) {
+				if (!(__sync_fetch_and_or(&e->flags, PROTO_EXPECTATION_FLAG_MATCHED) & PROTO_EXPECTATION_FLAG_MATCHED)) {
+					// Something matched
+					matched++;
 				}
 			}
-
-			if (expt_dir & 2) {
-				if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], rev_value)) ||
-					(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], fwd_value))) {
-					expt_dir &= ~2;
-				}
-			}
-
-			if (!expt_dir)
-				break;
-
-			es = es->prev;
-			stack_index_tmp--;
-		}
-
-		if (expt_dir) {
-			// It matched
-			if (!(__sync_fetch_and_or(&e->flags, PROTO_EXPECTATION_FLAG_MATCHED) & PROTO_EXPECTATION_FLAG_MATCHED)) {
-				// Something matched
-				matched++;
-			}
 		}
 	}
 	pom_rwlock_unlock(&proto->expectation_lock);
 
+	registry_perf_hist_record_since(proto->perf_expt_lookup_time, lookup_start);
+	registry_perf_inc(proto->perf_expt_lookups, 1);
+
 	if (!matched)
 		return POM_OK;
 
@@ -245,65 +332,63 @@ int proto_process(struct packet *p, struct proto_process_stack *stack, unsigned
 
 	// Relock with write access
 	pom_rwlock_wlock(&proto->expectation_lock);
-	e = proto->expectations;
-	while (e) {
+	list_count = proto_expectation_get_lists(proto, s, lists);
+	for (i = 0; i < list_count; i++) {
+		struct proto_expectation *e = *lists[i];
+		while (e) {
 
-		struct proto_expectation *cur = e;
-		e = e->next;
+			struct proto_expectation *cur = e;
+			e = e->next;
 
-		if (!(cur->flags & PROTO_EXPECTATION_FLAG_MATCHED))
-			continue;
+			if (!(cur->flags & PROTO_EXPECTATION_FLAG_MATCHED))
+				continue;
 
-		// Remove the expectation from the conntrack
-		if (cur->next)
-			cur->next->prev = cur->prev;
-		if (cur->prev)
-			cur->prev->next = cur->next;
-		else
-			proto->expectations = cur->next;
+			// Remove the expectation from the conntrack
+			proto_expectation_unlink(proto, cur);
 
-		// Remove matched and queued flags
-		__sync_fetch_and_and(&cur->flags, ~(PROTO_EXPECTATION_FLAG_MATCHED | PROTO_EXPECTATION_FLAG_QUEUED));
+			// Remove matched and queued flags
+			__sync_fetch_and_and(&cur->flags, ~(PROTO_EXPECTATION_FLAG_MATCHED | PROTO_EXPECTATION_FLAG_QUEUED));
 
-		struct proto_process_stack *s_next = &stack[stack_index + 1];
-		s_next->proto = cur->proto;
+			struct proto_process_stack *s_next = &stack[stack_index + 1];
+			s_next->proto = cur->proto;
 
-		if (conntrack_get_unique_from_parent(stack, stack_index + 1) != POM_OK) {
-			proto_expectation_cleanup(cur);
-			continue;
-		}
+			if (conntrack_get_unique_from_parent(stack, stack_index + 1) != POM_OK) {
+				proto_expectation_cleanup(cur);
+				continue;
+			}
 
-		if (!s_next->ce->priv) {
-			s_next->ce->priv = cur->priv;
-			// Prevent cleanup of private data while cleaning the expectation
-			cur->priv = NULL;
-		}
+			if (!s_next->ce->priv) {
+				s_next->ce->priv = cur->priv;
+				// Prevent cleanup of private data while cleaning the expectation
+				cur->priv = NULL;
+			}
 
 
-		if (cur->session) {
-			if (conntrack_session_bind(s_next->ce, cur->session)) {
-				proto_expectation_cleanup(cur);
-				continue;
+			if (cur->session) {
+				if (conntrack_session_bind(s_next->ce, cur->session)) {
+					proto_expectation_cleanup(cur);
+					continue;
+				}
 			}
-		}
 
-		registry_perf_dec(cur->proto->perf_expt_pending, 1);
-		registry_perf_inc(cur->proto->perf_expt_matched, 1);
+			registry_perf_dec(cur->proto->perf_expt_pending, 1);
+			registry_perf_inc(cur->proto->perf_expt_matched, 1);
 
-		if (cur->match_callback) {
-			// Call the callback with the conntrack locked
-			cur->match_callback(cur, cur->callback_priv, s_next->ce);
-			// Nullify callback_priv so it doesn't get cleaned up
-			cur->callback_priv = NULL;
-		}
+			if (cur->match_callback) {
+				// Call the callback with the conntrack locked
+				cur->match_callback(cur, cur->callback_priv, s_next->ce);
+				// Nullify callback_priv so it doesn't get cleaned up
+				cur->callback_priv = NULL;
+			}
 
-		if (cur->expiry) {
-			// The expectation was added using 'add_and_cleanup' function
-			proto_expectation_cleanup(cur);
-		}
+			if (cur->expiry) {
+				// The expectation was added using 'add_and_cleanup' function
+				proto_expectation_cleanup(cur);
+			}
 
-		conntrack_unlock(s_next->ce);
+			conntrack_unlock(s_next->ce);
 
+		}
 	}
 	pom_rwlock_unlock(&proto->expectation_lock);
 
@@ -321,14 +406,22 @@ int proto_process_pload_listeners(struct packet *p, struct proto_process_stack *
 
 	if (proto && s_next->plen) {
 		
+		struct filter_index_cursor c;
+		filter_index_cursor_init(&c, &proto->payload_listeners_index, stack);
+
 		struct proto_packet_listener *l;
-		for (l = proto->payload_listeners; l; l = l->next) {
-			if (l->filter && packet_filter_match(l->filter, stack) != FILTER_MATCH_YES)
+		while ((l = filter_index_next(&c))) {
+			if (!s_next->pload && !(l->flags & PROTO_PACKET_LISTENER_GAP))
 				continue;
+			uint64_t prof = profiler_start();
+			uint64_t start = (l->perf_process_time ? registry_perf_hist_clock() : 0);
 			if (l->process(l->object, p, stack, stack_index + 1) != POM_OK) {
 				pomlog(POMLOG_WARN "Warning payload listener failed");
 				// FIXME remove listener from the list ?
 			}
+			registry_perf_hist_record_since(l->perf_process_time, start);
+			if (prof)
+				profiler_account(l->profiler_id, prof);
 		}
 	}
 
@@ -346,20 +439,31 @@ int proto_post_process(struct packet *p, struct proto_process_stack *s, unsigned
 		return PROTO_ERR;
 
 	// Process the listeners after the whole stack has been processed
+	struct filter_index_cursor c;
+	filter_index_cursor_init(&c, &proto->packet_listeners_index, s);
+
 	struct proto_packet_listener *l;
-	for (l = proto->packet_listeners; l; l = l->next) {
-		if (l->filter && packet_filter_match(l->filter, s) != FILTER_MATCH_YES)
-			continue;
+	while ((l = filter_index_next(&c))) {
+		uint64_t prof = profiler_start();
+		uint64_t start = (l->perf_process_time ? registry_perf_hist_clock() : 0);
 		if (l->process(l->object, p, s, stack_index) != POM_OK) {
 			pomlog(POMLOG_WARN "Warning packet listener failed");
 			// FIXME remove listener from the list ?
 		}
+		registry_perf_hist_record_since(l->perf_process_time, start);
+		if (prof)
+			profiler_account(l->profiler_id, prof);
 	}
 
-	if (proto->info->post_process)
-		return proto->info->post_process(proto->priv, p, s, stack_index);
+	if (!proto->info->post_process)
+		return POM_OK;
 
-	return POM_OK;
+	uint64_t prof = profiler_start();
+	int res = proto->info->post_process(proto->priv, p, s, stack_index);
+	if (prof)
+		profiler_account(proto->profiler_post_process_id, prof);
+
+	return res;
 }
 
 int proto_unregister(char *name) {
@@ -390,6 +494,9 @@ int proto_unregister(char *name) {
 
 	mod_refcount_dec(proto->info->mod);
 
+	if (proto->expectation_table)
+		free(proto->expectation_table);
+
 	free(proto);
 
 	return POM_OK;
@@ -409,10 +516,21 @@ int proto_finish() {
 
 	// Cleanup the expectations first
 	for (proto = proto_head; proto; proto = proto->next) {
-		while (proto->expectations) {
-			struct proto_expectation *e = proto->expectations;
-			proto->expectations = e->next;
-			proto_expectation_cleanup(e);
+		unsigned int i;
+		for (i = 0; i <= PROTO_EXPECTATION_HASH_SIZE; i++) {
+			struct proto_expectation **list = &proto->expectations;
+			if (i < PROTO_EXPECTATION_HASH_SIZE) {
+				if (!proto->expectation_table)
+					continue;
+				list = &proto->expectation_table[i];
+			}
+
+			while (*list) {
+				struct proto_expectation *e = *list;
+				proto_expectation_unlink(proto, e);
+				__sync_fetch_and_and(&e->flags, ~PROTO_EXPECTATION_FLAG_QUEUED);
+				proto_expectation_cleanup(e);
+			}
 		}
 	}
 
@@ -444,6 +562,8 @@ int proto_cleanup() {
 		if (res)
 			pomlog(POMLOG_ERR "Error while destroying the listners lock : %s", pom_strerror(res));
 
+		if (proto->expectation_table)
+			free(proto->expectation_table);
 
 		free(proto);
 	}
@@ -460,6 +580,7 @@ int proto_cleanup() {
 			cls->nums = num->next;
 			free(num);
 		}
+		free(cls->index);
 		free(cls->name);
 		free(cls);
 	}
@@ -484,6 +605,21 @@ struct proto_packet_listener *proto_packet_listener_register(struct proto *proto
 	l->object = object;
 	l->filter = f;
 
+	// Account the time spent in the listener to its analyzer or output
+	l->perf_process_time = analyzer_get_listener_perf(object);
+	if (!l->perf_process_time)
+		l->perf_process_time = output_get_listener_perf(object);
+	char *owner_name = analyzer_get_listener_name(object);
+	if (!owner_name)
+		owner_name = output_get_listener_name(object);
+	l->profiler_id = profiler_register(profiler_stage_packet_listener, owner_name);
+
+	l->index_item = filter_index_add((l->flags & PROTO_PACKET_LISTENER_PLOAD_ONLY ? &proto->payload_listeners_index : &proto->packet_listeners_index), l, f);
+	if (!l->index_item) {
+		free(l);
+		return NULL;
+	}
+
 	if (l->flags & PROTO_PACKET_LISTENER_PLOAD_ONLY)
 		l->next = proto->payload_listeners;
 	else
@@ -497,6 +633,8 @@ struct proto_packet_listener *proto_packet_listener_register(struct proto *proto
 	else
 		proto->packet_listeners = l;
 
+	proto_bpf_filter_update();
+
 	return l;
 }
 
@@ -519,8 +657,12 @@ int proto_packet_listener_unregister(struct proto_packet_listener *l) {
 			l->proto->packet_listeners = l->next;
 	}
 
+	filter_index_remove((l->flags & PROTO_PACKET_LISTENER_PLOAD_ONLY ? &l->proto->payload_listeners_index : &l->proto->packet_listeners_index), l->index_item);
+
 	free(l);
 
+	proto_bpf_filter_update();
+
 	return POM_OK;
 }
 
@@ -529,6 +671,54 @@ void proto_packet_listener_set_filter(struct proto_packet_listener *l, struct fi
 	core_assert_is_paused();
 
 	l->filter = f;
+	filter_index_set_filter((l->flags & PROTO_PACKET_LISTENER_PLOAD_ONLY ? &l->proto->payload_listeners_index : &l->proto->packet_listeners_index), l->index_item, f);
+
+	proto_bpf_filter_update();
+}
+
+static int proto_bpf_filter_add(struct proto_packet_listener *l, struct packet_bpf *untagged, struct packet_bpf *tagged) {
+
+	for (; l; l = l->next) {
+		struct packet_bpf b;
+		if (packet_filter_to_bpf(l->proto, l->filter, 0, &b) != POM_OK || packet_bpf_or(untagged, &b) != POM_OK)
+			return POM_ERR;
+		if (packet_filter_to_bpf(l->proto, l->filter, 1, &b) != POM_OK || packet_bpf_or(tagged, &b) != POM_OK)
+			return POM_ERR;
+	}
+
+	return POM_OK;
+}
+
+// Compute the BPF filter of the packets needed by the packet listeners, used by the inputs to drop the other ones
+void proto_bpf_filter_update() {
+
+	core_assert_is_paused();
+
+	struct packet_bpf untagged = { packet_bpf_type_none, 1, NULL }, tagged = { packet_bpf_type_none, 1, NULL };
+	int found = 0;
+
+	// Events can be generated from any packet
+	if (!event_listener_count()) {
+		struct proto *proto;
+		for (proto = proto_head; proto; proto = proto->next) {
+			if (!proto->packet_listeners && !proto->payload_listeners)
+				continue;
+			found = 1;
+			if (proto_bpf_filter_add(proto->packet_listeners, &untagged, &tagged) != POM_OK || proto_bpf_filter_add(proto->payload_listeners, &untagged, &tagged) != POM_OK) {
+				found = 0;
+				break;
+			}
+		}
+	}
+
+	if (!found) {
+		free(untagged.expr);
+		free(tagged.expr);
+		packet_bpf_filter_set(NULL, NULL);
+		return;
+	}
+
+	packet_bpf_filter_set(&untagged, &tagged);
 }
 
 
@@ -734,7 +924,7 @@ void proto_expectation_set_match_callback(struct proto_expectation *e, void (*ma
 	e->callback_priv_cleanup = callback_priv_cleanup;
 }
 
-int proto_expectation_add_and_cleanup(struct proto_expectation *e, unsigned int expiry, ptime now) {
+int proto_expectation_add_and_cleanup(struct proto_expectation *e, ptime expiry, ptime now) {
 
 	if (e->flags & PROTO_EXPECTATION_FLAG_QUEUED)
 		return POM_ERR;
@@ -765,13 +955,32 @@ int proto_expectation_add(struct proto_expectation *e) {
 	struct proto *proto = e->tail->proto;
 	pom_rwlock_wlock(&proto->expectation_lock);
 
+	e->list = &proto->expectations;
+
+	struct ptype *key = proto_expectation_get_key(e);
+	if (key) {
+		if (!proto->expectation_table) {
+			size_t table_size = sizeof(struct proto_expectation *) * PROTO_EXPECTATION_HASH_SIZE;
+			proto->expectation_table = malloc(table_size);
+			if (!proto->expectation_table) {
+				pom_rwlock_unlock(&proto->expectation_lock);
+				pom_oom(table_size);
+				return POM_ERR;
+			}
+			memset(proto->expectation_table, 0, table_size);
+		}
+		e->list = &proto->expectation_table[ptype_get_hash(key) % PROTO_EXPECTATION_HASH_SIZE];
+	}
+
 	__sync_fetch_and_or(&e->flags, PROTO_EXPECTATION_FLAG_QUEUED);
 
-	e->next = proto->expectations;
+	e->prev = NULL;
+	e->next = *e->list;
 	if (e->next)
 		e->next->prev = e;
 
-	proto->expectations = e;
+	*e->list = e;
+	proto->expectation_count++;
 
 	pom_rwlock_unlock(&proto->expectation_lock);
 
@@ -790,18 +999,13 @@ int proto_expectation_remove(struct proto_expectation *e) {
 		return POM_ERR;
 	}
 
-	if (!e->next && !e->prev && proto->expectations != e) {
+	if (!e->list) {
 		// The expectation is not queued
 		pom_rwlock_unlock(&proto->expectation_lock);
 		return POM_OK;
 	}
 
-	if (e->next)
-		e->next->prev = e->prev;
-	if (e->prev)
-		e->prev->next = e->next;
-	else
-		proto->expectations = e->next;
+	proto_expectation_unlink(proto, e);
 
 	__sync_fetch_and_and(&e->flags, ~PROTO_EXPECTATION_FLAG_QUEUED);
 
@@ -867,6 +1071,69 @@ struct proto_number_class *proto_number_class_get(char *name) {
 
 }
 
+static int proto_number_class_build_index(struct proto_number_class *cls) {
+
+	// Lookups don't lock anything so the index can only be swapped while processing is paused
+	core_assert_is_paused();
+
+	unsigned int count = 0, max = 0;
+	struct proto_number *num;
+	for (num = cls->nums; num; num = num->next) {
+		count++;
+		if (num->val > max)
+			max = num->val;
+	}
+
+	struct proto_number_index *index = NULL;
+
+	if (count) {
+		unsigned int direct = (max < PROTO_NUMBER_DIRECT_MAX);
+		unsigned int size = (direct ? max + 1 : count);
+		size_t index_size = sizeof(struct proto_number_index) + (sizeof(struct proto *) * size);
+		if (!direct)
+			index_size += sizeof(unsigned int) * size;
+
+		index = malloc(index_size);
+		if (!index) {
+			pom_oom(index_size);
+			return POM_ERR;
+		}
+		memset(index, 0, index_size);
+		index->direct = direct;
+		index->protos = (void *)index + sizeof(struct proto_number_index);
+
+		if (direct) {
+			index->size = size;
+			// The most recent registration wins, like it used to with the list
+			for (num = cls->nums; num; num = num->next) {
+				if (!index->protos[num->val])
+					index->protos[num->val] = num->proto;
+			}
+		} else {
+			index->vals = (void *)index->protos + (sizeof(struct proto *) * size);
+			// Insertion sort, keeping the first registration found for duplicate values
+			for (num = cls->nums; num; num = num->next) {
+				unsigned int i = index->size;
+				while (i > 0 && index->vals[i - 1] > num->val)
+					i--;
+				if (i > 0 && index->vals[i - 1] == num->val)
+					continue;
+				memmove(&index->vals[i + 1], &index->vals[i], sizeof(unsigned int) * (index->size - i));
+				memmove(&index->protos[i + 1], &index->protos[i], sizeof(struct proto *) * (index->size - i));
+				index->vals[i] = num->val;
+				index->protos[i] = num->proto;
+				index->size++;
+			}
+		}
+	}
+
+	struct proto_number_index *old = cls->index;
+	cls->index = index;
+	free(old);
+
+	return POM_OK;
+}
+
 int proto_number_register(char *class, unsigned int proto_num, struct proto *p) {
 
 	struct proto_number_class *cls = proto_number_class_get(class);
@@ -888,6 +1155,14 @@ int proto_number_register(char *class, unsigned int proto_num, struct proto *p)
 		num->next->prev = num;
 	cls->nums = num;
 
+	if (proto_number_class_build_index(cls) != POM_OK) {
+		cls->nums = num->next;
+		if (cls->nums)
+			cls->nums->prev = NULL;
+		free(num);
+		return POM_ERR;
+	}
+
 	return POM_OK;
 }
 
@@ -898,35 +1173,68 @@ struct proto *proto_get_by_number(struct proto *p, unsigned int num) {
 		return NULL;
 	}
 
-	struct proto_number *n;
-	for (n = p->number_class->nums; n && n->val != num; n = n->next);
+	struct proto_number_index *index = p->number_class->index;
+	if (!index)
+		return NULL;
+
+	if (index->direct)
+		return (num < index->size ? index->protos[num] : NULL);
+
+	unsigned int lo = 0, hi = index->size;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (index->vals[mid] < num)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	if (n)
-		return n->proto;
+	if (lo < index->size && index->vals[lo] == num)
+		return index->protos[lo];
 
 	return NULL;
 }
 
 int proto_number_unregister(struct proto *p) {
 
+	int res = POM_OK;
+
 	struct proto_number_class *cls;
 	for (cls = proto_number_class_head; cls; cls = cls->next) {
-		struct proto_number *num;
-		for (num = cls->nums; num && num->proto != p; num = num->next);
-
-		if (num) {
-			if (num->next)
-				num->next->prev = num->prev;
-			if (num->prev)
-				num->prev->next = num->next;
+		struct proto_number *num = cls->nums;
+		int found = 0;
+
+		// A proto may be registered more than once in the same class
+		while (num) {
+			struct proto_number *tmp = num;
+			num = num->next;
+
+			if (tmp->proto != p)
+				continue;
+
+			if (tmp->next)
+				tmp->next->prev = tmp->prev;
+			if (tmp->prev)
+				tmp->prev->next = tmp->next;
 			else
-				cls->nums = num->next;
-			free(num);
+				cls->nums = tmp->next;
+			free(tmp);
+			found = 1;
 		}
 
+		if (!found || proto_number_class_build_index(cls) == POM_OK)
+			continue;
+
+		// Make sure the current index doesn't reference this proto anymore
+		unsigned int i;
+		for (i = 0; cls->index && i < cls->index->size; i++) {
+			if (cls->index->protos[i] == p)
+				cls->index->protos[i] = NULL;
+		}
+		res = POM_ERR;
 	}
 
-	return POM_OK;
+	return res;
 
 }
 
@@ -26,12 +26,18 @@
 #include "packet.h"
 #include "conntrack.h"
 #include "registry.h"
+#include "filter.h"
 
 #define PROTO_REGISTRY "proto"
 
 #define PROTO_EXPECTATION_FLAG_QUEUED	0x1
 #define PROTO_EXPECTATION_FLAG_MATCHED	0x2
 
+#define PROTO_EXPECTATION_HASH_SIZE	1024
+
+// Number classes with all their values below this use a direct lookup table
+#define PROTO_NUMBER_DIRECT_MAX		8192
+
 struct proto {
 
 	struct proto_reg_info *info;
@@ -47,9 +53,13 @@ struct proto {
 
 	struct proto_packet_listener *packet_listeners;
 	struct proto_packet_listener *payload_listeners;
+	struct filter_index packet_listeners_index;
+	struct filter_index payload_listeners_index;
 
 	pthread_rwlock_t expectation_lock;
-	struct proto_expectation *expectations;
+	struct proto_expectation *expectations; // Expectations without a value for this proto
+	struct proto_expectation **expectation_table; // Expectations hashed by their value for this proto
+	unsigned int expectation_count;
 
 	struct proto_number_class *number_class;
 
@@ -60,6 +70,11 @@ struct proto {
 	struct registry_perf *perf_conn_hash_col;
 	struct registry_perf *perf_expt_pending;
 	struct registry_perf *perf_expt_matched;
+	struct registry_perf *perf_expt_lookups;
+	struct registry_perf *perf_expt_lookup_time;
+	struct registry_perf *perf_process_time;
+
+	unsigned int profiler_process_id, profiler_post_process_id;
 
 	struct proto *next, *prev;
 
@@ -87,6 +102,7 @@ struct proto_expectation {
 	struct timer *expiry;
 	struct conntrack_session *session;
 	struct proto_expectation *prev, *next;
+	struct proto_expectation **list; // List head where the expectation is queued
 	int flags;
 	void (*match_callback) (struct proto_expectation *e, void *callback_priv, struct conntrack_entry *ce);
 };
@@ -98,12 +114,21 @@ struct proto_number {
 	struct proto_number *prev, *next;
 };
 
+struct proto_number_index {
+
+	unsigned int direct; // Protos are indexed by their number, otherwise sorted by vals
+	unsigned int size;
+	unsigned int *vals;
+	struct proto **protos;
+};
+
 struct proto_number_class {
 	char *name;
 	size_t size;
 	
 	struct proto_number_class *next;
 	struct proto_number *nums;
+	struct proto_number_index *index;
 };
 
 int proto_init();
@@ -116,5 +141,6 @@ int proto_expectation_timeout(void *priv, ptime now);
 unsigned int proto_get_count();
 struct proto_number_class *proto_number_class_get(char *name);
 int proto_number_unregister(struct proto *p);
+void proto_bpf_filter_update();
 
 #endif
@@ -31,6 +31,9 @@
 #include <pom-ng/ptype_uint32.h>
 #include <pom-ng/ptype_uint64.h>
 
+#include <ctype.h>
+#include <inttypes.h>
+
 static struct datavalue_template registry_config_list_dataset_template[] = {
 
 	{ .name = "name", .type = "string" },
@@ -58,6 +61,22 @@ static size_t registry_uid_table_size = 0;
 static unsigned int registry_uid_seedp = 0;
 static uint32_t registry_serial = 0, registry_classes_serial = 0, registry_config_serial = 0;
 
+static volatile int registry_perf_hist_enabled = 0;
+
+static __thread int registry_perf_shard_id = -1;
+static unsigned int registry_perf_shard_next = 0;
+
+static void registry_perf_hist_cleanup(struct registry_perf *p);
+
+// Metric names are rendered once and reused until a class, instance or perf changes
+static struct registry_metric *registry_metrics = NULL;
+static unsigned int registry_metrics_count = 0;
+static uint32_t registry_metrics_serial = 1, registry_metrics_table_serial = 0;
+static char *registry_metrics_buff = NULL;
+static size_t registry_metrics_buff_size = 0, registry_metrics_buff_len = 0;
+
+static void registry_metrics_table_cleanup();
+
 int registry_init() {
 
 	if (pom_mutex_init_type(&registry_global_lock, PTHREAD_MUTEX_RECURSIVE) != POM_OK)
@@ -81,6 +100,11 @@ int registry_cleanup() {
 	pthread_mutex_destroy(&registry_global_lock);
 
 	free(registry_uid_table);
+
+	registry_metrics_table_cleanup();
+	free(registry_metrics_buff);
+	registry_metrics_buff = NULL;
+	registry_metrics_buff_size = 0;
 	
 	return POM_OK;
 }
@@ -141,6 +165,7 @@ struct registry_class* registry_add_class(char *name) {
 	if (c->next)
 		registry_head->prev = c;
 	registry_head = c;
+	registry_metrics_serial++;
 	registry_unlock();
 
 	return c;
@@ -161,6 +186,8 @@ int registry_remove_class(struct registry_class *c) {
 	if (c->next)
 		c->next->prev = c->prev;
 
+	registry_metrics_serial++;
+
 	while (c->types) {
 		struct registry_instance_type *t = c->types;
 		c->types = c->types->next;
@@ -198,9 +225,12 @@ int registry_remove_class(struct registry_class *c) {
 			}
 		}
 
+		registry_perf_hist_cleanup(p);
+
 		free(p->name);
 		free(p->description);
 		free(p->unit);
+		free(p->shards);
 		free(p);
 	}
 
@@ -365,9 +395,12 @@ int registry_remove_instance(struct registry_instance *i) {
 			}
 		}
 
+		registry_perf_hist_cleanup(p);
+
 		free(p->name);
 		free(p->description);
 		free(p->unit);
+		free(p->shards);
 		free(p);
 	}
 
@@ -815,6 +848,7 @@ int registry_uid_assign(struct registry_instance *instance, char* uid) {
 
 void registry_classes_serial_inc() {
 	registry_classes_serial++;
+	registry_metrics_serial++;
 
 	registry_serial++;
 
@@ -1492,11 +1526,50 @@ struct registry_perf *registry_perf_alloc(const char *name, enum registry_perf_t
 		return NULL;
 	}
 
+	if (type == registry_perf_type_histogram) {
+		size_t size = sizeof(struct registry_perf_hist *) * REGISTRY_PERF_SHARDS;
+		perf->hists = malloc(size);
+		if (!perf->hists) {
+			free(perf->name);
+			free(perf->description);
+			free(perf->unit);
+			free(perf);
+			pom_oom(size);
+			return NULL;
+		}
+		memset(perf->hists, 0, size);
+	} else if (type != registry_perf_type_timeticks) {
+		size_t size = sizeof(struct registry_perf_shard) * REGISTRY_PERF_SHARDS;
+		if (posix_memalign((void **)&perf->shards, REGISTRY_PERF_CACHE_LINE, size)) {
+			free(perf->name);
+			free(perf->description);
+			free(perf->unit);
+			free(perf);
+			pom_oom(size);
+			return NULL;
+		}
+		memset(perf->shards, 0, size);
+	}
+
 	perf->type = type;
 
 	return perf;
 }
 
+static int registry_perf_get_shard_id() {
+
+	// Each thread gets its own slot until there are more threads than slots
+	if (registry_perf_shard_id < 0)
+		registry_perf_shard_id = __sync_fetch_and_add(&registry_perf_shard_next, 1) % REGISTRY_PERF_SHARDS;
+
+	return registry_perf_shard_id;
+}
+
+static struct registry_perf_shard *registry_perf_get_shard(struct registry_perf *p) {
+
+	return &p->shards[registry_perf_get_shard_id()];
+}
+
 struct registry_perf *registry_class_add_perf(struct registry_class *c, const char *name, enum registry_perf_type type, const char *description, const char *unit) {
 	
 	struct registry_perf *p = registry_perf_alloc(name, type, description, unit);
@@ -1506,6 +1579,7 @@ struct registry_perf *registry_class_add_perf(struct registry_class *c, const ch
 	registry_lock();
 	p->next = c->perfs;
 	c->perfs = p;
+	registry_metrics_serial++;
 	registry_unlock();
 	
 	return p;
@@ -1520,6 +1594,7 @@ struct registry_perf *registry_instance_add_perf(struct registry_instance *i, co
 	registry_lock();
 	p->next = i->perfs;
 	i->perfs = p;
+	registry_metrics_serial++;
 	registry_unlock();
 	
 	return p;
@@ -1530,6 +1605,9 @@ void registry_perf_set_update_hook(struct registry_perf *p, int (*update_hook) (
 	if (p->type == registry_perf_type_timeticks) {
 		pomlog(POMLOG_ERR "Trying to set an update hook on a timeticks perf");
 		return;
+	} else if (p->type == registry_perf_type_histogram) {
+		pomlog(POMLOG_ERR "Trying to set an update hook on a histogram perf");
+		return;
 	}
 
 	if (!update_hook) {
@@ -1563,12 +1641,15 @@ void registry_perf_inc(struct registry_perf *p, uint64_t val) {
 	if (p->type == registry_perf_type_timeticks) {
 		pomlog(POMLOG_ERR "Trying to increase a perf item of type timeticks");
 		return;
+	} else if (p->type == registry_perf_type_histogram) {
+		pomlog(POMLOG_ERR "Trying to increase a perf item of type histogram");
+		return;
 	} else if (p->update_hook) {
 		pomlog(POMLOG_ERR "Trying to increase a perf item with an update hook");
 		return;
 	}
 
-	__sync_fetch_and_add(&p->value, val);
+	__sync_fetch_and_add(&registry_perf_get_shard(p)->value, val);
 }
 
 void registry_perf_dec(struct registry_perf *p, uint64_t val) {
@@ -1581,7 +1662,7 @@ void registry_perf_dec(struct registry_perf *p, uint64_t val) {
 		return;
 	}
 
-	__sync_fetch_and_sub(&p->value, val);
+	__sync_fetch_and_sub(&registry_perf_get_shard(p)->value, val);
 }
 
 void registry_perf_timeticks_stop(struct registry_perf *p) {
@@ -1627,16 +1708,36 @@ uint64_t registry_perf_getval(struct registry_perf *p) {
 
 	// Since we have memory barrier for updating the value
 	// I don't think there is the need for one for simply reading it
-	if (p->type != registry_perf_type_timeticks) {
+	if (p->type == registry_perf_type_histogram) {
+
+		// The value of a histogram is the number of samples recorded
+		uint64_t count = 0;
+		int i;
+		for (i = 0; i < REGISTRY_PERF_SHARDS; i++) {
+			if (p->hists[i])
+				count += p->hists[i]->count;
+		}
+
+		return count;
+
+	} else if (p->type != registry_perf_type_timeticks) {
 
 		if (p->update_hook) {
 			pom_mutex_lock(&p->hook_lock);
 			if (p->update_hook((uint64_t*)&p->value, p->hook_priv) != POM_OK)
 				pomlog(POMLOG_WARN "Warning: update of performance %s value failed.", p->name);
 			pom_mutex_unlock(&p->hook_lock);
+
+			return p->value;
 		}
 
-		return p->value;
+		// Gauges may go below zero in one slot, the wrap around cancels out in the sum
+		uint64_t value = 0;
+		int i;
+		for (i = 0; i < REGISTRY_PERF_SHARDS; i++)
+			value += p->shards[i].value;
+
+		return value;
 
 	}
 
@@ -1654,6 +1755,15 @@ void registry_perf_reset(struct registry_perf *p) {
 	if (p->type == registry_perf_type_gauge)
 		return;
 
+	if (p->type == registry_perf_type_histogram) {
+		int i;
+		for (i = 0; i < REGISTRY_PERF_SHARDS; i++) {
+			if (p->hists[i])
+				memset((void *)p->hists[i], 0, sizeof(struct registry_perf_hist));
+		}
+		return;
+	}
+
 	if (p->update_hook) {
 		pom_mutex_lock(&p->hook_lock);
 		p->value = 0;
@@ -1666,11 +1776,207 @@ void registry_perf_reset(struct registry_perf *p) {
 			p->value = 0;
 		}
 
-	}else {
-		p->value = 0;
+	} else {
+		int i;
+		for (i = 0; i < REGISTRY_PERF_SHARDS; i++)
+			p->shards[i].value = 0;
 	}
 }
 
+static void registry_perf_hist_cleanup(struct registry_perf *p) {
+
+	if (!p->hists)
+		return;
+
+	int i;
+	for (i = 0; i < REGISTRY_PERF_SHARDS; i++)
+		free(p->hists[i]);
+
+	free(p->hists);
+	p->hists = NULL;
+}
+
+void registry_perf_hist_set_enabled(int enabled) {
+
+	registry_perf_hist_enabled = enabled;
+}
+
+// Returns 0 when the latencies are not recorded, registry_perf_hist_record_since() then skips them
+uint64_t registry_perf_hist_clock() {
+
+	if (!registry_perf_hist_enabled)
+		return 0;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000LLU) + ts.tv_nsec;
+}
+
+void registry_perf_hist_record_since(struct registry_perf *p, uint64_t start) {
+
+	// Nothing to record if the clock wasn't read at the start or recording was disabled since
+	if (!start)
+		return;
+
+	uint64_t now = registry_perf_hist_clock();
+	if (now >= start)
+		registry_perf_hist_record(p, now - start);
+}
+
+static unsigned int registry_perf_hist_get_bucket(uint64_t val) {
+
+	if (val >> REGISTRY_PERF_HIST_MAX_BITS)
+		return REGISTRY_PERF_HIST_BUCKETS - 1;
+
+	// The first two powers of two are accounted linearly
+	if (val < (2 << REGISTRY_PERF_HIST_SUB_BITS))
+		return val;
+
+	unsigned int shift = (63 - __builtin_clzll(val)) - REGISTRY_PERF_HIST_SUB_BITS;
+	return (shift << REGISTRY_PERF_HIST_SUB_BITS) + (val >> shift);
+}
+
+static uint64_t registry_perf_hist_get_bucket_max(unsigned int bucket) {
+
+	if (bucket < (2 << REGISTRY_PERF_HIST_SUB_BITS))
+		return bucket;
+
+	unsigned int shift = (bucket >> REGISTRY_PERF_HIST_SUB_BITS) - 1;
+	uint64_t sub = bucket - (shift << REGISTRY_PERF_HIST_SUB_BITS);
+	return ((sub + 1) << shift) - 1;
+}
+
+void registry_perf_hist_record(struct registry_perf *p, uint64_t val) {
+
+	if (p->type != registry_perf_type_histogram) {
+		pomlog(POMLOG_ERR "Trying to record a value in a perf item which is not of type histogram");
+		return;
+	}
+
+	int id = registry_perf_get_shard_id();
+	struct registry_perf_hist *h = p->hists[id];
+	if (!h) {
+		if (posix_memalign((void **)&h, REGISTRY_PERF_CACHE_LINE, sizeof(struct registry_perf_hist))) {
+			pom_oom(sizeof(struct registry_perf_hist));
+			return;
+		}
+		memset(h, 0, sizeof(struct registry_perf_hist));
+
+		// Another thread sharing this slot may have been faster
+		if (!__sync_bool_compare_and_swap(&p->hists[id], NULL, h)) {
+			free(h);
+			h = p->hists[id];
+		}
+	}
+
+	__sync_fetch_and_add(&h->buckets[registry_perf_hist_get_bucket(val)], 1);
+	__sync_fetch_and_add(&h->sum, val);
+	__sync_fetch_and_add(&h->count, 1);
+
+	uint64_t max = h->max;
+	while (val > max) {
+		if (__sync_bool_compare_and_swap(&h->max, max, val))
+			break;
+		max = h->max;
+	}
+}
+
+struct registry_perf_hist_snapshot *registry_perf_hist_snapshot(struct registry_perf *p) {
+
+	if (p->type != registry_perf_type_histogram) {
+		pomlog(POMLOG_ERR "Trying to get a snapshot of a perf item which is not of type histogram");
+		return NULL;
+	}
+
+	struct registry_perf_hist_snapshot *s = malloc(sizeof(struct registry_perf_hist_snapshot));
+	if (!s) {
+		pom_oom(sizeof(struct registry_perf_hist_snapshot));
+		return NULL;
+	}
+	memset(s, 0, sizeof(struct registry_perf_hist_snapshot));
+
+	int i;
+	for (i = 0; i < REGISTRY_PERF_SHARDS; i++) {
+		struct registry_perf_hist *h = p->hists[i];
+		if (!h)
+			continue;
+
+		unsigned int j;
+		for (j = 0; j < REGISTRY_PERF_HIST_BUCKETS; j++)
+			s->buckets[j] += h->buckets[j];
+
+		s->count += h->count;
+		s->sum += h->sum;
+		if (h->max > s->max)
+			s->max = h->max;
+	}
+
+	return s;
+}
+
+void registry_perf_hist_snapshot_merge(struct registry_perf_hist_snapshot *dst, struct registry_perf_hist_snapshot *src) {
+
+	unsigned int i;
+	for (i = 0; i < REGISTRY_PERF_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+uint64_t registry_perf_hist_snapshot_percentile(struct registry_perf_hist_snapshot *s, double pct) {
+
+	// The buckets are read one by one so their total may differ slightly from the count
+	uint64_t total = 0;
+	unsigned int i;
+	for (i = 0; i < REGISTRY_PERF_HIST_BUCKETS; i++)
+		total += s->buckets[i];
+
+	if (!total)
+		return 0;
+
+	if (pct < 0.0)
+		pct = 0.0;
+	else if (pct > 100.0)
+		pct = 100.0;
+
+	uint64_t target = (uint64_t) ((pct / 100.0) * total + 0.5);
+	if (!target)
+		target = 1;
+
+	uint64_t seen = 0;
+	for (i = 0; i < REGISTRY_PERF_HIST_BUCKETS; i++) {
+		seen += s->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	// Report the highest value of the bucket without going over the max recorded
+	uint64_t val = registry_perf_hist_get_bucket_max(i);
+	if (s->max && val > s->max)
+		val = s->max;
+
+	return val;
+}
+
+void registry_perf_hist_snapshot_cleanup(struct registry_perf_hist_snapshot *s) {
+	free(s);
+}
+
+uint64_t registry_perf_hist_percentile(struct registry_perf *p, double pct) {
+
+	struct registry_perf_hist_snapshot *s = registry_perf_hist_snapshot(p);
+	if (!s)
+		return 0;
+
+	uint64_t val = registry_perf_hist_snapshot_percentile(s, pct);
+	registry_perf_hist_snapshot_cleanup(s);
+
+	return val;
+}
+
 void registry_perf_reset_all() {
 	registry_lock();
 
@@ -1679,14 +1985,14 @@ void registry_perf_reset_all() {
 		
 		struct registry_perf *p;
 		for (p = ctmp->perfs; p; p = p->next) {
-			if (p->type == registry_perf_type_counter)
+			if (p->type == registry_perf_type_counter || p->type == registry_perf_type_histogram)
 				registry_perf_reset(p);
 		}
 
 		struct registry_instance *inst;
 		for (inst = ctmp->instances; inst; inst = inst->next) {
 			for (p = inst->perfs; p; p = p->next) {
-				if (p->type == registry_perf_type_counter)
+				if (p->type == registry_perf_type_counter || p->type == registry_perf_type_histogram)
 					registry_perf_reset(p);
 			}
 		}
@@ -1694,6 +2000,313 @@ void registry_perf_reset_all() {
 	registry_unlock();
 }
 
+static void registry_metrics_table_cleanup() {
+
+	unsigned int i;
+	for (i = 0; i < registry_metrics_count; i++) {
+		free(registry_metrics[i].name);
+		free(registry_metrics[i].labels);
+		free(registry_metrics[i].header);
+	}
+	free(registry_metrics);
+	registry_metrics = NULL;
+	registry_metrics_count = 0;
+	registry_metrics_table_serial = 0;
+}
+
+static int registry_metrics_printf(const char *fmt, ...) {
+
+	while (1) {
+		size_t avail = registry_metrics_buff_size - registry_metrics_buff_len;
+
+		va_list ap;
+		va_start(ap, fmt);
+		int res = vsnprintf(registry_metrics_buff + registry_metrics_buff_len, avail, fmt, ap);
+		va_end(ap);
+
+		if (res < 0)
+			return POM_ERR;
+
+		if ((size_t) res < avail) {
+			registry_metrics_buff_len += res;
+			return POM_OK;
+		}
+
+		// The buffer is kept between scrapes, it only grows until it fits
+		size_t new_size = (registry_metrics_buff_size ? registry_metrics_buff_size * 2 : REGISTRY_METRICS_BUFF_SIZE);
+		while (new_size < registry_metrics_buff_len + res + 1)
+			new_size *= 2;
+
+		char *new_buff = realloc(registry_metrics_buff, new_size);
+		if (!new_buff) {
+			pom_oom(new_size);
+			return POM_ERR;
+		}
+		registry_metrics_buff = new_buff;
+		registry_metrics_buff_size = new_size;
+	}
+}
+
+static char *registry_metrics_escape(const char *str, int quote) {
+
+	size_t len = 0;
+	const char *c;
+	for (c = str; *c; c++)
+		len += ((*c == '\\' || *c == '\n' || (quote && *c == '"')) ? 2 : 1);
+
+	char *res = malloc(len + 1);
+	if (!res) {
+		pom_oom(len + 1);
+		return NULL;
+	}
+
+	char *out = res;
+	for (c = str; *c; c++) {
+		if (*c == '\n') {
+			*out++ = '\\';
+			*out++ = 'n';
+		} else {
+			if (*c == '\\' || (quote && *c == '"'))
+				*out++ = '\\';
+			*out++ = *c;
+		}
+	}
+	*out = 0;
+
+	return res;
+}
+
+static char *registry_metrics_get_type(struct registry_perf *p) {
+
+	if (p->type == registry_perf_type_counter || p->type == registry_perf_type_timeticks)
+		return "counter";
+	else if (p->type == registry_perf_type_histogram)
+		return "summary";
+
+	return "gauge";
+}
+
+static int registry_metrics_add(struct registry_class *c, struct registry_instance *inst, struct registry_perf *p) {
+
+	char *suffix = "";
+	if (p->type == registry_perf_type_counter || p->type == registry_perf_type_timeticks)
+		suffix = "_total";
+
+	size_t len = strlen(REGISTRY_METRICS_PREFIX) + strlen(c->name) + 1 + strlen(p->name) + strlen(suffix) + 1;
+	char *name = malloc(len);
+	if (!name) {
+		pom_oom(len);
+		return POM_ERR;
+	}
+	snprintf(name, len, REGISTRY_METRICS_PREFIX "%s_%s%s", c->name, p->name, suffix);
+
+	// Only [a-zA-Z0-9_:] is allowed in metric names
+	char *tmp;
+	for (tmp = name; *tmp; tmp++) {
+		if (!isalnum((unsigned char) *tmp) && *tmp != '_' && *tmp != ':')
+			*tmp = '_';
+	}
+
+	char *labels = NULL;
+	if (inst) {
+		char *inst_name = registry_metrics_escape(inst->name, 1);
+		if (!inst_name) {
+			free(name);
+			return POM_ERR;
+		}
+		// Prometheus sets the instance label itself, don't clash with it
+		len = strlen(REGISTRY_METRICS_INSTANCE_LABEL "=\"\"") + strlen(inst_name) + 1;
+		labels = malloc(len);
+		if (!labels) {
+			free(inst_name);
+			free(name);
+			pom_oom(len);
+			return POM_ERR;
+		}
+		snprintf(labels, len, REGISTRY_METRICS_INSTANCE_LABEL "=\"%s\"", inst_name);
+		free(inst_name);
+	}
+
+	if (registry_metrics_count % REGISTRY_METRICS_TABLE_STEP == 0) {
+		size_t size = sizeof(struct registry_metric) * (registry_metrics_count + REGISTRY_METRICS_TABLE_STEP);
+		struct registry_metric *new_metrics = realloc(registry_metrics, size);
+		if (!new_metrics) {
+			free(labels);
+			free(name);
+			pom_oom(size);
+			return POM_ERR;
+		}
+		registry_metrics = new_metrics;
+	}
+
+	struct registry_metric *m = &registry_metrics[registry_metrics_count++];
+	memset(m, 0, sizeof(struct registry_metric));
+	m->name = name;
+	m->labels = labels;
+	m->perf = p;
+
+	return POM_OK;
+}
+
+static int registry_metrics_compare(const void *a, const void *b) {
+
+	const struct registry_metric *ma = a, *mb = b;
+	int res = strcmp(ma->name, mb->name);
+	if (res)
+		return res;
+
+	if (!ma->labels || !mb->labels)
+		return (ma->labels ? 1 : (mb->labels ? -1 : 0));
+
+	return strcmp(ma->labels, mb->labels);
+}
+
+static int registry_metrics_table_build() {
+
+	// Must be called with the registry locked
+
+	registry_metrics_table_cleanup();
+
+	struct registry_class *c;
+	for (c = registry_head; c; c = c->next) {
+		struct registry_perf *p;
+		for (p = c->perfs; p; p = p->next) {
+			if (registry_metrics_add(c, NULL, p) != POM_OK)
+				goto err;
+		}
+
+		struct registry_instance *inst;
+		for (inst = c->instances; inst; inst = inst->next) {
+			for (p = inst->perfs; p; p = p->next) {
+				if (registry_metrics_add(c, inst, p) != POM_OK)
+					goto err;
+			}
+		}
+	}
+
+	// Samples of the same metric must be grouped under a single header
+	qsort(registry_metrics, registry_metrics_count, sizeof(struct registry_metric), registry_metrics_compare);
+
+	unsigned int i, first = 0;
+	for (i = 0; i < registry_metrics_count; i++) {
+		struct registry_metric *m = &registry_metrics[i];
+		char *type = registry_metrics_get_type(m->perf);
+
+		if (i > 0 && !strcmp(m->name, registry_metrics[first].name)) {
+			// A class perf and an instance perf may share a name but not a type
+			if (strcmp(type, registry_metrics_get_type(registry_metrics[first].perf))) {
+				pomlog(POMLOG_DEBUG "Not exporting perf %s of %s, its type conflicts with another one of the same name", m->perf->name, (m->labels ? m->labels : "the class"));
+				m->skip = 1;
+			}
+			continue;
+		}
+		first = i;
+
+		char *help = registry_metrics_escape(m->perf->description, 0);
+		if (!help)
+			goto err;
+
+		size_t len = strlen("# HELP  \n# TYPE  \n") + (strlen(m->name) * 2) + strlen(help) + strlen(m->perf->unit) + strlen(type) + 4;
+		m->header = malloc(len);
+		if (!m->header) {
+			free(help);
+			pom_oom(len);
+			goto err;
+		}
+
+		if (strlen(m->perf->unit))
+			snprintf(m->header, len, "# HELP %s %s (%s)\n# TYPE %s %s\n", m->name, help, m->perf->unit, m->name, type);
+		else
+			snprintf(m->header, len, "# HELP %s %s\n# TYPE %s %s\n", m->name, help, m->name, type);
+		free(help);
+	}
+
+	registry_metrics_table_serial = registry_metrics_serial;
+
+	return POM_OK;
+
+err:
+	registry_metrics_table_cleanup();
+	return POM_ERR;
+}
+
+static int registry_metrics_render_perf(struct registry_metric *m) {
+
+	char *l = (m->labels ? m->labels : "");
+	char *sep = (m->labels ? "," : "");
+
+	if (m->perf->type != registry_perf_type_histogram) {
+		if (m->labels)
+			return registry_metrics_printf("%s{%s} %"PRIu64"\n", m->name, l, registry_perf_getval(m->perf));
+		return registry_metrics_printf("%s %"PRIu64"\n", m->name, registry_perf_getval(m->perf));
+	}
+
+	struct registry_perf_hist_snapshot *s = registry_perf_hist_snapshot(m->perf);
+	if (!s)
+		return POM_ERR;
+
+	static const char *quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+	static const double pcts[] = { 50.0, 90.0, 99.0, 99.9 };
+
+	int res = POM_OK;
+	unsigned int i;
+	for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]) && res == POM_OK; i++)
+		res = registry_metrics_printf("%s{%s%squantile=\"%s\"} %"PRIu64"\n", m->name, l, sep, quantiles[i], registry_perf_hist_snapshot_percentile(s, pcts[i]));
+
+	if (res == POM_OK) {
+		if (m->labels)
+			res = registry_metrics_printf("%s_sum{%s} %"PRIu64"\n%s_count{%s} %"PRIu64"\n", m->name, l, s->sum, m->name, l, s->count);
+		else
+			res = registry_metrics_printf("%s_sum %"PRIu64"\n%s_count %"PRIu64"\n", m->name, s->sum, m->name, s->count);
+	}
+
+	registry_perf_hist_snapshot_cleanup(s);
+
+	return res;
+}
+
+char *registry_metrics_render(size_t *len) {
+
+	registry_lock();
+
+	if (registry_metrics_table_serial != registry_metrics_serial && registry_metrics_table_build() != POM_OK) {
+		registry_unlock();
+		return NULL;
+	}
+
+	registry_metrics_buff_len = 0;
+
+	unsigned int i;
+	for (i = 0; i < registry_metrics_count; i++) {
+		struct registry_metric *m = &registry_metrics[i];
+		if (m->skip)
+			continue;
+		if (m->header && registry_metrics_printf("%s", m->header) != POM_OK)
+			goto err;
+		if (registry_metrics_render_perf(m) != POM_OK)
+			goto err;
+	}
+
+	// Hand over a copy, the render buffer is reused by the next scrape
+	char *res = malloc(registry_metrics_buff_len + 1);
+	if (!res) {
+		pom_oom(registry_metrics_buff_len + 1);
+		goto err;
+	}
+	if (registry_metrics_buff_len)
+		memcpy(res, registry_metrics_buff, registry_metrics_buff_len);
+	res[registry_metrics_buff_len] = 0;
+	*len = registry_metrics_buff_len;
+
+	registry_unlock();
+
+	return res;
+
+err:
+	registry_unlock();
+	return NULL;
+}
+
 uint32_t registry_serial_poll(uint32_t last_serial, struct timespec *timeout) {
 
 
@@ -32,6 +32,25 @@
 // Use the msb for started/stopped flag
 #define REGISTRY_PERF_TIMETICKS_STARTED (1LLU << 63)
 
+#define REGISTRY_METRICS_PREFIX		"pomng_"
+#define REGISTRY_METRICS_INSTANCE_LABEL	"pom_instance"
+#define REGISTRY_METRICS_BUFF_SIZE	65536
+#define REGISTRY_METRICS_TABLE_STEP	64
+
+// Counters and gauges are split across per thread slots to avoid cache line bouncing
+#define REGISTRY_PERF_SHARDS		32
+#define REGISTRY_PERF_CACHE_LINE	64
+
+struct registry_perf_shard {
+	volatile uint64_t value;
+} __attribute__((aligned(REGISTRY_PERF_CACHE_LINE)));
+
+// Histograms are recorded in a per thread copy allocated on first use
+struct registry_perf_hist {
+	volatile uint64_t count, sum, max;
+	volatile uint64_t buckets[REGISTRY_PERF_HIST_BUCKETS];
+} __attribute__((aligned(REGISTRY_PERF_CACHE_LINE)));
+
 struct registry_perf {
 
 	char *name;
@@ -39,6 +58,8 @@ struct registry_perf {
 	char *unit;
 	enum registry_perf_type type;
 	volatile uint64_t value;
+	struct registry_perf_shard *shards;
+	struct registry_perf_hist **hists;
 	struct registry_perf *next;
 
 	int (*update_hook) (uint64_t *cur_val, void *priv);
@@ -46,6 +67,15 @@ struct registry_perf {
 	pthread_mutex_t hook_lock;
 };
 
+struct registry_metric {
+
+	char *name;
+	char *labels;
+	char *header; // HELP and TYPE lines, only set on the first metric of each name
+	int skip; // Type conflicting with the first metric of the same name
+	struct registry_perf *perf;
+};
+
 enum registry_param_info_type {
 
 	registry_param_info_type_none = 0,
@@ -180,7 +210,9 @@ int registry_config_load(char *config_name);
 int registry_config_delete(char *config_name);
 
 void registry_perf_reset_all();
+void registry_perf_hist_set_enabled(int enabled);
 
+char *registry_metrics_render(size_t *len);
 uint32_t registry_serial_poll(uint32_t last_serial, struct timespec *timeout);
 
 #endif
@@ -30,6 +30,39 @@
 #define debug_stream(x ...)
 #endif
 
+static int stream_process_pending(struct stream *stream, struct stream_pkt *own);
+static void stream_buff_sub(struct stream *stream, uint32_t len);
+
+// Bytes buffered by all the streams
+static uint64_t stream_buff_tot = 0;
+
+static pthread_mutex_t stream_buff_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stream *stream_buff_head = NULL, *stream_buff_tail = NULL;
+
+static struct registry_perf *perf_stream_buff = NULL;
+static struct registry_perf *perf_stream_forced_flush = NULL;
+static struct registry_perf *perf_stream_reorder_wait = NULL;
+
+static int stream_perf_buff_update(uint64_t *cur_val, void *priv) {
+
+	*cur_val = stream_buff_tot;
+	return POM_OK;
+}
+
+int stream_init() {
+
+	perf_stream_buff = core_add_perf("stream_buff", registry_perf_type_gauge, "Number of bytes buffered by the streams", "bytes");
+	perf_stream_forced_flush = core_add_perf("stream_forced_flush", registry_perf_type_counter, "Number of streams flushed to stay within the stream buffer budget", "flushes");
+	perf_stream_reorder_wait = core_add_perf("stream_reorder_wait", registry_perf_type_histogram, "Time spent by the packets in the stream buffers waiting to be reordered", "ns");
+
+	if (!perf_stream_buff || !perf_stream_forced_flush || !perf_stream_reorder_wait)
+		return POM_ERR;
+
+	registry_perf_set_update_hook(perf_stream_buff, stream_perf_buff_update, NULL);
+
+	return POM_OK;
+}
+
 struct stream* stream_alloc(uint32_t max_buff_size, struct conntrack_entry *ce, unsigned int flags, int (*handler) (struct conntrack_entry *ce, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index)) {
 	
 	struct stream *res = malloc(sizeof(struct stream));
@@ -47,34 +80,38 @@ struct stream* stream_alloc(uint32_t max_buff_size, struct conntrack_entry *ce,
 		free(res);
 		return NULL;
 	}
-	if (pthread_mutex_init(&res->wait_lock, NULL)) {
-		pomlog(POMLOG_ERR "Error while initializing stream wait lock : %s", pom_strerror(errno));
-		free(res);
-		return NULL;
-	}
 
 	res->flags = flags;
 	res->handler = handler;
+	res->skip_seed = ((uint32_t) (uintptr_t) res) | 0x1;
 
 	debug_stream("thread %p, entry %p, allocated", pthread_self(), res);
 
 	return res;
 }
 
-int stream_set_timeout(struct stream *stream, unsigned int timeout) {
+int stream_set_timeout(struct stream *stream, ptime timeout) {
 
 	stream->timeout = timeout;
 
 	return POM_OK;
 }
 
+int stream_set_gap_handler(struct stream *stream, int (*gap_handler) (struct conntrack_entry *ce, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index)) {
+
+	stream->gap_handler = gap_handler;
+
+	return POM_OK;
+}
+
 int stream_cleanup(struct stream *stream) {
 
+	// Wait for any thread flushing this stream
+	pom_mutex_lock(&stream->lock);
 
-	if (stream->wait_list_head) {
-		pomlog(POMLOG_ERR "Internal error, cleaning up stream while packets still present!");
-		return POM_ERR;
-	}
+	// Process what other threads may have handed over
+	if (stream->pending)
+		stream_process_pending(stream, NULL);
 
 	while (stream->head[0] || stream->head[1]) {
 		if (stream_force_dequeue(stream) == POM_ERR) {
@@ -83,26 +120,19 @@ int stream_cleanup(struct stream *stream) {
 		}
 	}
 
+	// Make sure the stream isn't reachable from the buffer list once freed
+	stream_buff_sub(stream, stream->cur_buff_size);
+
 	conntrack_delayed_cleanup(stream->ce, 0, stream->last_ts);
 
+	pom_mutex_unlock(&stream->lock);
+
 	int res = pthread_mutex_destroy(&stream->lock);
 	if (res){
 		pomlog(POMLOG_ERR "Error while destroying stream lock : %s", pom_strerror(res));
 	}
 
-	res = pthread_mutex_destroy(&stream->wait_lock);
-	if (res){
-		pomlog(POMLOG_ERR "Error while destroying stream wait lock : %s", pom_strerror(res));
-	}
 
-	while (stream->wait_list_unused) {
-		struct stream_thread_wait *tmp = stream->wait_list_unused;
-		stream->wait_list_unused = tmp->next;
-		if (pthread_cond_destroy(&tmp->cond))
-			pomlog(POMLOG_WARN "Error while destroying list condition");
-		free(tmp);
-	}
-	
 	free(stream);
 
 	debug_stream("thread %p, entry %p, released", pthread_self(), stream);
@@ -112,15 +142,27 @@ int stream_cleanup(struct stream *stream) {
 
 static void stream_end_process_packet(struct stream *stream) {
 
-	conntrack_delayed_cleanup(stream->ce, stream->timeout, stream->last_ts);
+	while (1) {
 
-	pom_mutex_unlock(&stream->lock);
-	pom_mutex_lock(&stream->wait_lock);
-	if (stream->wait_list_head) {
-		debug_stream("thread %p, entry %p : signaling thread %p", pthread_self(), stream, stream->wait_list_head->thread);
-		pthread_cond_broadcast(&stream->wait_list_head->cond);
+		// Another thread asked us to flush the stream to stay within the buffer budget
+		if (stream->flush_requested) {
+			stream->flush_requested = 0;
+			debug_stream("thread %p, entry %p, buffer budget exceeded, flushing %u bytes", pthread_self(), stream, stream->cur_buff_size);
+			if (stream_force_dequeue(stream) != POM_OK)
+				pomlog(POMLOG_ERR "Error while flushing the stream");
+			registry_perf_inc(perf_stream_forced_flush, 1);
+		}
+
+		conntrack_delayed_cleanup(stream->ce, stream->timeout, stream->last_ts);
+		pom_mutex_unlock(&stream->lock);
+
+		// Another thread may have handed over a packet after we last looked and failed to get the lock
+		__sync_synchronize();
+		if (!stream->pending || pthread_mutex_trylock(&stream->lock))
+			break;
+
+		stream_process_pending(stream, NULL);
 	}
-	pom_mutex_unlock(&stream->wait_lock);
 }
 
 static int stream_is_packet_old_dupe(struct stream *stream, struct stream_pkt *pkt, int direction) {
@@ -205,138 +247,280 @@ static int stream_is_packet_next(struct stream *stream, struct stream_pkt *pkt,
 
 static void stream_free_packet(struct stream_pkt *p) {
 
-	core_stack_release(p->stack);
+	unsigned int i;
+	for (i = 0; i <= p->stack_index; i++) {
+		if (p->stack[i].proto)
+			packet_info_pool_release(p->stack[i].pkt_info, p->stack[i].proto->id);
+	}
 	packet_release(p->pkt);
 	free(p);
 }
 
-int stream_process_packet(struct stream *stream, struct packet *pkt, struct proto_process_stack *stack, unsigned int stack_index, uint32_t seq, uint32_t ack) {
+static struct stream_pkt *stream_pkt_backup(struct stream *stream, struct stream_pkt *spkt) {
 
-	if (!stream || !pkt || !stack)
-		return PROTO_ERR;
+	// Only keep the layers up to ours, they share the packet info with the original stack
+	size_t size = sizeof(struct stream_pkt) + (sizeof(struct proto_process_stack) * (spkt->stack_index + 1));
+	struct stream_pkt *p = malloc(size);
+	if (!p) {
+		pom_oom(size);
+		return NULL;
+	}
+	memset(p, 0 , size);
 
-	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : start", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
 
-	struct proto_process_stack *cur_stack = &stack[stack_index];
-	int direction = cur_stack->direction;
+	int flags = 0;
+	if (stream->flags & STREAM_FLAG_PACKET_NO_COPY)
+		flags = PACKET_FLAG_FORCE_NO_COPY;
+	p->pkt = packet_clone(spkt->pkt, flags);
+	if (!p->pkt) {
+		free(p);
+		return NULL;
+	}
+	p->stack = (struct proto_process_stack *) (p + 1);
+	memcpy(p->stack, spkt->stack, sizeof(struct proto_process_stack) * (spkt->stack_index + 1));
 
-	int must_wait = 0;
+	unsigned int i;
+	for (i = 0; i <= spkt->stack_index; i++) {
+		if (p->stack[i].pkt_info)
+			packet_info_pool_ref(p->stack[i].pkt_info);
 
-	pom_mutex_lock(&stream->wait_lock);
+		if (p->stack[i].pload && spkt->pkt->buff != p->pkt->buff)
+			p->stack[i].pload = p->pkt->buff + (spkt->stack[i].pload - spkt->pkt->buff);
+	}
 
-	int res = pthread_mutex_trylock(&stream->lock);
-	if (res == EBUSY) {
-		// Already locked, let's wait a bit
-		must_wait = 1;
-	} else if (res) {
-		pomlog(POMLOG_ERR "Error while locking packet stream lock : %s", pom_strerror(res));
-		abort();
-		return POM_ERR;
-	} else {
+	p->flags = STREAM_PKT_FLAG_COMPACT;
+	p->plen = spkt->plen;
+	p->seq = spkt->seq;
+	p->ack = spkt->ack;
+	p->stack_index = spkt->stack_index;
 
-		// We got the processing lock. But was it really this thread's turn ?
+	return p;
+}
 
-		struct stream_thread_wait *tmp = stream->wait_list_head;
-		// A thread with a packet preceding ours is waiting
-		if (tmp && (tmp->ts < pkt->ts)) {
-			// No it wasn't, release it and signal the right thread
-			must_wait = 2;
-			pom_mutex_unlock(&stream->lock);
-			debug_stream("thread %p, entry %p : signaling thread %p", pthread_self(), stream, stream->wait_list_head->thread);
-			pthread_cond_broadcast(&stream->wait_list_head->cond);
-		} else {
-			// Yes it was. YAY !
-			pom_mutex_unlock(&stream->wait_lock);
+static int stream_seq_before(uint32_t a, uint32_t b) {
+
+	return ((a < b && b - a < STREAM_HALF_SEQ) || (a > b && a - b > STREAM_HALF_SEQ));
+}
+
+static struct stream_pkt *stream_find_prev(struct stream *stream, int direction, uint32_t seq, struct stream_pkt **update) {
+
+	// Find the last queued packet starting before seq, NULL if it goes first
+	// update is filled with the last packet before seq on each level of the skip list
+
+	struct stream_pkt *prev = NULL, *next;
+
+	int l;
+	for (l = STREAM_SKIP_LEVELS - 1; l >= 0; l--) {
+		next = (prev ? prev->skip[l] : stream->skip[direction][l]);
+		while (next && stream_seq_before(next->seq, seq)) {
+			prev = next;
+			next = prev->skip[l];
 		}
+		update[l] = prev;
+	}
 
+	next = (prev ? prev->next : stream->head[direction]);
+	while (next && stream_seq_before(next->seq, seq)) {
+		prev = next;
+		next = prev->next;
 	}
 
+	return prev;
+}
 
-	if (must_wait) {
+static int stream_is_packet_covered(struct stream *stream, struct stream_pkt *pkt, struct stream_pkt *prev, int direction) {
 
-		// Add ourself in the waiting list
-		struct stream_thread_wait *lst = NULL;
-		if (stream->wait_list_unused) {
-			lst = stream->wait_list_unused;
-			stream->wait_list_unused = lst->next;
-			lst->next = NULL;
-		} else {
-			lst = malloc(sizeof(struct stream_thread_wait));
-			if (!lst) {
-				pom_oom(sizeof(struct stream_thread_wait));
-				pom_mutex_unlock(&stream->wait_lock);
-				return POM_ERR;
-			}
-			memset(lst, 0, sizeof(struct stream_thread_wait));
-			
-			if (pthread_cond_init(&lst->cond, NULL)) {
-				pom_mutex_unlock(&stream->wait_lock);
-				pomlog(POMLOG_ERR "Error while initializing wait list condition : %s", pom_strerror(errno));
-				free(lst);
-				return POM_ERR;
-			}
-		}
-		lst->ts = pkt->ts;
-		lst->thread = pthread_self();
+	if (!pkt->plen)
+		return 0;
 
-		struct stream_thread_wait *tmp;
-		for (tmp = stream->wait_list_head; tmp && (tmp->ts < lst->ts); tmp = tmp->next);
-		if (tmp) {
+	// Retransmission of a queued packet starting at the same sequence
+	struct stream_pkt *next = (prev ? prev->next : stream->head[direction]);
+	if (next && next->seq == pkt->seq && next->plen >= pkt->plen)
+		return 1;
 
-			lst->prev = tmp->prev;
-			if (lst->prev)
-				lst->prev->next = lst;
-			else
-				stream->wait_list_head = lst;
+	if (!prev)
+		return 0;
 
-			lst->next = tmp;
-			lst->next->prev = lst;
-		} else {
-			lst->prev = stream->wait_list_tail;
-			if (lst->prev)
-				lst->prev->next = lst;
-			else
-				stream->wait_list_head = lst;
+	// Packet fully contained in the previous one
+	uint32_t prev_end = prev->seq + prev->plen;
+	if (pkt->seq != prev_end && pkt->seq + pkt->plen - prev->seq <= prev->plen)
+		return 1;
 
-			stream->wait_list_tail = lst;
-		}
+	return 0;
+}
 
+static void stream_insert(struct stream *stream, int direction, struct stream_pkt *p, struct stream_pkt *prev, struct stream_pkt **update) {
 
-		while (1) {
-			debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : waiting (%u)", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack, must_wait);
-			if (pthread_cond_wait(&lst->cond, &stream->wait_lock)) {
-				pomlog(POMLOG_ERR "Error while waiting for the packet stream wait cond : %s", pom_strerror(errno));
-				abort();
-				return POM_ERR;
-			}
+	p->queued = registry_perf_hist_clock();
 
-			if (stream->wait_list_head != lst) {
-				// There is a small chance that another stream lock stream->wait_lock while pthread_cond_wait acquires it
-				// If we are not the right thread, then simply signal the right one and wait again for our turn
-				debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : wrong thread woke up", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
-				pthread_cond_broadcast(&stream->wait_list_head->cond);
-				continue;
-			}
-			break;
-		}
+	if (!prev) {
+		// Packet goes at the begining of the list
+		p->prev = NULL;
+		p->next = stream->head[direction];
+		if (p->next)
+			p->next->prev = p;
+		else
+			stream->tail[direction] = p;
+		stream->head[direction] = p;
+
+	} else {
+		// Insert the packet after the previous one
+		p->next = prev->next;
+		p->prev = prev;
 
-		tmp = stream->wait_list_head;
-		stream->wait_list_head = tmp->next;
-		if (stream->wait_list_head)
-			stream->wait_list_head->prev = NULL;
+		if (p->next)
+			p->next->prev = p;
 		else
-			stream->wait_list_tail = NULL;
+			stream->tail[direction] = p;
+
+		prev->next = p;
+	}
+
+	// Each level of the skip list has a quarter of the packets of the one below
+	uint32_t rnd = stream->skip_seed;
+	rnd ^= rnd << 13;
+	rnd ^= rnd >> 17;
+	rnd ^= rnd << 5;
+	stream->skip_seed = rnd;
+
+	unsigned int l;
+	for (l = 0; l < STREAM_SKIP_LEVELS && !(rnd & 0x3); l++, rnd >>= 2) {
+		if (update[l]) {
+			p->skip[l] = update[l]->skip[l];
+			update[l]->skip[l] = p;
+		} else {
+			p->skip[l] = stream->skip[direction][l];
+			stream->skip[direction][l] = p;
+		}
+	}
+	p->skip_levels = l;
+	for (; l < STREAM_SKIP_LEVELS; l++)
+		p->skip[l] = NULL;
+}
 
-		tmp->next = stream->wait_list_unused;
-		tmp->prev = NULL;
-		stream->wait_list_unused = tmp;
+static void stream_buff_add(struct stream *stream, uint32_t len) {
 
-		pom_mutex_unlock(&stream->wait_lock);
-		pom_mutex_lock(&stream->lock);
+	if (!len)
+		return;
 
+	if (!stream->cur_buff_size) {
+		// First bytes buffered, make the stream available for flushing
+		pom_mutex_lock(&stream_buff_lock);
+		stream->buff_prev = stream_buff_tail;
+		if (stream_buff_tail)
+			stream_buff_tail->buff_next = stream;
+		else
+			stream_buff_head = stream;
+		stream_buff_tail = stream;
+		pom_mutex_unlock(&stream_buff_lock);
 	}
 
-	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : start locked : cur_seq %u, rev_seq %u", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack, stream->cur_seq[direction], stream->cur_seq[POM_DIR_REVERSE(direction)]);
+	stream->cur_buff_size += len;
+	__sync_fetch_and_add(&stream_buff_tot, len);
+}
+
+static void stream_buff_sub(struct stream *stream, uint32_t len) {
+
+	if (!len)
+		return;
+
+	stream->cur_buff_size -= len;
+	__sync_fetch_and_sub(&stream_buff_tot, len);
+
+	if (stream->cur_buff_size)
+		return;
+
+	pom_mutex_lock(&stream_buff_lock);
+	if (stream->buff_prev)
+		stream->buff_prev->buff_next = stream->buff_next;
+	else
+		stream_buff_head = stream->buff_next;
+
+	if (stream->buff_next)
+		stream->buff_next->buff_prev = stream->buff_prev;
+	else
+		stream_buff_tail = stream->buff_prev;
+	pom_mutex_unlock(&stream_buff_lock);
+
+	stream->buff_prev = NULL;
+	stream->buff_next = NULL;
+}
+
+static uint32_t stream_get_max_buff_size(struct stream *stream) {
+
+	uint64_t max_tot = core_get_stream_buffer_max();
+	uint64_t half = max_tot / 2;
+	uint64_t tot = stream_buff_tot;
+
+	if (!max_tot || tot < half)
+		return stream->max_buff_size;
+
+	// Past half of the budget, shrink the limit of each stream with the space left
+	uint64_t avail = (tot < max_tot ? max_tot - tot : 0);
+	uint32_t max_buff_size = (double) stream->max_buff_size * avail / half;
+
+	if (max_buff_size < STREAM_BUFF_MIN)
+		max_buff_size = STREAM_BUFF_MIN;
+	if (max_buff_size > stream->max_buff_size)
+		max_buff_size = stream->max_buff_size;
+
+	return max_buff_size;
+}
+
+static struct stream_pkt *stream_dequeue_head(struct stream *stream, int direction) {
+
+	struct stream_pkt *p = stream->head[direction];
+
+	stream->head[direction] = p->next;
+	if (p->next)
+		p->next->prev = NULL;
+	else
+		stream->tail[direction] = NULL;
+
+	// The first packet is also the first on all the levels it's part of
+	unsigned int l;
+	for (l = 0; l < p->skip_levels; l++)
+		stream->skip[direction][l] = p->skip[l];
+
+	p->next = NULL;
+	stream_buff_sub(stream, p->plen);
+
+	registry_perf_hist_record_since(perf_stream_reorder_wait, p->queued);
+
+	return p;
+}
+
+static struct proto_process_stack *stream_pkt_get_stack(struct stream_pkt *p, struct proto_process_stack *stack) {
+
+	if (!(p->flags & STREAM_PKT_FLAG_COMPACT))
+		return p->stack;
+
+	// Rebuild a full stack from the layers we kept
+	memcpy(stack, p->stack, sizeof(struct proto_process_stack) * (p->stack_index + 1));
+	memset(&stack[p->stack_index + 1], 0, sizeof(struct proto_process_stack) * (CORE_PROTO_STACK_MAX + 1 - p->stack_index));
+
+	return stack;
+}
+
+static int stream_pkt_process(struct stream *stream, struct stream_pkt *p) {
+
+	struct proto_process_stack stack_buff[CORE_PROTO_STACK_MAX + 2];
+	struct proto_process_stack *stack = stream_pkt_get_stack(p, stack_buff);
+
+	return stream->handler(stream->ce, p->pkt, stack, p->stack_index);
+}
+
+static int stream_process_locked(struct stream *stream, struct stream_pkt *spkt, int owned) {
+
+	// This function must be called locked
+	// If owned is set, spkt was allocated and is either buffered or released
+
+	struct packet *pkt = spkt->pkt;
+	struct proto_process_stack *cur_stack = &spkt->stack[spkt->stack_index];
+	int direction = cur_stack->direction;
+	uint32_t seq = spkt->seq;
+
+	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : start locked : cur_seq %u, rev_seq %u", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, spkt->ack, stream->cur_seq[direction], stream->cur_seq[POM_DIR_REVERSE(direction)]);
 
 	// Update the stream flags
 	if (stream->flags & STREAM_FLAG_BIDIR) {
@@ -354,16 +538,6 @@ int stream_process_packet(struct stream *stream, struct packet *pkt, struct prot
 	if (stream->last_ts < pkt->ts)
 		stream->last_ts = pkt->ts;
 
-	// Put this packet in our struct stream_pkt
-	struct stream_pkt spkt = {0};
-	spkt.pkt = pkt;
-	spkt.seq = seq;
-	spkt.ack = ack;
-	spkt.plen = cur_stack->plen;
-	spkt.stack = stack;
-	spkt.stack_index = stack_index;
-
-
 	// Check that we are aware of the start sequence
 	// If not, we queue
 	int dir_flag = (direction == POM_DIR_FWD ? STREAM_FLAG_GOT_FWD_STARTSEQ : STREAM_FLAG_GOT_REV_STARTSEQ);
@@ -374,15 +548,17 @@ int stream_process_packet(struct stream *stream, struct packet *pkt, struct prot
 		// Check if the packet is worth processing
 		uint32_t cur_seq = stream->cur_seq[direction];
 		if (cur_seq != seq) {
-			if (stream_is_packet_old_dupe(stream, &spkt, direction)) {
+			if (stream_is_packet_old_dupe(stream, spkt, direction)) {
 				// cur_seq is after the end of the packet, discard it
-				stream_end_process_packet(stream);
-				debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : discard", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+				debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : discard", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, spkt->ack);
+				if (owned)
+					stream_free_packet(spkt);
 				return PROTO_OK;
 			}
 
-			if (stream_remove_dupe_bytes(stream, &spkt, direction) == POM_ERR) {
-				stream_end_process_packet(stream);
+			if (stream_remove_dupe_bytes(stream, spkt, direction) == POM_ERR) {
+				if (owned)
+					stream_free_packet(spkt);
 				return PROTO_ERR;
 			}
 		}
@@ -391,15 +567,16 @@ int stream_process_packet(struct stream *stream, struct packet *pkt, struct prot
 		// Ok let's process it then
 
 		// Check if it is the packet we're waiting for
-		if (stream_is_packet_next(stream, &spkt, direction)) {
+		if (stream_is_packet_next(stream, spkt, direction)) {
 
 			// Process it
-			stream->cur_seq[direction] += cur_stack->plen;
-			debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : process", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+			stream->cur_seq[direction] += spkt->plen;
+			debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : process", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, spkt->ack);
 
-			int res = stream->handler(stream->ce, pkt, stack, stack_index);
+			int res = stream_pkt_process(stream, spkt);
 			if (res == PROTO_ERR) {
-				stream_end_process_packet(stream);
+				if (owned)
+					stream_free_packet(spkt);
 				return PROTO_ERR;
 			}
 
@@ -414,8 +591,10 @@ int stream_process_packet(struct stream *stream, struct packet *pkt, struct prot
 
 				debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : process additional", pthread_self(), stream, pom_ptime_sec(p->pkt->ts), pom_ptime_usec(p->pkt->ts), p->seq, p->ack);
 
-				if (stream->handler(stream->ce, p->pkt, p->stack, p->stack_index) == POM_ERR) {
-					stream_end_process_packet(stream);
+				if (stream_pkt_process(stream, p) == POM_ERR) {
+					stream_free_packet(p);
+					if (owned)
+						stream_free_packet(spkt);
 					return PROTO_ERR;
 				}
 
@@ -424,120 +603,231 @@ int stream_process_packet(struct stream *stream, struct packet *pkt, struct prot
 				stream_free_packet(p);
 			}
 
-			stream_end_process_packet(stream);
-			debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : done processed", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+			debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : done processed", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, spkt->ack);
+			if (owned)
+				stream_free_packet(spkt);
 			return res;
 		}
 	} else {
-		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : start_seq not known yet", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : start_seq not known yet", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, spkt->ack);
 	}
 
 	// Queue the packet then
 
-	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : queue", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : queue", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, spkt->ack);
 
-	struct stream_pkt *p = malloc(sizeof(struct stream_pkt));
-	if (!p) {
-		pom_oom(sizeof(struct stream_pkt));
-		stream_end_process_packet(stream);
-		return PROTO_ERR;
-	}
-	memset(p, 0 , sizeof(struct stream_pkt));
+	struct stream_pkt *update[STREAM_SKIP_LEVELS];
+	struct stream_pkt *tmp = stream_find_prev(stream, direction, seq, update);
 
+	if (stream_is_packet_covered(stream, spkt, tmp, direction)) {
+		// Same bytes as a packet already queued, it would be discarded when dequeued
+		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : already queued, discard", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, spkt->ack);
+		if (owned)
+			stream_free_packet(spkt);
+		return PROTO_OK;
+	}
 
-	int flags = 0;
-	if (stream->flags & STREAM_FLAG_PACKET_NO_COPY)
-		flags = PACKET_FLAG_FORCE_NO_COPY;
-	p->pkt = packet_clone(pkt, flags);
-	if (!p->pkt) {
-		stream_end_process_packet(stream);
-		free(p);
-		return PROTO_ERR;
+	struct stream_pkt *p = spkt;
+	if (!owned) {
+		p = stream_pkt_backup(stream, spkt);
+		if (!p)
+			return PROTO_ERR;
 	}
-	p->stack = core_stack_backup(stack, pkt, p->pkt);
-	if (!p->stack) {
-		stream_end_process_packet(stream);
-		packet_release(p->pkt);
-		free(p);
-		return PROTO_ERR;
+
+	stream_insert(stream, direction, p, tmp, update);
+	
+	stream_buff_add(stream, p->plen);
+
+	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : done queued", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, spkt->ack);
+	
+	if (stream->cur_buff_size >= stream_get_max_buff_size(stream)) {
+		// Buffer overflow, the packet we just queued may be processed and released
+		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : buffer overflow, forced dequeue", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, spkt->ack);
+		if (stream_force_dequeue(stream) != POM_OK)
+			return PROTO_ERR;
 	}
 
+	return PROTO_OK;
+}
+
+static int stream_process_pending(struct stream *stream, struct stream_pkt *own) {
 
-	p->plen = cur_stack->plen;
-	p->seq = seq;
-	p->ack = ack;
-	p->stack_index = stack_index;
+	// This function must be called locked
 
+	// Grab all the packets handed over by the other threads
+	struct stream_pkt *lst = __sync_lock_test_and_set(&stream->pending, NULL);
 
-	if (!stream->tail[direction]) {
-		stream->head[direction] = p;
-		stream->tail[direction] = p;
-	} else { 
+	// They were pushed on top of each other, sort them by timestamp
+	struct stream_pkt *sorted = NULL;
+	if (own) {
+		own->next = NULL;
+		sorted = own;
+	}
 
-		struct stream_pkt *tmp = stream->tail[direction];
-		while ( tmp && 
-			((tmp->seq >= seq && tmp->seq - seq < STREAM_HALF_SEQ)
-			|| (tmp->seq <= seq && seq - tmp->seq > STREAM_HALF_SEQ))) {
+	while (lst) {
+		struct stream_pkt *p = lst;
+		lst = p->next;
 
-			tmp = tmp->prev;
+		struct stream_pkt **tmp = &sorted;
+		while (*tmp && ((*tmp)->pkt->ts < p->pkt->ts || (*tmp == own && own->pkt->ts == p->pkt->ts)))
+			tmp = &(*tmp)->next;
+		p->next = *tmp;
+		*tmp = p;
+	}
+
+	int res = PROTO_OK;
+	while (sorted) {
+		struct stream_pkt *p = sorted;
+		sorted = p->next;
+		p->next = NULL;
 
+		if (p == own) {
+			res = stream_process_locked(stream, p, 0);
+		} else {
+			debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : process handed over", pthread_self(), stream, pom_ptime_sec(p->pkt->ts), pom_ptime_usec(p->pkt->ts), p->seq, p->ack);
+			if (stream_process_locked(stream, p, 1) == PROTO_ERR)
+				pomlog(POMLOG_ERR "Error while processing a packet handed over by another thread");
 		}
+	}
 
-		if (!tmp) {
-			// Packet goes at the begining of the list
-			p->next = stream->head[direction];
-			if (p->next)
-				p->next->prev = p;
-			else
-				stream->tail[direction] = p;
-			stream->head[direction] = p;
+	return res;
+}
 
-		} else {
-			// Insert the packet after the current one
-			p->next = tmp->next;
-			p->prev = tmp;
+static void stream_reclaim() {
+
+	uint64_t max_tot = core_get_stream_buffer_max();
+	uint64_t tot = stream_buff_tot;
 
-			if (p->next)
-				p->next->prev = p;
-			else
-				stream->tail[direction] = p;
+	if (!max_tot || tot <= max_tot)
+		return;
 
-			tmp->next = p;
+	// Streams belong to their conntrack, only ask the owner to flush them
+	uint64_t excess = tot - max_tot;
+	pom_mutex_lock(&stream_buff_lock);
 
+	unsigned int i;
+	for (i = 0; i < STREAM_RECLAIM_MAX && excess; i++) {
+
+		// Pick the biggest buffer among the oldest streams
+		struct stream *tmp, *victim = NULL;
+		unsigned int j;
+		for (tmp = stream_buff_head, j = 0; tmp && j < STREAM_RECLAIM_SCAN; tmp = tmp->buff_next, j++) {
+			if (tmp->flush_requested)
+				continue;
+			if (!victim || tmp->cur_buff_size > victim->cur_buff_size)
+				victim = tmp;
 		}
+
+		if (!victim)
+			break;
+
+		debug_stream("thread %p, entry %p, buffer budget exceeded, requesting flush of %u bytes", pthread_self(), victim, victim->cur_buff_size);
+
+		victim->flush_requested = 1;
+
+		uint32_t size = victim->cur_buff_size;
+		excess = (size < excess ? excess - size : 0);
 	}
-	
-	stream->cur_buff_size += cur_stack->plen;
 
-	
-	if (stream->cur_buff_size >= stream->max_buff_size) {
-		// Buffer overflow
-		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : buffer overflow, forced dequeue", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
-		if (stream_force_dequeue(stream) != POM_OK) {
-			stream_end_process_packet(stream);
-			return POM_ERR;
-		}
+	pom_mutex_unlock(&stream_buff_lock);
+}
+
+int stream_process_packet(struct stream *stream, struct packet *pkt, struct proto_process_stack *stack, unsigned int stack_index, uint32_t seq, uint32_t ack) {
+
+	if (!stream || !pkt || !stack)
+		return PROTO_ERR;
+
+	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : start", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+
+	// Put this packet in our struct stream_pkt
+	struct stream_pkt spkt = {0};
+	spkt.pkt = pkt;
+	spkt.seq = seq;
+	spkt.ack = ack;
+	spkt.plen = stack[stack_index].plen;
+	spkt.stack = stack;
+	spkt.stack_index = stack_index;
+
+	int res = pthread_mutex_trylock(&stream->lock);
+	if (res == EBUSY) {
+
+		// Another thread is processing this stream, hand the packet over to it
+		struct stream_pkt *p = stream_pkt_backup(stream, &spkt);
+		if (!p)
+			return PROTO_ERR;
+
+		do {
+			p->next = stream->pending;
+		} while (!__sync_bool_compare_and_swap(&stream->pending, p->next, p));
+
+		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : handed over", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+
+		// The other thread may have released the lock before seeing our packet
+		if (pthread_mutex_trylock(&stream->lock))
+			return PROTO_OK;
+
+		stream_process_pending(stream, NULL);
+		stream_end_process_packet(stream);
+
+		return PROTO_OK;
+
+	} else if (res) {
+		pomlog(POMLOG_ERR "Error while locking packet stream lock : %s", pom_strerror(res));
+		abort();
+		return POM_ERR;
 	}
 
+	// Packets handed over by other threads are processed in order with ours
+	res = stream_process_pending(stream, &spkt);
+
 	stream_end_process_packet(stream);
 
-	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : done queued", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
-	return PROTO_OK;
+	// Make room for the others if all the streams together buffer too much
+	stream_reclaim();
+
+	return res;
 }
 
 int stream_fill_gap(struct stream *stream, struct stream_pkt *p, uint32_t gap, int reverse_dir) {
 
-	if (gap > stream->max_buff_size) {
-		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : gap of %u too big. not filling", pthread_self(), stream, pom_ptime_sec(p->pkt->ts), pom_ptime_usec(p->pkt->ts), p->seq, p->ack, gap);
-		return POM_OK;
-	}
-	
 	if (!reverse_dir) {
 		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : filling gap of %u in forward direction", pthread_self(), stream, pom_ptime_sec(p->pkt->ts), pom_ptime_usec(p->pkt->ts), p->seq, p->ack, gap);
 	} else {
 		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : filling gap of %u in reverse direction", pthread_self(), stream, pom_ptime_sec(p->pkt->ts), pom_ptime_usec(p->pkt->ts), p->seq, p->ack, gap);
 	}
 	
+	struct proto_process_stack stack_buff[CORE_PROTO_STACK_MAX + 2];
+	struct proto_process_stack *stack = stream_pkt_get_stack(p, stack_buff);
+	struct proto_process_stack *s = &stack[p->stack_index];
+	uint32_t plen_old = s->plen;
+	void *pload_old = s->pload;
+	int dir_old = s->direction;
+	int dir_new = s->direction;
+
+	if (reverse_dir)
+		dir_new = POM_DIR_REVERSE(s->direction);
+
+	if (stream->gap_handler) {
+		// Report the whole gap at once, zeros are only used if the handler asks for it
+		s->pload = NULL;
+		s->plen = gap;
+		s->direction = dir_new;
+		int res = stream->gap_handler(stream->ce, p->pkt, stack, p->stack_index);
+
+		s->pload = pload_old;
+		s->plen = plen_old;
+		s->direction = dir_old;
+
+		if (res != STREAM_GAP_FILL)
+			return POM_OK;
+	}
+
+	// Don't feed huge amounts of zeros to the handler
+	if (gap > stream->max_buff_size) {
+		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : gap of %u too big. not filling", pthread_self(), stream, pom_ptime_sec(p->pkt->ts), pom_ptime_usec(p->pkt->ts), p->seq, p->ack, gap);
+		return POM_OK;
+	}
+
 	uint32_t gap_step = gap;
 	if (gap_step > STREAM_GAP_STEP_MAX)
 		gap_step = STREAM_GAP_STEP_MAX;
@@ -548,16 +838,6 @@ int stream_fill_gap(struct stream *stream, struct stream_pkt *p, uint32_t gap, i
 		return POM_ERR;
 	}
 	memset(zero, 0, gap_step);
-	
-	struct proto_process_stack *s = &p->stack[p->stack_index];
-	uint32_t plen_old = s->plen;
-	void *pload_old = s->pload;
-	int dir_old = s->direction;
-	int dir_new = s->direction;
-
-	if (reverse_dir)
-		dir_new = POM_DIR_REVERSE(s->direction);
-
 
 	uint32_t pos;
 	for (pos = 0; pos < gap; pos += gap_step) {
@@ -567,7 +847,7 @@ int stream_fill_gap(struct stream *stream, struct stream_pkt *p, uint32_t gap, i
 			s->plen = gap - pos;
 		s->pload = zero;
 		s->direction = dir_new;
-		int res = stream->handler(stream->ce, p->pkt, p->stack, p->stack_index);
+		int res = stream->handler(stream->ce, p->pkt, stack, p->stack_index);
 		if (res == PROTO_ERR)
 			break;
 	}
@@ -623,14 +903,7 @@ int stream_force_dequeue(struct stream *stream) {
 			}
 		}
 
-		p = stream->head[next_dir];
-		if (p->next)
-			p->next->prev = NULL;
-		else
-			stream->tail[next_dir] = NULL;
-		
-		stream->head[next_dir] = p->next;
-		stream->cur_buff_size -= p->plen;
+		p = stream_dequeue_head(stream, next_dir);
 
 
 		if (stream_is_packet_old_dupe(stream, p, next_dir)) {
@@ -697,7 +970,7 @@ int stream_force_dequeue(struct stream *stream) {
 
 	if (res != PROTO_ERR) {
 		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : process forced", pthread_self(), stream, pom_ptime_sec(p->pkt->ts), pom_ptime_usec(p->pkt->ts), p->seq, p->ack);
-		res = stream->handler(stream->ce, p->pkt, p->stack, p->stack_index);
+		res = stream_pkt_process(stream, p);
 	}
 
 
@@ -714,7 +987,7 @@ int stream_force_dequeue(struct stream *stream) {
 
 		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : process additional", pthread_self(), stream, pom_ptime_sec(p->pkt->ts), pom_ptime_usec(p->pkt->ts), p->seq, p->ack);
 
-		if (stream->handler(stream->ce, p->pkt, p->stack, p->stack_index) == PROTO_ERR)
+		if (stream_pkt_process(stream, p) == PROTO_ERR)
 			return POM_ERR;
 
 		stream->cur_seq[next_dir] += p->plen;
@@ -759,28 +1032,19 @@ struct stream_pkt *stream_get_next(struct stream *stream, unsigned int *directio
 
 				if (stream_is_packet_old_dupe(stream, res, cur_dir)) {
 					// Packet is a duplicate, remove it
-					stream->head[cur_dir] = res->next;
-					if (res->next) {
-						res->next->prev = NULL;
-					} else {
-						stream->tail[cur_dir] = NULL;
-					}
-
-					if (res->prev) {
-						pomlog(POMLOG_WARN "Dequeing packet which wasn't the first in the list. This shouldn't happen !");
-						res->prev->next = res->next;
-					}
-					
-					stream->cur_buff_size -= res->plen;
+					stream_dequeue_head(stream, cur_dir);
 					stream_free_packet(res);
 					res = NULL;
 
 					// Next packet please
 					continue;
 				} else {
+					uint32_t plen = res->plen;
 					if (stream_remove_dupe_bytes(stream, res, cur_dir) == POM_ERR)
 						return NULL;
 
+					// The trimmed bytes are not buffered anymore
+					stream_buff_sub(stream, plen - res->plen);
 				}
 			}
 
@@ -795,18 +1059,7 @@ struct stream_pkt *stream_get_next(struct stream *stream, unsigned int *directio
 		return NULL;
 
 	// Dequeue the packet
-	
-
-	stream->head[cur_dir] = res->next;
-	if (res->next) {
-		res->next->prev = res->prev;
-	} else {
-		stream->tail[cur_dir] = NULL;
-	}
-
-	stream->cur_buff_size -= res->plen;
-
-	return res;
+	return stream_dequeue_head(stream, cur_dir);
 }
 
 int stream_increase_seq(struct stream *stream, unsigned int direction, uint32_t inc) {
@@ -822,7 +1075,7 @@ int stream_increase_seq(struct stream *stream, unsigned int direction, uint32_t
 		// Flag the stream as running
 		stream->flags |= STREAM_FLAG_RUNNING;
 
-		if (stream->handler(stream->ce, p->pkt, p->stack, p->stack_index) == PROTO_ERR)
+		if (stream_pkt_process(stream, p) == PROTO_ERR)
 			return POM_ERR;
 
 		stream->cur_seq[direction] += p->plen;
@@ -856,7 +1109,7 @@ int stream_set_start_seq(struct stream *stream, unsigned int direction, uint32_t
 		// Flag the stream as running
 		stream->flags |= STREAM_FLAG_RUNNING;
 
-		if (stream->handler(stream->ce, p->pkt, p->stack, p->stack_index) == PROTO_ERR) {
+		if (stream_pkt_process(stream, p) == PROTO_ERR) {
 			stream_end_process_packet(stream);
 			return POM_ERR;
 		}
@@ -37,6 +37,18 @@
 
 #define STREAM_GAP_STEP_MAX		2048
 
+#define STREAM_PKT_FLAG_COMPACT		0x1 // Only the layers up to stack_index are kept
+
+// Number of levels above the packet list in the skip list of queued packets
+#define STREAM_SKIP_LEVELS		8
+
+// Smallest buffer a stream is allowed when the global budget gets tight
+#define STREAM_BUFF_MIN			65536
+// Number of streams, from the oldest, looked at to find the biggest buffer to flush
+#define STREAM_RECLAIM_SCAN		8
+// Maximum number of streams a thread asks to flush for each packet
+#define STREAM_RECLAIM_MAX		4
+
 struct stream_pkt {
 
 	struct packet *pkt;
@@ -44,33 +56,40 @@ struct stream_pkt {
 	uint32_t seq, ack, plen;
 	unsigned int stack_index;
 	unsigned int flags;
+	uint64_t queued;
 	struct stream_pkt *prev, *next;
+	unsigned int skip_levels;
+	struct stream_pkt *skip[STREAM_SKIP_LEVELS];
 
 };
 
-struct stream_thread_wait {
-	ptime ts;
-	pthread_t thread;
-	pthread_cond_t cond;
-	struct stream_thread_wait *prev, *next;
-};
-
 struct stream {
 
 	uint32_t cur_seq[POM_DIR_TOT];
 	uint32_t cur_buff_size, max_buff_size;
 	unsigned int flags;
-	unsigned int timeout;
+	ptime timeout;
 	struct stream_pkt *head[POM_DIR_TOT], *tail[POM_DIR_TOT];
+	struct stream_pkt *skip[POM_DIR_TOT][STREAM_SKIP_LEVELS];
+	uint32_t skip_seed;
 	int (*handler) (struct conntrack_entry *ce, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
+	int (*gap_handler) (struct conntrack_entry *ce, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
 	ptime last_ts;
 	struct conntrack_entry *ce;
 	pthread_mutex_t lock;
 
-	pthread_mutex_t wait_lock;
-	struct stream_thread_wait *wait_list_head, *wait_list_tail, *wait_list_unused;
+	// Packets handed over by threads which couldn't get the lock, last one first
+	struct stream_pkt * volatile pending;
+
+	// List of streams with buffered packets, oldest first
+	struct stream *buff_prev, *buff_next;
+
+	// Set by other threads when the buffer budget is exceeded, flushed by the owner
+	volatile int flush_requested;
 };
 
+int stream_init();
+
 int stream_timeout(struct conntrack_entry *ce, void *priv, ptime now);
 int stream_force_dequeue(struct stream *stream);
 int stream_fill_gap(struct stream *stream, struct stream_pkt *p, uint32_t gap, int reverse_dir);
@@ -786,7 +786,7 @@ int telephony_sdp_add_expectations(struct telephony_sdp *sdp, ptime now) {
 
 				proto_expectation_set_match_callback(e, telephony_sdp_expectation_callback, sc, telephony_sdp_exectation_callback_cleanup);
 
-				if (proto_expectation_add_and_cleanup(e, 60, now) != POM_OK) {
+				if (proto_expectation_add_and_cleanup(e, pom_sec_ptime(60), now) != POM_OK) {
 					pom_rwlock_unlock(&d->lock);
 					proto_expectation_cleanup(e);
 					return POM_ERR;
@@ -34,339 +34,576 @@ static struct timer_sys *timer_sys_head = NULL, *timer_sys_tail = NULL;
 static pthread_mutex_t timer_sys_lock;
 
 
-static pthread_mutex_t timer_main_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct timer_queue *timer_queues = NULL;
+// Each processing thread owns a wheel and expires its timers against core_get_clock()
+// A queued timer stays in the wheel it was queued in, even when it is rearmed by another thread
+// Once it expired or was dequeued, the next thread queuing it becomes its owner
+// Wheels whose thread stopped processing packets are expired by the other threads
+static pthread_mutex_t timer_wheels_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timer_wheel *timer_wheels[CORE_PROCESS_THREAD_MAX] = { 0 };
+
+// Wheel of the processing thread, threads which don't process packets use the first one
+static __thread int timer_thread_id = -1;
+static __thread struct timer_wheel *timer_wheel_local = NULL;
 
 static struct registry_perf *perf_timer_processed = NULL;
 static struct registry_perf *perf_timer_queued = NULL;
 static struct registry_perf *perf_timer_allocated = NULL;
 static struct registry_perf *perf_timer_queues = NULL;
+static struct registry_perf *perf_timer_expiry_lag = NULL;
+static struct registry_perf *perf_timer_helped = NULL;
+
+static ptime timer_wheel_oldest_overdue(struct timer_wheel *w, ptime now);
+
+static int timer_perf_queues_update(uint64_t *cur_val, void *priv) {
+
+	uint64_t count = 0;
+
+	unsigned int i, j;
+	for (i = 0; i < CORE_PROCESS_THREAD_MAX; i++) {
+		struct timer_wheel *w = timer_wheels[i];
+		if (!w)
+			continue;
+		for (j = 0; j < TIMER_WHEEL_LEVELS; j++)
+			count += __builtin_popcountll(w->bitmap[j]);
+	}
+
+	*cur_val = count;
+
+	return POM_OK;
+}
+
+static int timer_perf_expiry_lag_update(uint64_t *cur_val, void *priv) {
+
+	ptime now = core_get_clock();
+	uint64_t lag = 0;
+
+	unsigned int i;
+	for (i = 0; i < CORE_PROCESS_THREAD_MAX; i++) {
+		struct timer_wheel *w = timer_wheels[i];
+		if (!w)
+			continue;
+
+		pom_mutex_lock(&w->lock);
+		ptime oldest = timer_wheel_oldest_overdue(w, now);
+		pom_mutex_unlock(&w->lock);
+
+		if (oldest && now - oldest > lag)
+			lag = now - oldest;
+	}
+
+	*cur_val = lag;
+
+	return POM_OK;
+}
 
 int timers_init() {
 
 	perf_timer_processed = core_add_perf("timer_processed", registry_perf_type_counter, "Number of timers processeds", "timers");
 	perf_timer_queued = core_add_perf("timer_queued", registry_perf_type_gauge, "Number of timers queued", "timers");
 	perf_timer_allocated = core_add_perf("timer_allocated", registry_perf_type_gauge, "Number of timers allocated", "timers");
-	perf_timer_queues = core_add_perf("timer_queues", registry_perf_type_gauge, "Number of timer queues", "queues");
+	perf_timer_queues = core_add_perf("timer_queues", registry_perf_type_gauge, "Number of non empty timer wheel slots", "queues");
+	perf_timer_expiry_lag = core_add_perf("timer_expiry_lag", registry_perf_type_gauge, "Time elapsed since the oldest overdue timer should have been processed", "usec");
+	perf_timer_helped = core_add_perf("timer_helped", registry_perf_type_counter, "Number of timers processed on behalf of an idle thread", "timers");
 
-	if (!perf_timer_processed || !perf_timer_queued || !perf_timer_allocated || !perf_timer_queues)
+	if (!perf_timer_processed || !perf_timer_queued || !perf_timer_allocated || !perf_timer_queues || !perf_timer_expiry_lag || !perf_timer_helped)
 		return POM_ERR;
 
+	registry_perf_set_update_hook(perf_timer_queues, timer_perf_queues_update, NULL);
+	registry_perf_set_update_hook(perf_timer_expiry_lag, timer_perf_expiry_lag_update, NULL);
+
 	return POM_OK;
 }
 
-int timers_process() {
+void timers_thread_init(unsigned int thread_id) {
 
+	timer_thread_id = thread_id;
+	timer_wheel_local = NULL;
+}
 
-	static int processing = 0;
+static struct timer_wheel *timer_wheel_get() {
 
-	int res = pthread_mutex_trylock(&timer_main_lock);
-	if (res == EBUSY) {
-		// Already locked, give up
-		return POM_OK;
-	} else if (res) {
-		// Something went wrong
-		pomlog(POMLOG_ERR "Error while trying to lock the main timer lock : %s", pom_strerror(res));
-		abort();
-		return POM_ERR;
+	if (timer_wheel_local)
+		return timer_wheel_local;
+
+	unsigned int id = (timer_thread_id < 0 ? 0 : timer_thread_id);
+
+	pom_mutex_lock(&timer_wheels_lock);
+	struct timer_wheel *w = timer_wheels[id];
+	if (!w) {
+		w = malloc(sizeof(struct timer_wheel));
+		if (!w) {
+			pom_mutex_unlock(&timer_wheels_lock);
+			pom_oom(sizeof(struct timer_wheel));
+			return NULL;
+		}
+		memset(w, 0, sizeof(struct timer_wheel));
+
+		int res = pthread_mutex_init(&w->lock, NULL);
+		if (res) {
+			pom_mutex_unlock(&timer_wheels_lock);
+			pomlog(POMLOG_ERR "Error while initializing the timer wheel lock : %s", pom_strerror(res));
+			free(w);
+			return NULL;
+		}
+		timer_wheels[id] = w;
 	}
+	pom_mutex_unlock(&timer_wheels_lock);
 
-	// Another thread is already processing the timers, drop out
-	if (processing) {
-		pom_mutex_unlock(&timer_main_lock);
-		return POM_OK;
+	timer_wheel_local = w;
+
+	return w;
+}
+
+static int timer_wheel_empty(struct timer_wheel *w) {
+
+	unsigned int i;
+	for (i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+		if (w->bitmap[i])
+			return 0;
 	}
 
-	processing = 1;
+	return 1;
+}
 
-	ptime now = core_get_clock();
+static void timer_slot_append(struct timer_wheel *w, struct timer_slot *slot, struct timer *t) {
 
-	struct timer_queue *tq;
-	tq = timer_queues;
-
-	while (tq) {
-		while (tq->head && (tq->head->expires < now)) {
-				
-			// Dequeue the timer
-			struct timer *tmp = tq->head;
-			tq->head = tq->head->next;
-			if (tq->head)
-				tq->head->prev = NULL;
-			else
-				tq->tail = NULL;
-
-			tmp->next = NULL;
-			tmp->prev = NULL;
-			tmp->queue = NULL;
-			pom_mutex_unlock(&timer_main_lock);
-			registry_perf_dec(perf_timer_queued, 1);
-
-			// Process it
-			debug_timer( "Timer 0x%lx reached. Starting handler ...", (unsigned long) tmp);
-			if ((*tmp->handler) (tmp->priv, now) != POM_OK) {
-				return POM_ERR;
-			}
+	t->next = NULL;
+	t->prev = slot->tail;
+	if (t->prev)
+		t->prev->next = t;
+	else
+		slot->head = t;
+	slot->tail = t;
 
-			registry_perf_inc(perf_timer_processed, 1);
+	t->slot = slot;
+	t->wheel = w;
+}
 
-			pom_mutex_lock(&timer_main_lock);
+static void timer_slot_remove(struct timer_wheel *w, struct timer *t) {
 
-		}
-		tq = tq->next;
+	struct timer_slot *slot = t->slot;
 
-	}
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		slot->head = t->next;
 
-	processing = 0;
+	if (t->next)
+		t->next->prev = t->prev;
+	else
+		slot->tail = t->prev;
 
-	pom_mutex_unlock(&timer_main_lock);
+	if (!slot->head && slot != &w->expired) {
+		unsigned int pos = slot - &w->slots[0][0];
+		w->bitmap[pos / TIMER_WHEEL_SLOTS] &= ~(1ULL << (pos % TIMER_WHEEL_SLOTS));
+	}
 
-	return POM_OK;
+	t->next = NULL;
+	t->prev = NULL;
+	t->slot = NULL;
+	t->wheel = NULL;
 }
 
+static void timer_wheel_add(struct timer_wheel *w, struct timer *t) {
 
-int timers_cleanup() {
-
+	uint64_t expires = t->expires / TIMER_WHEEL_TICK;
+	if (expires < w->tick)
+		expires = w->tick;
 
-	// Free the timers
+	uint64_t delta = expires - w->tick;
+	if (delta > TIMER_WHEEL_MAX_TICKS) {
+		// Too far ahead, it will be placed again when its slot is cascaded
+		expires = w->tick + TIMER_WHEEL_MAX_TICKS;
+		delta = TIMER_WHEEL_MAX_TICKS;
+	}
 
-	while (timer_queues) {
-		struct timer_queue *tmpq;
-		tmpq = timer_queues;
+	unsigned int level;
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))); level++);
 
-		while (tmpq->head) {
-			
-			struct timer *tmp;
-			tmp = tmpq->head;
+	unsigned int idx = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	timer_slot_append(w, &w->slots[level][idx], t);
+	w->bitmap[level] |= 1ULL << idx;
+}
 
-			tmpq->head = tmpq->head->next;
+static void timer_wheel_cascade(struct timer_wheel *w) {
 
-			free(tmp);
+	// Move the timers of the upper levels down as the lower level wraps
+	unsigned int level;
+	for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		unsigned int idx = (w->tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+		struct timer_slot *slot = &w->slots[level][idx];
 
-			pomlog(POMLOG_WARN "Timer not dequeued");
+		struct timer *t = slot->head;
+		slot->head = NULL;
+		slot->tail = NULL;
+		w->bitmap[level] &= ~(1ULL << idx);
 
+		while (t) {
+			struct timer *next = t->next;
+			timer_wheel_add(w, t);
+			t = next;
 		}
-		timer_queues = timer_queues->next;
 
-		free(tmpq);
+		if (idx)
+			break;
 	}
-
-	return POM_OK;
-
 }
 
-struct timer *timer_alloc(void* priv, int (*handler) (void*, ptime)) {
+static void timer_wheel_advance(struct timer_wheel *w, uint64_t now_tick) {
 
-	struct timer *t;
-	t = malloc(sizeof(struct timer));
-	if (!t) {
-		pom_oom(sizeof(struct timer));
-		return NULL;
+	if (w->tick < now_tick && timer_wheel_empty(w)) {
+		w->tick = now_tick;
+		return;
 	}
-	memset(t, 0, sizeof(struct timer));
 
-	t->priv = priv;
-	t->handler = handler;
+	while (w->tick < now_tick) {
 
-	registry_perf_inc(perf_timer_allocated, 1);
+		unsigned int idx = w->tick & TIMER_WHEEL_MASK;
+		if (!idx)
+			timer_wheel_cascade(w);
 
-	return t;
-}
+		uint64_t pending = w->bitmap[0] >> idx;
+		if (!pending) {
+			// Nothing left in the first level for this round, skip to the next one
+			uint64_t next = (w->tick | TIMER_WHEEL_MASK) + 1;
+			w->tick = (next > now_tick ? now_tick : next);
+			continue;
+		}
 
-int timer_cleanup(struct timer *t) {
+		unsigned int skip = __builtin_ctzll(pending);
+		if (w->tick + skip >= now_tick) {
+			w->tick = now_tick;
+			break;
+		}
 
-	if (t->queue)
-		timer_dequeue(t);
+		w->tick += skip;
+		idx += skip;
 
-	free(t);
-	
-	registry_perf_dec(perf_timer_allocated, 1);
+		// Move the whole slot to the expired list
+		struct timer_slot *slot = &w->slots[0][idx];
+		struct timer *t;
+		for (t = slot->head; t; t = t->next)
+			t->slot = &w->expired;
 
-	return POM_OK;
+		if (w->expired.tail) {
+			w->expired.tail->next = slot->head;
+			slot->head->prev = w->expired.tail;
+		} else {
+			w->expired.head = slot->head;
+		}
+		w->expired.tail = slot->tail;
+
+		slot->head = NULL;
+		slot->tail = NULL;
+		w->bitmap[0] &= ~(1ULL << idx);
+
+		w->tick++;
+	}
 }
 
-int timer_queue(struct timer *t, unsigned int expiry) {
+static void timer_wheel_rebase(struct timer_wheel *w, uint64_t tick) {
+
+	// Take out all the queued timers and restart from the given tick or the oldest timer
+	// They stay attached to the wheel so timer_unlink() waits for us
+	struct timer *lst = NULL;
+	uint64_t oldest = 0;
+	unsigned int i;
+	for (i = 0; i < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS; i++) {
+		struct timer_slot *slot = &w->slots[i / TIMER_WHEEL_SLOTS][i % TIMER_WHEEL_SLOTS];
+		struct timer *t = slot->head;
+		while (t) {
+			struct timer *next = t->next;
+			if (!lst || t->expires / TIMER_WHEEL_TICK < oldest)
+				oldest = t->expires / TIMER_WHEEL_TICK;
+			t->next = lst;
+			lst = t;
+			t = next;
+		}
+		slot->head = NULL;
+		slot->tail = NULL;
+	}
+	memset(w->bitmap, 0, sizeof(w->bitmap));
 
-	return timer_queue_now(t, expiry, core_get_clock_last());
+	// A null tick means the clock is unknown yet
+	if (lst && (!tick || oldest < tick))
+		tick = oldest;
+	w->tick = tick;
+
+	while (lst) {
+		struct timer *t = lst;
+		lst = t->next;
+		timer_wheel_add(w, t);
+	}
 }
 
-int timer_queue_now(struct timer *t, unsigned int expiry, ptime now) {
+static ptime timer_wheel_oldest_overdue(struct timer_wheel *w, ptime now) {
 
+	// Expired timers were moved slot by slot, the head is the oldest one
+	if (w->expired.head)
+		return w->expired.head->expires;
 
-	pom_mutex_lock(&timer_main_lock);
+	uint64_t now_tick = now / TIMER_WHEEL_TICK;
+	ptime oldest = 0;
 
-	struct timer_queue *tq = timer_queues;
+	// Only the first non empty slot of each level can hold the oldest timer
+	unsigned int level;
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
 
-	// Timer is still queued, dequeue it
-	if (t->queue) {
+		if (!w->bitmap[level])
+			continue;
 
-		// Start further in the list of queues if possible
-		if (expiry >= t->queue->expiry)
-			tq = t->queue;
+		unsigned int shift = TIMER_WHEEL_BITS * level;
+		unsigned int cur = (w->tick >> shift) & TIMER_WHEEL_MASK;
 
-		if (t->prev) {
-			t->prev->next = t->next;
+		// The current slot of the upper levels was already cascaded, what's left there is for the next round
+		uint64_t pending = w->bitmap[level] >> cur;
+		if (level)
+			pending &= ~1ULL;
+
+		unsigned int idx;
+		uint64_t base = (w->tick >> (shift + TIMER_WHEEL_BITS)) << (shift + TIMER_WHEEL_BITS);
+		if (pending) {
+			idx = cur + __builtin_ctzll(pending);
 		} else {
-			t->queue->head = t->next;
-			if (t->queue->head)
-				t->queue->head->prev = NULL;
+			idx = __builtin_ctzll(w->bitmap[level]);
+			base += 1ULL << (shift + TIMER_WHEEL_BITS);
 		}
+		base += (uint64_t) idx << shift;
 
-		if (t->next) {
-			t->next->prev = t->prev;
-		} else {
-			t->queue->tail = t->prev;
-			if (t->queue->tail)
-				t->queue->tail->next = NULL;
-			
+		if (base >= now_tick)
+			continue;
+
+		struct timer *t;
+		for (t = w->slots[level][idx].head; t; t = t->next) {
+			if (t->expires < now && (!oldest || t->expires < oldest))
+				oldest = t->expires;
 		}
-		t->queue = NULL;
-		t->prev = NULL;
-		t->next = NULL;
-	} else {
-		registry_perf_inc(perf_timer_queued, 1);
 	}
 
-	// First find the right queue or create it
-	
-	if (!tq) {
+	return oldest;
+}
+
+static int timer_wheel_expire(struct timer_wheel *w, ptime now, struct registry_perf *perf) {
+
+	// Must be called with the wheel locked, returns with it unlocked
+
+	timer_wheel_advance(w, now / TIMER_WHEEL_TICK);
 
-		// There is no queue yet
-		tq = malloc(sizeof(struct timer_queue));
-		if (!tq) {
-			pom_mutex_unlock(&timer_main_lock);
-			pom_oom(sizeof(struct timer_queue));
+	while (w->expired.head) {
+
+		struct timer *t = w->expired.head;
+		timer_slot_remove(w, t);
+		pom_mutex_unlock(&w->lock);
+		registry_perf_dec(perf_timer_queued, 1);
+
+		// Process it
+		debug_timer( "Timer 0x%lx reached. Starting handler ...", (unsigned long) t);
+		if ((*t->handler) (t->priv, now) != POM_OK) {
 			return POM_ERR;
 		}
-		memset(tq, 0, sizeof(struct timer_queue));
-		timer_queues = tq;
 
-		tq->expiry = expiry;
+		registry_perf_inc(perf_timer_processed, 1);
+		if (perf)
+			registry_perf_inc(perf, 1);
 
-		registry_perf_inc(perf_timer_queues, 1);
+		pom_mutex_lock(&w->lock);
+	}
 
-	} else {
+	pom_mutex_unlock(&w->lock);
 
-		while (tq) {
-			
-			if (tq->expiry == expiry) { // The right queue already exists
-				
-				break;
+	return POM_OK;
+}
 
-			} else if (tq->expiry > expiry) { // The right queue doesn't exists and we are too far in the list
+int timers_process() {
 
-				struct timer_queue *tmp;
-				tmp = malloc(sizeof(struct timer_queue));
-				if (!tmp) {
-					pom_oom(sizeof(struct timer_queue));
-					pom_mutex_unlock(&timer_main_lock);
-					return POM_ERR;
-				}
-				memset(tmp, 0, sizeof(struct timer_queue));
+	// Only the processing threads expire timers
+	if (timer_thread_id < 0)
+		return POM_OK;
 
-				tmp->prev = tq->prev;
-				tmp->next = tq;
-				tq->prev = tmp;
+	struct timer_wheel *w = timer_wheel_get();
+	if (!w)
+		return POM_ERR;
 
-				if (tmp->prev)
-					tmp->prev->next = tmp;
-				else
-					timer_queues = tmp;
+	ptime now = core_get_clock();
+	uint64_t now_tick = now / TIMER_WHEEL_TICK;
 
+	// Other threads only advance our wheel when we're idle so no need to lock for this check
+	if (now_tick <= w->tick && !w->expired.head)
+		return POM_OK;
 
-				tq = tmp;
-				tq->expiry = expiry;
+	pom_mutex_lock(&w->lock);
+	if (timer_wheel_expire(w, now, NULL) != POM_OK)
+		return POM_ERR;
 
-				registry_perf_inc(perf_timer_queues, 1);
+	// Expire the wheels of the threads which are not processing packets anymore
+	unsigned int i;
+	for (i = 0; i < CORE_PROCESS_THREAD_MAX; i++) {
+		struct timer_wheel *o = timer_wheels[i];
+		if (!o || o == w || o->tick + TIMER_WHEEL_IDLE_TICKS >= now_tick)
+			continue;
 
-				break;
-			
-			} else if (!tq->next) { // Looks like we are at the end of our list
+		// Leave it alone if its owner or another thread is already on it
+		if (pthread_mutex_trylock(&o->lock))
+			continue;
 
-				struct timer_queue *tmp;
-				tmp = malloc(sizeof(struct timer_queue));
-				if (!tmp) {
-					pom_oom(sizeof(struct timer_queue));
-					pom_mutex_unlock(&timer_main_lock);
-					return POM_ERR;
-				}
-				memset(tmp, 0, sizeof(struct timer_queue));
+		debug_timer("Thread %u expiring timers of idle wheel %u", timer_thread_id, i);
+		if (timer_wheel_expire(o, now, perf_timer_helped) != POM_OK)
+			return POM_ERR;
+	}
 
-				tmp->prev = tq;
-				
-				tq->next = tmp;
+	return POM_OK;
+}
 
-				tq = tmp;
+void timers_reset() {
 
-				tq->expiry = expiry;
+	// The clock starts over when the core is restarted, don't keep the wheels at the old time
+	unsigned int i;
+	for (i = 0; i < CORE_PROCESS_THREAD_MAX; i++) {
+		struct timer_wheel *w = timer_wheels[i];
+		if (!w)
+			continue;
 
-				registry_perf_inc(perf_timer_queues, 1);
-				
-				break;
-			}
+		pom_mutex_lock(&w->lock);
+		timer_wheel_rebase(w, 0);
+		pom_mutex_unlock(&w->lock);
+	}
+}
+
+
+int timers_cleanup() {
+
+	// Free the timers
 
-			tq = tq->next;
+	unsigned int i, j, k;
+	for (i = 0; i < CORE_PROCESS_THREAD_MAX; i++) {
+		struct timer_wheel *w = timer_wheels[i];
+		if (!w)
+			continue;
+
+		for (j = 0; j <= TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS; j++) {
+			struct timer_slot *slot = (j < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS ? &w->slots[j / TIMER_WHEEL_SLOTS][j % TIMER_WHEEL_SLOTS] : &w->expired);
+			for (k = 0; slot->head; k++) {
+				struct timer *tmp = slot->head;
+				slot->head = tmp->next;
+				free(tmp);
+			}
+			if (k)
+				pomlog(POMLOG_WARN "%u timer(s) not dequeued", k);
 		}
 
+		pthread_mutex_destroy(&w->lock);
+		free(w);
+		timer_wheels[i] = NULL;
 	}
 
-	// Now we can queue the timer
-	
-	if (tq->head == NULL) {
-		tq->head = t;
-		tq->tail = t;
-	} else {
-		t->prev = tq->tail;
-		tq->tail = t;
-		t->prev->next = t;
+	return POM_OK;
+
+}
+
+struct timer *timer_alloc(void* priv, int (*handler) (void*, ptime)) {
+
+	struct timer *t;
+	t = malloc(sizeof(struct timer));
+	if (!t) {
+		pom_oom(sizeof(struct timer));
+		return NULL;
 	}
+	memset(t, 0, sizeof(struct timer));
 
-	// Update the expiry time
-	
-	t->expires = now + (expiry * 1000000UL);
-	t->queue = tq;
-	pom_mutex_unlock(&timer_main_lock);
+	t->priv = priv;
+	t->handler = handler;
+
+	registry_perf_inc(perf_timer_allocated, 1);
+
+	return t;
+}
+
+static int timer_unlink(struct timer *t) {
+
+	// The timer may be queued in the wheel of another thread
+	struct timer_wheel *w;
+	while ((w = t->wheel)) {
+		pom_mutex_lock(&w->lock);
+		if (t->wheel == w) {
+			timer_slot_remove(w, t);
+			pom_mutex_unlock(&w->lock);
+			return 1;
+		}
+		pom_mutex_unlock(&w->lock);
+	}
 
+	return 0;
+}
+
+int timer_cleanup(struct timer *t) {
+
+	if (timer_unlink(t))
+		registry_perf_dec(perf_timer_queued, 1);
+
+	free(t);
+	
+	registry_perf_dec(perf_timer_allocated, 1);
 
 	return POM_OK;
 }
 
+int timer_queue(struct timer *t, ptime expiry) {
 
-int timer_dequeue(struct timer *t) {
+	return timer_queue_now(t, expiry, core_get_clock_last());
+}
 
-	// First let's check if it's the one at the begining of the queue
+int timer_queue_now(struct timer *t, ptime expiry, ptime now) {
 
-	pom_mutex_lock(&timer_main_lock);
+	struct timer_wheel *local = timer_wheel_get();
+	if (!local)
+		return POM_ERR;
 
-	if (!t->queue) {
-		pomlog(POMLOG_WARN "Warning, timer %p was already dequeued", t);
-		pom_mutex_unlock(&timer_main_lock);
-		return POM_OK;
+	// A queued timer is rearmed in the wheel which owns it, otherwise it goes in ours
+	struct timer_wheel *w;
+	while (1) {
+		w = t->wheel;
+		if (!w)
+			w = local;
+		pom_mutex_lock(&w->lock);
+		if (t->wheel == w || (!t->wheel && w == local))
+			break;
+		// It was dequeued or moved in the meantime
+		pom_mutex_unlock(&w->lock);
 	}
 
-	if (t->prev) {
-		t->prev->next = t->next;
-	} else {
-		t->queue->head = t->next;
-		if (t->queue->head)
-			t->queue->head->prev = NULL;
+	int queued = 0;
+	if (t->wheel) {
+		timer_slot_remove(w, t);
+		queued = 1;
 	}
 
-	if (t->next) {
-		t->next->prev = t->prev;
-	} else {
-		t->queue->tail = t->prev;
-		if (t->queue->tail)
-			t->queue->tail->next = NULL;
-		
-	}
+	// Don't let an empty wheel start from a tick far in the past or in the future
+	uint64_t now_tick = now / TIMER_WHEEL_TICK;
+	if (w->tick != now_tick && timer_wheel_empty(w))
+		w->tick = now_tick;
 
+	// The clock went back, e.g. a new input was started, the wheel must follow it
+	if (now_tick + TIMER_WHEEL_REBASE_TICKS < w->tick)
+		timer_wheel_rebase(w, now_tick);
 
-	// Make sure this timer will not reference anything
+	t->expires = now + expiry;
+	timer_wheel_add(w, t);
 
-	t->prev = NULL;
-	t->next = NULL;
-	t->queue = NULL;
-	pom_mutex_unlock(&timer_main_lock);
+	pom_mutex_unlock(&w->lock);
+
+	if (!queued)
+		registry_perf_inc(perf_timer_queued, 1);
+
+	return POM_OK;
+}
+
+
+int timer_dequeue(struct timer *t) {
+
+	if (!timer_unlink(t)) {
+		pomlog(POMLOG_WARN "Warning, timer %p was already dequeued", t);
+		return POM_OK;
+	}
 
 	registry_perf_dec(perf_timer_queued, 1);
 
@@ -31,34 +31,58 @@ struct timer_sys {
 	struct timer_sys *prev, *next;
 };
 
+// Duration of a wheel tick in usec
+#define TIMER_WHEEL_TICK	1000UL
+
+// Each level of the wheel has 2^TIMER_WHEEL_BITS slots
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SLOTS	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SLOTS - 1)
+// With 1ms ticks, 5 levels cover a bit more than 12 days
+#define TIMER_WHEEL_LEVELS	5
+
+// Maximum number of ticks a timer can be scheduled ahead without being clamped
+#define TIMER_WHEEL_MAX_TICKS	((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+// Number of ticks a wheel can fall behind before other threads start expiring its timers
+#define TIMER_WHEEL_IDLE_TICKS	100
+
+// Number of ticks the clock can go back before the wheel is rebuilt from that time
+#define TIMER_WHEEL_REBASE_TICKS	1000
+
 struct timer {
 
 	ptime expires;
 	void *priv;
 	int (*handler) (void *, ptime);
-	struct timer_queue *queue;
+	struct timer_wheel *wheel; // Wheel in which the timer is queued, NULL if not queued
+	struct timer_slot *slot;
 	struct timer *next;
 	struct timer *prev;
 
 };
 
-struct timer_queue {
-
-	unsigned int expiry;
-	struct timer_queue *next;
-	struct timer_queue *prev;
+struct timer_slot {
 	struct timer *head;
 	struct timer *tail;
+};
+
+struct timer_wheel {
+
+	pthread_mutex_t lock;
+	uint64_t tick; // Next tick to be processed
+	uint64_t bitmap[TIMER_WHEEL_LEVELS]; // Non empty slots of each level
+	struct timer_slot slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	struct timer_slot expired; // Timers expired but whose handler hasn't been called yet
 
 };
 
 int timers_init();
+void timers_thread_init(unsigned int thread_id);
 int timers_process();
+void timers_reset();
 int timers_cleanup();
 
-void timer_queue_lock(struct timer_queue *q, int write);
-void timer_queue_unlock(struct timer_queue *q);
-
 int timer_sys_process();
 
 #endif
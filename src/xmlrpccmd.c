@@ -26,6 +26,8 @@
 #include "xmlrpccmd_registry.h"
 
 #include "registry.h"
+#include "filter.h"
+#include "profiler.h"
 
 
 #include <pom-ng/ptype_bool.h>
@@ -38,7 +40,7 @@
 
 static struct ptype_reg *pt_bool = NULL, *pt_string = NULL, *pt_timestamp = NULL, *pt_uint8 = NULL, *pt_uint16 = NULL, *pt_uint32 = NULL, *pt_uint64 = NULL;
 
-#define XMLRPCCMD_NUM 3
+#define XMLRPCCMD_NUM 6
 static struct xmlrpcsrv_command xmlrpccmd_commands[XMLRPCCMD_NUM] = {
 
 	{
@@ -62,6 +64,27 @@ static struct xmlrpcsrv_command xmlrpccmd_commands[XMLRPCCMD_NUM] = {
 		.help = "Poll the logs",
 	},
 
+	{
+		.name = "core.reloadFilterSets",
+		.callback_func = xmlrpccmd_core_reload_filter_sets,
+		.signature = "i:",
+		.help = "Reload the files used by the \"in\" filter operator",
+	},
+
+	{
+		.name = "core.getProfile",
+		.callback_func = xmlrpccmd_core_get_profile,
+		.signature = "S:i",
+		.help = "Get the objects which used the most CPU while profiling was enabled",
+	},
+
+	{
+		.name = "core.resetProfile",
+		.callback_func = xmlrpccmd_core_reset_profile,
+		.signature = "i:",
+		.help = "Reset the profiling counters",
+	},
+
 };
 
 
@@ -285,3 +308,70 @@ xmlrpc_value *xmlrpccmd_core_poll_log(xmlrpc_env * const envP, xmlrpc_value * co
 	return res;
 
 }
+
+xmlrpc_value *xmlrpccmd_core_reload_filter_sets(xmlrpc_env * const envP, xmlrpc_value * const paramArrayP, void * const userData) {
+
+	if (filter_set_reload_all() != POM_OK) {
+		xmlrpc_faultf(envP, "Error while reloading some filter sets");
+		return NULL;
+	}
+
+	return xmlrpc_int_new(envP, 0);
+}
+
+xmlrpc_value *xmlrpccmd_core_get_profile(xmlrpc_env * const envP, xmlrpc_value * const paramArrayP, void * const userData) {
+
+	xmlrpc_int32 max = 0;
+	xmlrpc_decompose_value(envP, paramArrayP, "(i)", &max);
+	if (envP->fault_occurred)
+		return NULL;
+
+	if (max < 0)
+		max = 0;
+
+	struct profiler_report *report = profiler_report(max);
+
+	xmlrpc_value *entries = xmlrpc_array_new(envP);
+
+	struct profiler_report *r;
+	for (r = report; r; r = r->next) {
+
+		xmlrpc_value *threads = xmlrpc_array_new(envP);
+		unsigned int i;
+		for (i = 0; i < r->thread_count; i++) {
+			xmlrpc_value *thread = xmlrpc_build_value(envP, "{s:i,s:I,s:I}",
+							"thread", r->threads[i].id,
+							"cycles", r->threads[i].cycles,
+							"calls", r->threads[i].calls);
+			xmlrpc_array_append_item(envP, threads, thread);
+			xmlrpc_DECREF(thread);
+		}
+
+		xmlrpc_value *entry = xmlrpc_build_value(envP, "{s:s,s:s,s:I,s:I,s:A}",
+							"stage", profiler_stage_get_name(r->key.stage),
+							"name", r->key.name,
+							"cycles", r->cycles,
+							"calls", r->calls,
+							"threads", threads);
+		xmlrpc_DECREF(threads);
+		xmlrpc_array_append_item(envP, entries, entry);
+		xmlrpc_DECREF(entry);
+	}
+
+	profiler_report_cleanup(report);
+
+	xmlrpc_value *res = xmlrpc_build_value(envP, "{s:b,s:s,s:A}",
+						"enabled", profiler_enabled,
+						"unit", PROFILER_UNIT,
+						"entries", entries);
+	xmlrpc_DECREF(entries);
+
+	return res;
+}
+
+xmlrpc_value *xmlrpccmd_core_reset_profile(xmlrpc_env * const envP, xmlrpc_value * const paramArrayP, void * const userData) {
+
+	profiler_reset();
+
+	return xmlrpc_int_new(envP, 0);
+}
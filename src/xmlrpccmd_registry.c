@@ -240,6 +240,9 @@ static xmlrpc_value *xmlrpccmd_registry_build_perfs(xmlrpc_env * const envP, str
 			case registry_perf_type_timeticks:
 				type_str = "timeticks";
 				break;
+			case registry_perf_type_histogram:
+				type_str = "histogram";
+				break;
 		}
 		
 		xmlrpc_value *perf = NULL;
@@ -903,6 +906,24 @@ xmlrpc_value *xmlrpccmd_registry_get_perfs(xmlrpc_env * const envP, xmlrpc_value
 			xmlrpc_DECREF(inst_name);
 		}
 
+		if (perf_array[i].perf->type == registry_perf_type_histogram) {
+			struct registry_perf_hist_snapshot *snap = registry_perf_hist_snapshot(perf_array[i].perf);
+			if (snap) {
+				xmlrpc_value *hist = xmlrpc_build_value(envP, "{s:I,s:I,s:I,s:I,s:I,s:I,s:I,s:I}",
+								"count", snap->count,
+								"sum", snap->sum,
+								"max", snap->max,
+								"p50", registry_perf_hist_snapshot_percentile(snap, 50.0),
+								"p90", registry_perf_hist_snapshot_percentile(snap, 90.0),
+								"p99", registry_perf_hist_snapshot_percentile(snap, 99.0),
+								"p999", registry_perf_hist_snapshot_percentile(snap, 99.9),
+								"p9999", registry_perf_hist_snapshot_percentile(snap, 99.99));
+				registry_perf_hist_snapshot_cleanup(snap);
+				xmlrpc_struct_set_value(envP, item, "histogram", hist);
+				xmlrpc_DECREF(hist);
+			}
+		}
+
 		if (time_pkt > 0) {
 			xmlrpc_value *pkt_time = xmlrpc_build_value(envP, "{s:i,s:i}", "sec", pom_ptime_sec(time_pkt), "usec", pom_ptime_usec(time_pkt));
 			xmlrpc_struct_set_value(envP, item, "pkt_time", pkt_time);